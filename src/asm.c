@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "dcpu.h"
+#include "assembler.h"
+#include "image.h"
+
+
+static void
+usage (const char * name)
+{
+  fprintf (stderr, "usage: %s SOURCE [--output IMAGE]\n", name);
+}
+
+
+int main (int argc, char * argv [])
+{
+  static const struct option options [] = {
+    { "output", required_argument, NULL, 'o' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  static word program [RAM_SIZE];
+  const char * output = "-";
+  size_t size = 0;
+  unsigned int errors = 0;
+  FILE * out = NULL;
+  int result = 0;
+  int option = 0;
+
+  while (-1 != (option = getopt_long (argc, argv, "o:", options, NULL)))
+    {
+      switch (option)
+	{
+	case 'o':
+	  output = optarg;
+	  break;
+
+	default:
+	  usage (argv[0]);
+	  return 'h' == option ? 0 : 1;
+	}
+    }
+
+  if (optind + 1 != argc)
+    {
+      usage (argv[0]);
+      return 1;
+    }
+
+  errors = assemble_file (argv[optind], program, &size, stderr);
+  if (0 != errors)
+    {
+      fprintf (stderr, "%u error%s\n", errors, 1 == errors ? "" : "s");
+      return 1;
+    }
+
+  out = 0 == strcmp (output, "-") ? stdout : fopen (output, "wb");
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", output);
+      return 1;
+    }
+
+  result = write_image (out, program, size);
+  if (stdout != out && 0 != fclose (out))
+    {
+      result = 1;
+    }
+  if (0 != result)
+    {
+      fprintf (stderr, "Could not write the image to %s\n", output);
+    }
+
+  return result;
+}
@@ -0,0 +1,1246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "assembler.h"
+
+
+#define NO_SYMBOL ((unsigned int) -1)
+#define NO_REGISTER (-1)
+
+// initial number of symbol table slots, a power of two
+#define SYMBOL_SLOTS 1024
+
+// keywords are compared packed in an integer, upper cased
+#define KEY1(a) ((uint32_t) (a))
+#define KEY2(a, b) ((KEY1 (a) << 8) | (b))
+#define KEY3(a, b, c) ((KEY2 (a, b) << 8) | (c))
+#define KEY4(a, b, c, d) ((KEY3 (a, b, c) << 8) | (d))
+
+static const char register_letters [REGISTER_COUNT] = {
+  'A', 'B', 'C', 'X', 'Y', 'Z', 'I', 'J'
+};
+
+
+typedef struct symbol_t
+{
+  // in the source, which outlives the assembly
+  const char * name;
+  unsigned int length;
+  uint32_t hash;
+
+  // -1 until the label is defined
+  int32_t address;
+  unsigned long line;
+
+} symbol_t;
+
+// a next word holding the value of a label plus addend, filled once
+// all the labels are known
+typedef struct fixup_t
+{
+  size_t position;
+
+  // for a literal operand, the instruction word and the offset of the
+  // operand code in it, to use a short literal if the value allows it
+  // (shift is 0 for the other references)
+  size_t instruction;
+  unsigned char shift;
+  bool shrunk;
+
+  int32_t addend;
+  unsigned int symbol;
+  unsigned long line;
+
+} fixup_t;
+
+typedef struct operand_t
+{
+  unsigned char code;
+
+  // next word, if operand_length (code), before adding the label
+  long next;
+
+  // label whose address is added to next, NO_SYMBOL if none
+  unsigned int symbol;
+
+} operand_t;
+
+typedef struct assembler_t
+{
+  const char * p;
+  const char * end;
+  const char * name;
+  unsigned long line;
+  unsigned int errors;
+  FILE * messages;
+
+  word * program;
+  size_t size;
+
+  // packed names of opcodes[], 0 for BASIC
+  uint32_t mnemonics [16];
+
+  // dense array of the symbols, slots holding index + 1 (0 if empty)
+  symbol_t * symbols;
+  unsigned int symbol_count;
+  unsigned int symbols_allocated;
+  unsigned int * slots;
+  unsigned int slot_mask;
+
+  fixup_t * fixups;
+  size_t fixup_count;
+  size_t fixups_allocated;
+
+} assembler_t;
+
+
+static void
+report (assembler_t * assembler, unsigned long line, const char * format, ...)
+{
+  va_list args;
+
+  ++assembler->errors;
+  if (NULL == assembler->messages)
+    {
+      return;
+    }
+
+  fprintf (assembler->messages, "%s:%lu: ", assembler->name, line);
+  va_start (args, format);
+  vfprintf (assembler->messages, format, args);
+  va_end (args);
+  fputc ('\n', assembler->messages);
+}
+
+
+// the end of the source reads as the end of a line
+static inline char
+peek (const assembler_t * assembler)
+{
+  return assembler->p < assembler->end ? *assembler->p : '\n';
+}
+
+static inline void
+skip_blanks (assembler_t * assembler)
+{
+  while (assembler->p < assembler->end
+	 && (' ' == *assembler->p || '\t' == *assembler->p || '\r' == *assembler->p))
+    {
+      ++assembler->p;
+    }
+}
+
+static inline bool
+is_digit (char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static inline bool
+is_identifier_start (char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || '_' == c || '.' == c;
+}
+
+static inline bool
+is_identifier_char (char c)
+{
+  return is_identifier_start (c) || is_digit (c);
+}
+
+// @return the length of the identifier at p, 0 if there is none
+static inline unsigned int
+read_identifier (assembler_t * assembler, const char ** start)
+{
+  *start = assembler->p;
+  if (! is_identifier_start (peek (assembler)))
+    {
+      return 0;
+    }
+
+  while (assembler->p < assembler->end && is_identifier_char (*assembler->p))
+    {
+      ++assembler->p;
+    }
+
+  return assembler->p - *start;
+}
+
+// @return the packed upper cased letters, 0 if not a possible keyword
+static uint32_t
+keyword (const char * s, unsigned int length)
+{
+  uint32_t key = 0;
+  unsigned int i = 0;
+
+  if (length > 4)
+    {
+      return 0;
+    }
+
+  for (i = 0; i < length; ++i)
+    {
+      char c = s[i];
+
+      if (c >= 'a' && c <= 'z')
+	{
+	  c -= 'a' - 'A';
+	}
+      else if (c < 'A' || c > 'Z')
+	{
+	  return 0;
+	}
+      key = (key << 8) | (unsigned char) c;
+    }
+
+  return key;
+}
+
+// @return the index of the register, NO_REGISTER if key is not one
+static int
+register_index (uint32_t key)
+{
+  int i = 0;
+
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      if (KEY1 (register_letters[i]) == key)
+	{
+	  return i;
+	}
+    }
+
+  return NO_REGISTER;
+}
+
+// @return the operand code of the special registers, 0 if key is not one
+static unsigned char
+special_code (uint32_t key)
+{
+  switch (key)
+    {
+    case KEY3 ('P', 'O', 'P'):
+      return 0x18;
+
+    case KEY4 ('P', 'E', 'E', 'K'):
+      return 0x19;
+
+    case KEY4 ('P', 'U', 'S', 'H'):
+      return 0x1a;
+
+    case KEY2 ('S', 'P'):
+      return 0x1b;
+
+    case KEY2 ('P', 'C'):
+      return 0x1c;
+
+    case KEY1 ('O'):
+      return 0x1d;
+
+    default:
+      return 0;
+    }
+}
+
+
+// open addressing with linear probing, kept at most half full
+static bool
+grow_symbol_slots (assembler_t * assembler)
+{
+  unsigned int capacity = 2 * (assembler->slot_mask + 1);
+  unsigned int * slots = calloc (capacity, sizeof(unsigned int));
+  unsigned int i = 0;
+
+  if (NULL == slots)
+    {
+      return false;
+    }
+
+  for (i = 0; i < assembler->symbol_count; ++i)
+    {
+      unsigned int slot = assembler->symbols[i].hash & (capacity - 1);
+
+      while (0 != slots[slot])
+	{
+	  slot = (slot + 1) & (capacity - 1);
+	}
+      slots[slot] = i + 1;
+    }
+
+  free (assembler->slots);
+  assembler->slots = slots;
+  assembler->slot_mask = capacity - 1;
+
+  return true;
+}
+
+// @return the index of the symbol, added undefined if it was not
+// known, NO_SYMBOL if it could not be allocated
+static unsigned int
+find_symbol (assembler_t * assembler, const char * name, unsigned int length)
+{
+  uint32_t hash = 2166136261u;
+  unsigned int slot = 0;
+  unsigned int i = 0;
+  symbol_t * symbol = NULL;
+
+  // FNV-1a
+  for (i = 0; i < length; ++i)
+    {
+      hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+  for (slot = hash & assembler->slot_mask;
+       0 != assembler->slots[slot];
+       slot = (slot + 1) & assembler->slot_mask)
+    {
+      symbol = &assembler->symbols[assembler->slots[slot] - 1];
+      if (symbol->hash == hash
+	  && symbol->length == length
+	  && 0 == memcmp (symbol->name, name, length))
+	{
+	  return assembler->slots[slot] - 1;
+	}
+    }
+
+  if (assembler->symbol_count == assembler->symbols_allocated)
+    {
+      unsigned int allocated = 2 * assembler->symbols_allocated;
+      symbol_t * symbols = realloc (assembler->symbols, allocated * sizeof(symbol_t));
+
+      if (NULL == symbols)
+	{
+	  return NO_SYMBOL;
+	}
+      assembler->symbols = symbols;
+      assembler->symbols_allocated = allocated;
+    }
+
+  if (2 * (assembler->symbol_count + 1) > assembler->slot_mask + 1)
+    {
+      if (! grow_symbol_slots (assembler))
+	{
+	  return NO_SYMBOL;
+	}
+      for (slot = hash & assembler->slot_mask;
+	   0 != assembler->slots[slot];
+	   slot = (slot + 1) & assembler->slot_mask)
+	{
+	}
+    }
+
+  symbol = &assembler->symbols[assembler->symbol_count];
+  symbol->name = name;
+  symbol->length = length;
+  symbol->hash = hash;
+  symbol->address = -1;
+  symbol->line = 0;
+
+  assembler->slots[slot] = ++assembler->symbol_count;
+
+  return assembler->symbol_count - 1;
+}
+
+static bool
+define_label (assembler_t * assembler, const char * name, unsigned int length)
+{
+  unsigned int index = find_symbol (assembler, name, length);
+  symbol_t * symbol = NULL;
+
+  if (NO_SYMBOL == index)
+    {
+      report (assembler, assembler->line, "out of memory");
+      return false;
+    }
+
+  symbol = &assembler->symbols[index];
+  if (symbol->address >= 0)
+    {
+      report (assembler
+	      , assembler->line
+	      , "label '%.*s' already defined on line %lu"
+	      , (int) length
+	      , name
+	      , symbol->line);
+      return false;
+    }
+
+  symbol->address = (int32_t) assembler->size;
+  symbol->line = assembler->line;
+
+  return true;
+}
+
+
+static void
+emit (assembler_t * assembler, word value)
+{
+  if (assembler->size == RAM_SIZE)
+    {
+      // reported once, when the program gets one word too many
+      report (assembler, assembler->line, "program does not fit in ram");
+      ++assembler->size;
+      return;
+    }
+  if (assembler->size > RAM_SIZE)
+    {
+      return;
+    }
+
+  assembler->program[assembler->size++] = value;
+}
+
+// emits a next word, value plus the address of symbol if it is not
+// NO_SYMBOL (see fixup_t for instruction and shift)
+static void
+emit_relative (assembler_t * assembler
+	       , long value
+	       , unsigned int symbol
+	       , size_t instruction
+	       , unsigned char shift)
+{
+  fixup_t * fixup = NULL;
+
+  emit (assembler, (word) value);
+
+  if (NO_SYMBOL == symbol || assembler->size > RAM_SIZE)
+    {
+      return;
+    }
+
+  if (assembler->fixup_count == assembler->fixups_allocated)
+    {
+      size_t allocated = 0 == assembler->fixups_allocated
+	? 1024
+	: 2 * assembler->fixups_allocated;
+      fixup_t * fixups = realloc (assembler->fixups, allocated * sizeof(fixup_t));
+
+      if (NULL == fixups)
+	{
+	  report (assembler, assembler->line, "out of memory");
+	  return;
+	}
+      assembler->fixups = fixups;
+      assembler->fixups_allocated = allocated;
+    }
+
+  fixup = &assembler->fixups[assembler->fixup_count++];
+  fixup->position = assembler->size - 1;
+  fixup->instruction = instruction;
+  fixup->shift = shift;
+  fixup->shrunk = false;
+  fixup->addend = (int32_t) value;
+  fixup->symbol = symbol;
+  fixup->line = assembler->line;
+}
+
+
+static bool
+parse_number (assembler_t * assembler, long * value)
+{
+  unsigned long number = 0;
+  unsigned int base = 10;
+  bool digits = false;
+
+  if ('0' == peek (assembler) && assembler->p + 1 < assembler->end)
+    {
+      char c = assembler->p[1];
+
+      if ('x' == c || 'X' == c)
+	{
+	  base = 16;
+	  assembler->p += 2;
+	}
+      else if ('b' == c || 'B' == c)
+	{
+	  base = 2;
+	  assembler->p += 2;
+	}
+    }
+
+  for (;;)
+    {
+      char c = peek (assembler);
+      unsigned int digit = 0;
+
+      if (is_digit (c))
+	{
+	  digit = c - '0';
+	}
+      else if (c >= 'a' && c <= 'f')
+	{
+	  digit = c - 'a' + 10;
+	}
+      else if (c >= 'A' && c <= 'F')
+	{
+	  digit = c - 'A' + 10;
+	}
+      else
+	{
+	  break;
+	}
+
+      if (digit >= base)
+	{
+	  break;
+	}
+
+      // saturates, anything above a word is out of range anyway
+      number = number * base + digit;
+      if (number > 0x10000)
+	{
+	  number = 0x10000;
+	}
+      digits = true;
+      ++assembler->p;
+    }
+
+  if (! digits || is_identifier_char (peek (assembler)))
+    {
+      report (assembler, assembler->line, "malformed number");
+      return false;
+    }
+
+  *value = (long) number;
+  return true;
+}
+
+/**
+ * Parses terms added or subtracted together: numbers, at most one
+ * label and, between brackets, at most one register.
+ *
+ * @param index set to the register, NO_REGISTER if none (NULL if no
+ * register is allowed)
+ */
+static bool
+parse_sum (assembler_t * assembler
+	   , long * value
+	   , unsigned int * symbol
+	   , int * index)
+{
+  bool negative = false;
+
+  *value = 0;
+  *symbol = NO_SYMBOL;
+  if (NULL != index)
+    {
+      *index = NO_REGISTER;
+    }
+
+  skip_blanks (assembler);
+  if ('-' == peek (assembler))
+    {
+      negative = true;
+      ++assembler->p;
+    }
+
+  for (;;)
+    {
+      const char * start = NULL;
+      unsigned int length = 0;
+      char c = 0;
+
+      skip_blanks (assembler);
+      c = peek (assembler);
+
+      if (is_digit (c))
+	{
+	  long number = 0;
+
+	  if (! parse_number (assembler, &number))
+	    {
+	      return false;
+	    }
+	  *value += negative ? -number : number;
+	}
+      else if (0 != (length = read_identifier (assembler, &start)))
+	{
+	  uint32_t key = keyword (start, length);
+	  int i = register_index (key);
+
+	  if (NO_REGISTER != i && NULL != index)
+	    {
+	      if (negative || NO_REGISTER != *index)
+		{
+		  report (assembler, assembler->line, "a single register can be added");
+		  return false;
+		}
+	      *index = i;
+	    }
+	  else if (NO_REGISTER != i || 0 != special_code (key))
+	    {
+	      report (assembler
+		      , assembler->line
+		      , "unexpected '%.*s' in expression"
+		      , (int) length
+		      , start);
+	      return false;
+	    }
+	  else
+	    {
+	      if (negative || NO_SYMBOL != *symbol)
+		{
+		  report (assembler, assembler->line, "a single label can be added");
+		  return false;
+		}
+	      *symbol = find_symbol (assembler, start, length);
+	      if (NO_SYMBOL == *symbol)
+		{
+		  report (assembler, assembler->line, "out of memory");
+		  return false;
+		}
+	    }
+	}
+      else
+	{
+	  report (assembler, assembler->line, "expected a value");
+	  return false;
+	}
+
+      skip_blanks (assembler);
+      c = peek (assembler);
+      if ('+' != c && '-' != c)
+	{
+	  break;
+	}
+      negative = '-' == c;
+      ++assembler->p;
+    }
+
+  if (*value < -0x8000 || *value > 0xffff)
+    {
+      report (assembler, assembler->line, "value out of range");
+      return false;
+    }
+
+  return true;
+}
+
+static bool
+parse_operand (assembler_t * assembler, operand_t * operand)
+{
+  long value = 0;
+  int index = NO_REGISTER;
+
+  operand->symbol = NO_SYMBOL;
+  operand->next = 0;
+
+  skip_blanks (assembler);
+
+  if ('[' == peek (assembler))
+    {
+      ++assembler->p;
+      if (! parse_sum (assembler, &value, &operand->symbol, &index))
+	{
+	  return false;
+	}
+      if (']' != peek (assembler))
+	{
+	  report (assembler, assembler->line, "expected ']'");
+	  return false;
+	}
+      ++assembler->p;
+
+      if (NO_REGISTER == index)
+	{
+	  operand->code = 0x1e;
+	}
+      else if (0 == value && NO_SYMBOL == operand->symbol)
+	{
+	  operand->code = 0x08 + index;
+	}
+      else
+	{
+	  operand->code = 0x10 + index;
+	}
+      operand->next = value;
+
+      return true;
+    }
+
+  if (is_identifier_start (peek (assembler)))
+    {
+      const char * start = NULL;
+      unsigned int length = read_identifier (assembler, &start);
+      uint32_t key = keyword (start, length);
+      int i = register_index (key);
+
+      if (NO_REGISTER != i)
+	{
+	  operand->code = i;
+	  return true;
+	}
+      if (0 != (operand->code = special_code (key)))
+	{
+	  return true;
+	}
+
+      // a label, parsed again as a sum
+      assembler->p = start;
+    }
+
+  if (! parse_sum (assembler, &value, &operand->symbol, NULL))
+    {
+      return false;
+    }
+
+  if (NO_SYMBOL == operand->symbol && value >= 0 && value <= 0x1f)
+    {
+      operand->code = 0x20 + value;
+    }
+  else
+    {
+      operand->code = 0x1f;
+      operand->next = value;
+    }
+
+  return true;
+}
+
+// @param shift of the operand code in the instruction word, just emitted
+static void
+emit_next_word (assembler_t * assembler
+		, const operand_t * operand
+		, size_t instruction
+		, unsigned char shift)
+{
+  if (operand_length (operand->code))
+    {
+      emit_relative (assembler
+		     , operand->next
+		     , operand->symbol
+		     , instruction
+		     , 0x1f == operand->code ? shift : 0);
+    }
+}
+
+
+static bool
+parse_string (assembler_t * assembler)
+{
+  ++assembler->p;
+
+  for (;;)
+    {
+      char c = peek (assembler);
+
+      if ('\n' == c)
+	{
+	  report (assembler, assembler->line, "unterminated string");
+	  return false;
+	}
+      ++assembler->p;
+
+      if ('"' == c)
+	{
+	  return true;
+	}
+      if ('\\' == c)
+	{
+	  c = peek (assembler);
+	  switch (c)
+	    {
+	    case 'n':
+	      c = '\n';
+	      break;
+
+	    case 't':
+	      c = '\t';
+	      break;
+
+	    case '0':
+	      c = '\0';
+	      break;
+
+	    case '\\':
+	    case '"':
+	      break;
+
+	    default:
+	      report (assembler, assembler->line, "unknown escape sequence");
+	      return false;
+	    }
+	  ++assembler->p;
+	}
+
+      emit (assembler, (unsigned char) c);
+    }
+}
+
+static bool
+parse_data (assembler_t * assembler)
+{
+  for (;;)
+    {
+      skip_blanks (assembler);
+
+      if ('"' == peek (assembler))
+	{
+	  if (! parse_string (assembler))
+	    {
+	      return false;
+	    }
+	}
+      else
+	{
+	  long value = 0;
+	  unsigned int symbol = NO_SYMBOL;
+
+	  if (! parse_sum (assembler, &value, &symbol, NULL))
+	    {
+	      return false;
+	    }
+	  emit_relative (assembler, value, symbol, 0, 0);
+	}
+
+      skip_blanks (assembler);
+      if (',' != peek (assembler))
+	{
+	  return true;
+	}
+      ++assembler->p;
+    }
+}
+
+static bool
+parse_instruction (assembler_t * assembler, const char * mnemonic, unsigned int length)
+{
+  uint32_t key = keyword (mnemonic, length);
+  operand_t a;
+  operand_t b;
+  unsigned char opcode = 0;
+
+  if (KEY3 ('D', 'A', 'T') == key)
+    {
+      return parse_data (assembler);
+    }
+
+  if (KEY3 ('J', 'S', 'R') == key)
+    {
+      if (! parse_operand (assembler, &a))
+	{
+	  return false;
+	}
+      emit (assembler, (word) ((0x01 << 4) | (a.code << 10)));
+      emit_next_word (assembler, &a, assembler->size - 1, 10);
+      return true;
+    }
+
+  for (opcode = 1; opcode < 16; ++opcode)
+    {
+      if (0 != key && assembler->mnemonics[opcode] == key)
+	{
+	  break;
+	}
+    }
+  if (16 == opcode)
+    {
+      report (assembler
+	      , assembler->line
+	      , "unknown instruction '%.*s'"
+	      , (int) length
+	      , mnemonic);
+      return false;
+    }
+
+  if (! parse_operand (assembler, &a))
+    {
+      return false;
+    }
+  skip_blanks (assembler);
+  if (',' != peek (assembler))
+    {
+      report (assembler, assembler->line, "expected ','");
+      return false;
+    }
+  ++assembler->p;
+  if (! parse_operand (assembler, &b))
+    {
+      return false;
+    }
+
+  emit (assembler, (word) (opcode | (a.code << 4) | (b.code << 10)));
+  emit_next_word (assembler, &a, assembler->size - 1, 4);
+  emit_next_word (assembler, &b, assembler->size - 1 - operand_length (a.code), 10);
+
+  return true;
+}
+
+static bool
+parse_line (assembler_t * assembler)
+{
+  const char * start = NULL;
+  unsigned int length = 0;
+
+  skip_blanks (assembler);
+
+  if (':' == peek (assembler))
+    {
+      ++assembler->p;
+      if (0 == (length = read_identifier (assembler, &start)))
+	{
+	  report (assembler, assembler->line, "expected a label name");
+	  return false;
+	}
+      if (! define_label (assembler, start, length))
+	{
+	  return false;
+	}
+      skip_blanks (assembler);
+    }
+
+  if (0 == (length = read_identifier (assembler, &start)))
+    {
+      return true;
+    }
+
+  if (':' == peek (assembler))
+    {
+      ++assembler->p;
+      if (! define_label (assembler, start, length))
+	{
+	  return false;
+	}
+      skip_blanks (assembler);
+      if (0 == (length = read_identifier (assembler, &start)))
+	{
+	  return true;
+	}
+    }
+
+  return parse_instruction (assembler, start, length);
+}
+
+// @return the number of next words dropped before address, according to
+// the fixups already shrunk (removed holding their running count)
+static size_t
+removed_before (const assembler_t * assembler, const size_t removed [], size_t address)
+{
+  size_t low = 0;
+  size_t high = assembler->fixup_count;
+
+  // first fixup at or after address, fixups are in emission order
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+
+      if (assembler->fixups[middle].position < address)
+	{
+	  low = middle + 1;
+	}
+      else
+	{
+	  high = middle;
+	}
+    }
+
+  return removed[low];
+}
+
+static void
+count_removed (const assembler_t * assembler, size_t removed [])
+{
+  size_t i = 0;
+
+  removed[0] = 0;
+  for (i = 0; i < assembler->fixup_count; ++i)
+    {
+      removed[i + 1] = removed[i] + assembler->fixups[i].shrunk;
+    }
+}
+
+/**
+ * Turns the literal label operands whose value fits in a short literal
+ * into one, dropping their next word, and fills the other fixups.
+ *
+ * Every literal with a non negative addend starts short (negative
+ * addends keep their next word), the ones that do not fit getting
+ * their next word back. That moves the labels after them up, which may
+ * make other literals too large: this is repeated until nothing
+ * changes. Addresses only ever increase, so the literals are never
+ * shrunk again and this ends with the most short literals that fit,
+ * including the ones that only fit once their own next word is gone.
+ */
+static void
+relax (assembler_t * assembler)
+{
+  size_t * removed = malloc ((assembler->fixup_count + 1) * sizeof(size_t));
+  bool changed = true;
+  size_t i = 0;
+  size_t read = 0;
+  size_t write = 0;
+
+  if (NULL == removed)
+    {
+      report (assembler, assembler->line, "out of memory");
+      return;
+    }
+
+  for (i = 0; i < assembler->fixup_count; ++i)
+    {
+      fixup_t * fixup = &assembler->fixups[i];
+
+      fixup->shrunk = 0 != fixup->shift && fixup->addend >= 0;
+    }
+
+  while (changed)
+    {
+      changed = false;
+      count_removed (assembler, removed);
+
+      // the counts are not updated within a pass, the addresses are
+      // under estimated: a literal still fitting may not at the next
+      // pass, never the other way around
+      for (i = 0; i < assembler->fixup_count; ++i)
+	{
+	  fixup_t * fixup = &assembler->fixups[i];
+	  int32_t address = assembler->symbols[fixup->symbol].address;
+
+	  if (fixup->shrunk)
+	    {
+	      int32_t value = address
+		- (int32_t) removed_before (assembler, removed, address)
+		+ fixup->addend;
+
+	      if (value > 0x1f)
+		{
+		  fixup->shrunk = false;
+		  changed = true;
+		}
+	    }
+	}
+    }
+
+  count_removed (assembler, removed);
+
+  for (i = 0; i < assembler->fixup_count; ++i)
+    {
+      const fixup_t * fixup = &assembler->fixups[i];
+      int32_t address = assembler->symbols[fixup->symbol].address;
+      word value = (word) (address
+			   - (int32_t) removed_before (assembler, removed, address)
+			   + fixup->addend);
+
+      if (fixup->shrunk)
+	{
+	  assembler->program[fixup->instruction] &= ~(0x3f << fixup->shift);
+	  assembler->program[fixup->instruction] |= (0x20 + value) << fixup->shift;
+	}
+      else
+	{
+	  assembler->program[fixup->position] = value;
+	}
+    }
+
+  // drops the next words of the short literals
+  for (i = 0, read = 0; read < assembler->size; ++read)
+    {
+      while (i < assembler->fixup_count && assembler->fixups[i].position < read)
+	{
+	  ++i;
+	}
+      if (i < assembler->fixup_count
+	  && assembler->fixups[i].position == read
+	  && assembler->fixups[i].shrunk)
+	{
+	  continue;
+	}
+      assembler->program[write++] = assembler->program[read];
+    }
+  assembler->size = write;
+
+  free (removed);
+}
+
+
+// moves past the end of the current line
+static void
+skip_line (assembler_t * assembler)
+{
+  const char * newline = memchr (assembler->p, '\n', assembler->end - assembler->p);
+
+  assembler->p = NULL == newline ? assembler->end : newline + 1;
+  ++assembler->line;
+}
+
+
+unsigned int
+assemble (const char * source
+	  , size_t length
+	  , const char * name
+	  , word program []
+	  , size_t * size
+	  , FILE * errors)
+{
+  assembler_t assembler;
+  size_t i = 0;
+
+  memset (&assembler, 0, sizeof(assembler));
+  assembler.p = source;
+  assembler.end = source + length;
+  assembler.name = name;
+  assembler.line = 1;
+  assembler.messages = errors;
+  assembler.program = program;
+
+  for (i = 1; i < 16; ++i)
+    {
+      assembler.mnemonics[i] = keyword (opcodes[i].name, strlen (opcodes[i].name));
+    }
+
+  assembler.symbols_allocated = SYMBOL_SLOTS / 2;
+  assembler.symbols = malloc (assembler.symbols_allocated * sizeof(symbol_t));
+  assembler.slots = calloc (SYMBOL_SLOTS, sizeof(unsigned int));
+  assembler.slot_mask = SYMBOL_SLOTS - 1;
+  if (NULL == assembler.symbols || NULL == assembler.slots)
+    {
+      free (assembler.symbols);
+      free (assembler.slots);
+      report (&assembler, 0, "out of memory");
+      return assembler.errors;
+    }
+
+  while (assembler.p < assembler.end)
+    {
+      if (parse_line (&assembler))
+	{
+	  char c = 0;
+
+	  skip_blanks (&assembler);
+	  c = peek (&assembler);
+	  if ('\n' != c && ';' != c)
+	    {
+	      report (&assembler, assembler.line, "unexpected '%c'", c);
+	    }
+	}
+      skip_line (&assembler);
+    }
+
+  for (i = 0; i < assembler.fixup_count; ++i)
+    {
+      const fixup_t * fixup = &assembler.fixups[i];
+      const symbol_t * symbol = &assembler.symbols[fixup->symbol];
+
+      if (symbol->address < 0)
+	{
+	  report (&assembler
+		  , fixup->line
+		  , "undefined label '%.*s'"
+		  , (int) symbol->length
+		  , symbol->name);
+	}
+    }
+
+  if (0 == assembler.errors)
+    {
+      relax (&assembler);
+    }
+
+  free (assembler.fixups);
+  free (assembler.slots);
+  free (assembler.symbols);
+
+  *size = assembler.size > RAM_SIZE ? RAM_SIZE : assembler.size;
+
+  return assembler.errors;
+}
+
+
+// reads a whole stream in memory, @return the malloc'ed text or NULL
+static char *
+read_stream (int fd, size_t * length)
+{
+  size_t capacity = 64 * 1024;
+  char * text = malloc (capacity);
+  ssize_t count = 0;
+
+  *length = 0;
+  while (NULL != text
+	 && 0 < (count = read (fd, text + *length, capacity - *length)))
+    {
+      *length += count;
+      if (*length == capacity)
+	{
+	  char * grown = realloc (text, capacity *= 2);
+
+	  if (NULL == grown)
+	    {
+	      free (text);
+	      return NULL;
+	    }
+	  text = grown;
+	}
+    }
+
+  if (count < 0)
+    {
+      free (text);
+      return NULL;
+    }
+
+  return text;
+}
+
+unsigned int
+assemble_file (const char * path
+	       , word program []
+	       , size_t * size
+	       , FILE * errors)
+{
+  int fd = 0 == strcmp (path, "-") ? STDIN_FILENO : open (path, O_RDONLY);
+  struct stat status;
+  unsigned int result = 0;
+  char * text = NULL;
+  size_t length = 0;
+
+  if (fd < 0)
+    {
+      if (NULL != errors)
+	{
+	  fprintf (errors, "%s: could not open\n", path);
+	}
+      return 1;
+    }
+
+  if (0 == fstat (fd, &status) && S_ISREG (status.st_mode) && status.st_size > 0)
+    {
+      void * mapped = mmap (NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (MAP_FAILED != mapped)
+	{
+	  madvise (mapped, status.st_size, MADV_SEQUENTIAL);
+	  result = assemble (mapped, status.st_size, path, program, size, errors);
+	  munmap (mapped, status.st_size);
+	  if (STDIN_FILENO != fd)
+	    {
+	      close (fd);
+	    }
+	  return result;
+	}
+    }
+
+  // not a regular file (or mapping failed), read through
+  text = read_stream (fd, &length);
+  if (STDIN_FILENO != fd)
+    {
+      close (fd);
+    }
+  if (NULL == text)
+    {
+      if (NULL != errors)
+	{
+	  fprintf (errors, "%s: could not read\n", path);
+	}
+      return 1;
+    }
+
+  result = assemble (text, length, path, program, size, errors);
+  free (text);
+
+  return result;
+}
@@ -0,0 +1,42 @@
+#if ! defined (ASSEMBLER_H)
+#define ASSEMBLER_H
+
+#include <stdio.h>
+
+#include "dcpu.h"
+
+/**
+ * Assembles DCPU-16 source in a single pass, the references to labels
+ * being patched once the whole source is read. Literals use the short
+ * form (0 to 31 in the operand code) whenever their value fits,
+ * including label values once the layout is settled.
+ *
+ * The syntax is the usual one: ':label' (or 'label:') definitions,
+ * ';' comments, the mnemonics of opcodes[] plus JSR and DAT, registers,
+ * POP, PEEK, PUSH, SP, PC, O, '[...]' references and literals made of
+ * decimal, 0x or 0b numbers and at most one label added together.
+ *
+ * @param source the text, not necessarily nul terminated
+ * @param name of the source in the error messages
+ * @param program RAM_SIZE words receiving the assembled image
+ * @param size set to the number of words of the image
+ * @param errors where the error messages are written, NULL for none
+ * @return the number of errors, 0 if the image is valid
+ */
+unsigned int assemble (const char * source
+		       , size_t length
+		       , const char * name
+		       , word program []
+		       , size_t * size
+		       , FILE * errors);
+
+/**
+ * Same as assemble for a file ("-" for stdin), which is mapped in
+ * memory rather than read when possible.
+ */
+unsigned int assemble_file (const char * path
+			    , word program []
+			    , size_t * size
+			    , FILE * errors);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "assembler.h"
+
+// checks the images of sources whose label literals only fit in the
+// short form once the layout is settled
+
+typedef struct case_t
+{
+  const char * name;
+  const char * source;
+  const word * expected;
+  // in words
+  size_t size;
+
+} case_t;
+
+
+// Notch's sample, every label but the 0x20 literal made short
+static const char notch_source [] =
+  "; Try some basic stuff\n"
+  "        SET A, 0x30\n"
+  "        SET [0x1000], 0x20\n"
+  "        SUB A, [0x1000]\n"
+  "        IFN A, 0x10\n"
+  "           SET PC, crash\n"
+  "; Do a loopy thing\n"
+  "        SET I, 10\n"
+  "        SET A, 0x2000\n"
+  ":loop   SET [0x2000+I], [A]\n"
+  "        SUB I, 1\n"
+  "        IFN I, 0\n"
+  "           SET PC, loop\n"
+  "; Call a subroutine\n"
+  "        SET X, 0x4\n"
+  "        JSR testsub\n"
+  "        SET PC, crash\n"
+  ":testsub SHL X, 4\n"
+  "        SET PC, POP\n"
+  "; Hang forever. X should now be 0x40 if everything went right.\n"
+  ":crash  SET PC, crash\n";
+
+static const word notch_image [] = {
+  0x7c01, 0x0030, 0x7de1, 0x1000, 0x0020, 0x7803, 0x1000, 0xc00d,
+  0xd9c1, 0xa861, 0x7c01, 0x2000, 0x2161, 0x2000, 0x8463, 0x806d,
+  0xb1c1, 0x9031, 0xd010, 0xd9c1, 0x9037, 0x61c1, 0xd9c1
+};
+
+// 'end' is at 0x20 with a next word for the first jump, 0x1f without
+static const char own_word_source [] =
+  "        SET PC, end\n"
+  "        DAT 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0\n"
+  "        DAT 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0\n"
+  ":end    SET PC, end\n";
+
+static const word own_word_image [] = {
+  0xfdc1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xfdc1
+};
+
+// backward and forward labels on both sides of 0x1f, which keep their
+// next word
+static const char far_source [] =
+  ":start  SET PC, far\n"
+  "        DAT 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0\n"
+  "        DAT 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0\n"
+  ":far    SET PC, start\n"
+  "        SET PC, far\n";
+
+static const word far_image [] = {
+  0x7dc1, 0x0021, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0x81c1, 0x7dc1, 0x0021
+};
+
+#define DEFINE_CASE(c) { #c, c##_source, c##_image, sizeof(c##_image) / sizeof(word) }
+
+static const case_t cases [] = {
+  DEFINE_CASE(notch)
+  , DEFINE_CASE(own_word)
+  , DEFINE_CASE(far)
+};
+
+#undef DEFINE_CASE
+
+
+int
+main (void)
+{
+  static word program [RAM_SIZE];
+  unsigned int failures = 0;
+  size_t c = 0;
+
+  for (c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    {
+      const case_t * test = &cases[c];
+      size_t size = 0;
+
+      memset (program, 0, sizeof(program));
+      if (0 != assemble (test->source
+			 , strlen (test->source)
+			 , test->name
+			 , program
+			 , &size
+			 , stderr))
+	{
+	  fprintf (stderr, "%s: not assembled\n", test->name);
+	  ++failures;
+	}
+      else if (size != test->size
+	       || 0 != memcmp (program, test->expected, size * sizeof(word)))
+	{
+	  fprintf (stderr, "%s: %zu words, not the expected image of %zu\n"
+		   , test->name
+		   , size
+		   , test->size);
+	  ++failures;
+	}
+    }
+
+  printf ("%u failures over %zu sources\n"
+	  , failures
+	  , sizeof(cases) / sizeof(cases[0]));
+
+  return 0 == failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "threaded.h"
+#include "lockstep.h"
+#include "snapshot.h"
+#include "jit/jit.h"
+
+
+// each worker owns a range of instances: it takes them one at a time
+// from the front, idle workers steal the back half of the others'
+typedef struct worker_t
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  unsigned int next;
+  unsigned int end;
+
+  unsigned int index;
+  unsigned int count;
+  struct worker_t * workers;
+  batch_t * batch;
+
+  // instances this worker ran, its own or stolen ones
+  unsigned int completed;
+  // could not allocate its cpu or engine, its range is left to the
+  // others to steal
+  bool failed;
+
+} worker_t;
+
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+
+uint64_t
+digest (const void * data, size_t size)
+{
+  const unsigned char * bytes = data;
+  uint64_t hash = FNV_OFFSET_BASIS;
+  size_t i = 0;
+
+  // 8 bytes per multiply: byte per byte, hashing the ram of every
+  // instance costs more than running small budgets
+  for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+      uint64_t chunk = 0;
+      memcpy (&chunk, &bytes[i], sizeof(chunk));
+      hash ^= chunk;
+      hash *= FNV_PRIME;
+    }
+
+  for (; i < size; ++i)
+    {
+      hash ^= bytes[i];
+      hash *= FNV_PRIME;
+    }
+
+  return hash;
+}
+
+
+// takes up to 'max' consecutive instances
+static unsigned int
+take_instances (worker_t * worker, unsigned int max, unsigned int * first)
+{
+  unsigned int count = 0;
+
+  pthread_mutex_lock (&worker->lock);
+  count = worker->end - worker->next;
+  if (count > max)
+    {
+      count = max;
+    }
+  *first = worker->next;
+  worker->next += count;
+  pthread_mutex_unlock (&worker->lock);
+
+  return count;
+}
+
+
+// moves the back half of a victim's range to the (empty) thief's range
+static bool
+steal_instances (worker_t * thief)
+{
+  unsigned int i = 0;
+
+  for (i = 1; i < thief->count; ++i)
+    {
+      worker_t * victim = &thief->workers[(thief->index + i) % thief->count];
+      unsigned int begin = 0;
+      unsigned int end = 0;
+
+      pthread_mutex_lock (&victim->lock);
+      if (victim->next < victim->end)
+	{
+	  end = victim->end;
+	  begin = end - (end - victim->next + 1) / 2;
+	  victim->end = begin;
+	}
+      pthread_mutex_unlock (&victim->lock);
+
+      if (begin < end)
+	{
+	  pthread_mutex_lock (&thief->lock);
+	  thief->next = begin;
+	  thief->end = end;
+	  pthread_mutex_unlock (&thief->lock);
+	  return true;
+	}
+    }
+
+  return false;
+}
+
+
+// @return the state every instance of the worker starts from, the
+// image being loaded once per worker
+static dcpu_snapshot_t *
+load_image_snapshot (batch_t * batch, dcpu_t * cpu)
+{
+  memset (cpu, 0, sizeof(*cpu));
+  memcpy (cpu->ram, batch->image, batch->image_size * sizeof(word));
+  mark_all_dirty (cpu);
+  cpu->sp = RAM_SIZE - 1;
+
+  return dcpu_snapshot (cpu);
+}
+
+
+// only the pages the previous instance wrote are copied back
+static void
+prepare_instance (batch_t * batch
+		  , dcpu_t * cpu
+		  , dcpu_snapshot_t * image
+		  , unsigned int instance)
+{
+  uint32_t seed = batch->seed + instance;
+
+  dcpu_restore (cpu, image);
+  cpu->registers[0] = (word) seed;
+  cpu->registers[1] = (word) (seed >> 16);
+
+  if (NULL != batch->setup)
+    {
+      batch->setup (cpu, instance, batch->setup_data);
+      // wherever it wrote
+      mark_all_dirty (cpu);
+    }
+}
+
+
+static void
+store_result (batch_result_t * result
+	      , const dcpu_t * cpu
+	      , unsigned long long executed)
+{
+  result->executed = executed;
+  result->pc = cpu->pc;
+  result->sp = cpu->sp;
+  result->o = cpu->o;
+  memcpy (result->registers, cpu->registers, sizeof(result->registers));
+  result->ram_digest = digest (cpu->ram, sizeof(cpu->ram));
+}
+
+
+static void
+run_instance (batch_t * batch
+	      , dcpu_t * cpu
+	      , dcpu_snapshot_t * image
+	      , jit_t * jit
+	      , unsigned int instance)
+{
+  unsigned long long executed = 0;
+
+  prepare_instance (batch, cpu, image, instance);
+
+  if (BATCH_ENGINE_JIT == batch->engine)
+    {
+      // blocks translated for the previous instances stay valid
+      // as long as the ram they come from is unchanged
+      executed = run_jit (jit, cpu, batch->budget);
+    }
+  else
+    {
+      executed = run_threaded (cpu, batch->budget);
+    }
+
+  store_result (&batch->results[instance], cpu, executed);
+}
+
+
+// digest() of the ram of each lane, without gathering it in a dcpu_t
+static void
+digest_lanes (const lockstep_t * lockstep
+	      , unsigned int count
+	      , uint64_t digests [])
+{
+  unsigned int address = 0;
+  unsigned int lane = 0;
+
+  for (lane = 0; lane < count; ++lane)
+    {
+      digests[lane] = FNV_OFFSET_BASIS;
+    }
+
+  for (address = 0; address < RAM_SIZE; address += 4)
+    {
+      for (lane = 0; lane < count; ++lane)
+	{
+	  word words [4] = {
+	    lockstep->ram[address][lane]
+	    , lockstep->ram[address + 1][lane]
+	    , lockstep->ram[address + 2][lane]
+	    , lockstep->ram[address + 3][lane]
+	  };
+	  uint64_t chunk = 0;
+
+	  memcpy (&chunk, words, sizeof(chunk));
+	  digests[lane] = (digests[lane] ^ chunk) * FNV_PRIME;
+	}
+    }
+}
+
+
+// runs consecutive instances as the lanes of a lockstep group
+static void
+run_group (batch_t * batch
+	   , dcpu_t * cpu
+	   , dcpu_snapshot_t * image
+	   , lockstep_t * lockstep
+	   , unsigned int first
+	   , unsigned int count)
+{
+  unsigned long long executed [LOCKSTEP_LANES];
+  uint64_t digests [LOCKSTEP_LANES];
+  unsigned int lane = 0;
+
+  if (NULL == batch->setup)
+    {
+      // only the seed differs from one lane to the other
+      lockstep_reset (lockstep, batch->image, batch->image_size);
+      for (lane = 0; lane < count; ++lane)
+	{
+	  uint32_t seed = batch->seed + first + lane;
+	  lockstep->registers[0][lane] = (word) seed;
+	  lockstep->registers[1][lane] = (word) (seed >> 16);
+	}
+    }
+  else
+    {
+      for (lane = 0; lane < count; ++lane)
+	{
+	  prepare_instance (batch, cpu, image, first + lane);
+	  lockstep_load (lockstep, lane, cpu);
+	}
+    }
+
+  run_lockstep (lockstep, count, batch->budget, executed);
+
+  digest_lanes (lockstep, count, digests);
+  for (lane = 0; lane < count; ++lane)
+    {
+      batch_result_t * result = &batch->results[first + lane];
+      unsigned char i = 0;
+
+      result->executed = executed[lane];
+      result->pc = lockstep->pc[lane];
+      result->sp = lockstep->sp[lane];
+      result->o = lockstep->o[lane];
+      for (i = 0; i < REGISTER_COUNT; ++i)
+	{
+	  result->registers[i] = lockstep->registers[i][lane];
+	}
+      result->ram_digest = digests[lane];
+    }
+}
+
+
+static void *
+run_worker (void * argument)
+{
+  worker_t * worker = argument;
+  batch_t * batch = worker->batch;
+  unsigned int first = 0;
+  unsigned int count = 0;
+  unsigned int group = 1;
+  jit_t * jit = NULL;
+  lockstep_t * lockstep = NULL;
+  dcpu_snapshot_t * image = NULL;
+
+  // reused from one instance to the other
+  dcpu_t * cpu = malloc (sizeof(dcpu_t));
+  if (NULL == cpu)
+    {
+      worker->failed = true;
+      return NULL;
+    }
+
+  image = load_image_snapshot (batch, cpu);
+  if (NULL == image)
+    {
+      worker->failed = true;
+      free (cpu);
+      return NULL;
+    }
+
+  if (BATCH_ENGINE_JIT == batch->engine)
+    {
+      jit = jit_create ();
+    }
+  else if (BATCH_ENGINE_LOCKSTEP == batch->engine)
+    {
+      lockstep = lockstep_create ();
+      if (NULL == lockstep)
+	{
+	  worker->failed = true;
+	  dcpu_snapshot_free (image);
+	  dcpu_snapshot_detach (cpu);
+	  free (cpu);
+	  return NULL;
+	}
+      group = LOCKSTEP_LANES;
+    }
+
+  for (;;)
+    {
+      count = take_instances (worker, group, &first);
+      if (0 == count)
+	{
+	  if ( ! steal_instances (worker))
+	    {
+	      break;
+	    }
+	}
+      else if (NULL != lockstep)
+	{
+	  run_group (batch, cpu, image, lockstep, first, count);
+	  worker->completed += count;
+	}
+      else
+	{
+	  run_instance (batch, cpu, image, jit, first);
+	  worker->completed += count;
+	}
+    }
+
+  lockstep_destroy (lockstep);
+  jit_destroy (jit);
+  dcpu_snapshot_free (image);
+  dcpu_snapshot_detach (cpu);
+  free (cpu);
+
+  return NULL;
+}
+
+
+int
+run_batch (batch_t * batch)
+{
+  worker_t * workers = NULL;
+  unsigned int count = batch->threads;
+  unsigned int started = 0;
+  unsigned int completed = 0;
+  unsigned int i = 0;
+
+  if (0 == count)
+    {
+      long online = sysconf (_SC_NPROCESSORS_ONLN);
+      count = online > 0 ? (unsigned int) online : 1;
+    }
+  if (count > batch->instances)
+    {
+      count = batch->instances > 0 ? batch->instances : 1;
+    }
+
+  workers = calloc (count, sizeof(worker_t));
+  if (NULL == workers)
+    {
+      return -1;
+    }
+
+  // initial even split, stealing takes care of the imbalance
+  for (i = 0; i < count; ++i)
+    {
+      worker_t * worker = &workers[i];
+
+      pthread_mutex_init (&worker->lock, NULL);
+      worker->next = (unsigned int) ((unsigned long long) batch->instances * i / count);
+      worker->end = (unsigned int) ((unsigned long long) batch->instances * (i + 1) / count);
+      worker->index = i;
+      worker->count = count;
+      worker->workers = workers;
+      worker->batch = batch;
+    }
+
+  for (started = 0; started < count; ++started)
+    {
+      if (0 != pthread_create (&workers[started].thread
+			       , NULL
+			       , run_worker
+			       , &workers[started]))
+	{
+	  break;
+	}
+    }
+
+  // the started workers steal the instances of the missing ones
+  for (i = 0; i < started; ++i)
+    {
+      pthread_join (workers[i].thread, NULL);
+      completed += workers[i].completed;
+    }
+
+  for (i = 0; i < count; ++i)
+    {
+      pthread_mutex_destroy (&workers[i].lock);
+    }
+  free (workers);
+
+  // the results of the instances nobody ran are not to be trusted
+  return completed < batch->instances ? -1 : 0;
+}
@@ -0,0 +1,80 @@
+#if ! defined (BATCH_H)
+#define BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dcpu.h"
+
+typedef enum batch_engine_t
+  {
+    BATCH_ENGINE_THREADED,
+    BATCH_ENGINE_JIT,
+    // LOCKSTEP_LANES instances at a time, see lockstep.h
+    BATCH_ENGINE_LOCKSTEP
+
+  } batch_engine_t;
+
+/**
+ * Prepares an instance after the image has been loaded,
+ * e.g. writes its input in ram.
+ */
+typedef void (* BatchSetupFunc) (dcpu_t * cpu
+				 , unsigned int instance
+				 , void * data);
+
+typedef struct batch_result_t
+{
+  unsigned long long executed;
+
+  word pc;
+  word sp;
+  word o;
+  word registers [REGISTER_COUNT];
+
+  // digest of the final ram
+  uint64_t ram_digest;
+
+} batch_result_t;
+
+typedef struct batch_t
+{
+  const word * image;
+  // in words
+  size_t image_size;
+
+  unsigned int instances;
+  // instructions per instance
+  unsigned long long budget;
+
+  // 0 for one per online cpu
+  unsigned int threads;
+  batch_engine_t engine;
+
+  // instance i starts with seed + i in A (low word) and B (high word)
+  uint32_t seed;
+  // optional, called after the seed has been set
+  BatchSetupFunc setup;
+  void * setup_data;
+
+  // one per instance, filled by run_batch
+  batch_result_t * results;
+
+} batch_t;
+
+
+/**
+ * Runs every instance of the batch on a work stealing thread pool,
+ * each instance starting from the image loaded at address 0.
+ *
+ * @return 0 on success, -1 if some instances were not run, e.g. no
+ * worker could be started or allocate its cpu
+ */
+int run_batch (batch_t * batch);
+
+/**
+ * 64 bits FNV-1a of a buffer, fed 8 bytes at a time.
+ */
+uint64_t digest (const void * data, size_t size);
+
+#endif
@@ -0,0 +1,601 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "dcpu.h"
+#include "predecode.h"
+#include "threaded.h"
+#include "jit/jit.h"
+
+
+// instruction encoding, enough to write the corpus by hand
+#define OP(o, a, b) ((word) ((o) | ((a) << 4) | ((b) << 10)))
+#define JSR(a) ((word) ((0x01 << 4) | ((a) << 10)))
+
+enum
+  {
+    A_ = 0, B_, C_, X_, Y_, Z_, I_, J_
+  };
+
+// [register], [next word + register]
+#define REF(r) (0x08 + (r))
+#define REF_NEXT_REG(r) (0x10 + (r))
+#define POP 0x18
+#define PEEK 0x19
+#define PUSH 0x1a
+#define SP_ 0x1b
+#define PC_ 0x1c
+#define O_ 0x1d
+#define NEXT 0x1f
+#define LIT(n) (0x20 + (n))
+
+#define SET OPCODE_SET
+#define ADD OPCODE_ADD
+#define SUB OPCODE_SUB
+#define MUL OPCODE_MUL
+#define XOR OPCODE_XOR
+#define IFE OPCODE_IFE
+#define IFN OPCODE_IFN
+#define IFG OPCODE_IFG
+#define IFB OPCODE_IFB
+
+
+// the program run by dcpu without arguments
+static const word sample [] = {
+  0x7c01, 0x0030, 0x7de1, 0x1000, 0x0020, 0x7803, 0x1000, 0xc00d,
+  0x7dc1, 0x001a, 0xa861, 0x7c01, 0x2000, 0x2161, 0x2000, 0x8463,
+  0x806d, 0x7dc1, 0x000d, 0x9031, 0x7c10, 0x0018, 0x7dc1, 0x001a,
+  0x9037, 0x61c1, 0x7dc1, 0x001a, 0x0000, 0x0000, 0x0000, 0x0000
+};
+
+// primes below 0x1000, the table being at 0x8000
+static const word sieve [] = {
+  /* 0x00 */ OP (SET, I_, LIT (0)),
+  /* 0x01 */ OP (SET, REF_NEXT_REG (I_), LIT (0)), 0x8000,
+  /* 0x03 */ OP (ADD, I_, LIT (1)),
+  /* 0x04 */ OP (IFN, I_, NEXT), 0x1000,
+  /* 0x06 */ OP (SET, PC_, LIT (0x01)),
+  /* 0x07 */ OP (SET, I_, LIT (2)),
+  // outer:
+  /* 0x08 */ OP (IFN, REF_NEXT_REG (I_), LIT (0)), 0x8000,
+  /* 0x0a */ OP (SET, PC_, LIT (0x14)),
+  /* 0x0b */ OP (SET, J_, I_),
+  /* 0x0c */ OP (ADD, J_, I_),
+  // mark:
+  /* 0x0d */ OP (IFG, J_, NEXT), 0x0fff,
+  /* 0x0f */ OP (SET, PC_, LIT (0x14)),
+  /* 0x10 */ OP (SET, REF_NEXT_REG (J_), LIT (1)), 0x8000,
+  /* 0x12 */ OP (ADD, J_, I_),
+  /* 0x13 */ OP (SET, PC_, LIT (0x0d)),
+  // next:
+  /* 0x14 */ OP (ADD, I_, LIT (1)),
+  /* 0x15 */ OP (IFN, I_, NEXT), 0x1000,
+  /* 0x17 */ OP (SET, PC_, LIT (0x08)),
+  /* 0x18 */ OP (SET, PC_, LIT (0x00))
+};
+
+// recursive fib(12), call and stack heavy
+static const word fib [] = {
+  /* 0x00 */ OP (SET, A_, LIT (12)),
+  /* 0x01 */ JSR (LIT (0x03)),
+  /* 0x02 */ OP (SET, PC_, LIT (0x00)),
+  // fib: A = fib(A)
+  /* 0x03 */ OP (IFG, LIT (2), A_),
+  /* 0x04 */ OP (SET, PC_, POP),
+  /* 0x05 */ OP (SET, PUSH, A_),
+  /* 0x06 */ OP (SUB, A_, LIT (1)),
+  /* 0x07 */ JSR (LIT (0x03)),
+  /* 0x08 */ OP (SET, B_, A_),
+  /* 0x09 */ OP (SET, A_, POP),
+  /* 0x0a */ OP (SET, PUSH, B_),
+  /* 0x0b */ OP (SUB, A_, LIT (2)),
+  /* 0x0c */ JSR (LIT (0x03)),
+  /* 0x0d */ OP (ADD, A_, POP),
+  /* 0x0e */ OP (SET, PC_, POP)
+};
+
+// 0x400 words from 0x4000 to 0x6000, indexed then through pointers
+static const word memcpy_loops [] = {
+  /* 0x00 */ OP (SET, I_, LIT (0)),
+  /* 0x01 */ OP (SET, REF_NEXT_REG (I_), REF_NEXT_REG (I_)), 0x6000, 0x4000,
+  /* 0x04 */ OP (ADD, I_, LIT (1)),
+  /* 0x05 */ OP (IFN, I_, NEXT), 0x0400,
+  /* 0x07 */ OP (SET, PC_, LIT (0x01)),
+  /* 0x08 */ OP (SET, A_, NEXT), 0x4000,
+  /* 0x0a */ OP (SET, B_, NEXT), 0x6000,
+  /* 0x0c */ OP (SET, C_, NEXT), 0x4400,
+  /* 0x0e */ OP (SET, REF (B_), REF (A_)),
+  /* 0x0f */ OP (ADD, A_, LIT (1)),
+  /* 0x10 */ OP (ADD, B_, LIT (1)),
+  /* 0x11 */ OP (IFN, A_, C_),
+  /* 0x12 */ OP (SET, PC_, LIT (0x0e)),
+  /* 0x13 */ OP (SET, PC_, LIT (0x00))
+};
+
+// data dependent branches on a linear congruential sequence
+static const word branches [] = {
+  /* 0x00 */ OP (MUL, X_, LIT (5)),
+  /* 0x01 */ OP (ADD, X_, LIT (1)),
+  /* 0x02 */ OP (IFB, X_, LIT (16)),
+  /* 0x03 */ OP (SET, PC_, LIT (0x07)),
+  /* 0x04 */ OP (ADD, Y_, LIT (1)),
+  /* 0x05 */ OP (IFG, X_, Y_),
+  /* 0x06 */ OP (SET, PC_, LIT (0x0a)),
+  /* 0x07 */ OP (XOR, Z_, X_),
+  /* 0x08 */ OP (IFN, Z_, LIT (0)),
+  /* 0x09 */ OP (ADD, A_, LIT (1)),
+  /* 0x0a */ OP (SET, PC_, LIT (0x00))
+};
+
+// push / pop / peek and a leaf call
+static const word stack [] = {
+  /* 0x00 */ OP (SET, PUSH, A_),
+  /* 0x01 */ OP (SET, PUSH, B_),
+  /* 0x02 */ OP (SET, PUSH, C_),
+  /* 0x03 */ OP (SET, PUSH, X_),
+  /* 0x04 */ OP (ADD, PEEK, LIT (1)),
+  /* 0x05 */ OP (SET, X_, POP),
+  /* 0x06 */ OP (SET, C_, POP),
+  /* 0x07 */ OP (SET, B_, POP),
+  /* 0x08 */ OP (SET, A_, POP),
+  /* 0x09 */ JSR (LIT (0x0c)),
+  /* 0x0a */ OP (ADD, A_, X_),
+  /* 0x0b */ OP (SET, PC_, LIT (0x00)),
+  /* 0x0c */ OP (SET, PUSH, O_),
+  /* 0x0d */ OP (SET, O_, POP),
+  /* 0x0e */ OP (SET, PC_, POP)
+};
+
+#undef OP
+#undef JSR
+#undef REF
+#undef REF_NEXT_REG
+#undef POP
+#undef PEEK
+#undef PUSH
+#undef SP_
+#undef PC_
+#undef O_
+#undef NEXT
+#undef LIT
+#undef SET
+#undef ADD
+#undef SUB
+#undef MUL
+#undef XOR
+#undef IFE
+#undef IFN
+#undef IFG
+#undef IFB
+
+
+typedef struct program_t
+{
+  const char * name;
+  const word * code;
+  // in words
+  size_t size;
+
+} program_t;
+
+#define DEFINE_PROGRAM(p) { #p, p, sizeof(p) / sizeof(p[0]) }
+
+static const program_t corpus [] = {
+  DEFINE_PROGRAM(sample)
+  , DEFINE_PROGRAM(sieve)
+  , DEFINE_PROGRAM(fib)
+  , { "memcpy", memcpy_loops, sizeof(memcpy_loops) / sizeof(memcpy_loops[0]) }
+  , DEFINE_PROGRAM(branches)
+  , DEFINE_PROGRAM(stack)
+};
+
+#undef DEFINE_PROGRAM
+
+
+typedef enum engine_t
+  {
+    ENGINE_REFERENCE,
+    ENGINE_CACHED,
+    ENGINE_FUSED,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    ENGINE_COUNT
+
+  } engine_t;
+
+static const char * const engine_names [ENGINE_COUNT] = {
+  "reference", "cached", "fused", "threaded", "jit"
+};
+
+// opcode 0 is split between JSR and the unknown non-basic opcodes
+#define MIX_JSR 0
+#define MIX_UNKNOWN 16
+#define MIX_SIZE 17
+
+
+static void
+load_program (dcpu_t * cpu, const program_t * program)
+{
+  memset (cpu, 0, sizeof(*cpu));
+  cpu->sp = RAM_SIZE - 1;
+  memcpy (cpu->ram, program->code, program->size * sizeof(word));
+  mark_all_dirty (cpu);
+}
+
+
+static double
+seconds_since (const struct timespec * start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+/**
+ * @param dispatches set to the number of instruction handlers run
+ * @return the time it took to execute count instructions of the
+ * program, or a negative value if the engine is not available
+ */
+static double
+time_engine (engine_t engine
+	     , const program_t * program
+	     , dcpu_t * cpu
+	     , unsigned long long count
+	     , unsigned long long * dispatches)
+{
+  struct timespec start;
+  double elapsed = 0;
+  unsigned long long i = 0;
+  jit_t * jit = NULL;
+
+  load_program (cpu, program);
+  *dispatches = count;
+
+  switch (engine)
+    {
+    case ENGINE_CACHED:
+    case ENGINE_FUSED:
+      cpu->decode_cache = decode_cache_create ();
+      if (NULL == cpu->decode_cache)
+	{
+	  return -1;
+	}
+      break;
+
+    case ENGINE_JIT:
+      jit = jit_create ();
+      if (NULL == jit)
+	{
+	  return -1;
+	}
+      break;
+
+    default:
+      break;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  switch (engine)
+    {
+    case ENGINE_REFERENCE:
+    case ENGINE_CACHED:
+      // without a decode cache, this is execute_instruction
+      for (i = 0; i < count; ++i)
+	{
+	  execute_cached_instruction (cpu);
+	}
+      break;
+
+    case ENGINE_FUSED:
+      run_cached (cpu, count, dispatches);
+      break;
+
+    case ENGINE_THREADED:
+      run_threaded (cpu, count);
+      break;
+
+    case ENGINE_JIT:
+      run_jit (jit, cpu, count);
+      break;
+
+    default:
+      break;
+    }
+
+  elapsed = seconds_since (&start);
+
+  decode_cache_destroy (cpu->decode_cache);
+  cpu->decode_cache = NULL;
+  jit_destroy (jit);
+
+  return elapsed;
+}
+
+
+// FNV-1a, byte by byte
+static uint64_t
+hash_word (uint64_t hash, word value)
+{
+  hash = (hash ^ (value & 0xff)) * 1099511628211ull;
+  return (hash ^ (value >> 8)) * 1099511628211ull;
+}
+
+
+// of the registers and the ram, to compare the final states
+static uint64_t
+digest (const dcpu_t * cpu)
+{
+  uint64_t hash = 14695981039346656037ull;
+  unsigned int i = 0;
+
+  hash = hash_word (hash, cpu->pc);
+  hash = hash_word (hash, cpu->sp);
+  hash = hash_word (hash, cpu->o);
+  for (i = 0; i < sizeof(cpu->registers) / sizeof(cpu->registers[0]); ++i)
+    {
+      hash = hash_word (hash, cpu->registers[i]);
+    }
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      hash = hash_word (hash, cpu->ram[i]);
+    }
+
+  return hash;
+}
+
+
+// instruction mix of the first count instructions (not timed), run by
+// execute_instruction: the cpu is then in the reference final state
+static void
+count_opcodes (const program_t * program
+	       , dcpu_t * cpu
+	       , unsigned long long count
+	       , unsigned long long mix [MIX_SIZE])
+{
+  unsigned long long i = 0;
+
+  load_program (cpu, program);
+  memset (mix, 0, MIX_SIZE * sizeof(mix[0]));
+
+  for (i = 0; i < count; ++i)
+    {
+      word value = cpu->ram[cpu->pc];
+      unsigned char opcode = extract_opcode (value);
+
+      if (0 == opcode)
+	{
+	  opcode = 0x01 == extract_a (value) ? MIX_JSR : MIX_UNKNOWN;
+	}
+
+      ++mix[opcode];
+      execute_cached_instruction (cpu);
+    }
+}
+
+
+static const char *
+mix_name (unsigned char index)
+{
+  switch (index)
+    {
+    case MIX_JSR:
+      return "JSR";
+
+    case MIX_UNKNOWN:
+      return "UNKNOWN";
+
+    default:
+      return opcodes[index].name;
+    }
+}
+
+
+static void
+usage (const char * name)
+{
+  fprintf (stderr
+	   , "usage: %s [--count N] [--output FILE]"
+	   " [--engine reference|cached|fused|threaded|jit|all] [--program NAME]\n"
+	   , name);
+}
+
+
+int main (int argc, char * argv [])
+{
+  static const struct option options [] = {
+    { "count", required_argument, NULL, 'c' },
+    { "output", required_argument, NULL, 'o' },
+    { "engine", required_argument, NULL, 'e' },
+    { "program", required_argument, NULL, 'p' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  unsigned long long count = 10000000;
+  const char * output = "bench.tsv";
+  const char * only = NULL;
+  // bit per engine
+  unsigned int engines = 1 << ENGINE_REFERENCE;
+  int option = 0;
+
+  FILE * out = NULL;
+  dcpu_t * cpu = NULL;
+  size_t p = 0;
+  unsigned int mismatches = 0;
+
+  while (-1 != (option = getopt_long (argc, argv, "", options, NULL)))
+    {
+      switch (option)
+	{
+	case 'c':
+	  count = strtoull (optarg, NULL, 0);
+	  break;
+
+	case 'o':
+	  output = optarg;
+	  break;
+
+	case 'p':
+	  only = optarg;
+	  break;
+
+	case 'e':
+	  {
+	    engine_t e = 0;
+
+	    for (e = 0; e < ENGINE_COUNT; ++e)
+	      {
+		if (0 == strcmp (optarg, engine_names[e]))
+		  {
+		    break;
+		  }
+	      }
+
+	    if (e < ENGINE_COUNT)
+	      {
+		engines = 1 << e;
+	      }
+	    else if (0 == strcmp (optarg, "all"))
+	      {
+		engines = (1 << ENGINE_COUNT) - 1;
+	      }
+	    else
+	      {
+		usage (argv[0]);
+		return 1;
+	      }
+	  }
+	  break;
+
+	default:
+	  usage (argv[0]);
+	  return 'h' == option ? 0 : 1;
+	}
+    }
+
+  out = 0 == strcmp (output, "-") ? stdout : fopen (output, "w");
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", output);
+      return 1;
+    }
+
+  // too big for the stack
+  cpu = calloc (1, sizeof(dcpu_t));
+  if (NULL == cpu)
+    {
+      return 1;
+    }
+
+  // one tab separated record per line, the first field giving its kind:
+  // run <program> <engine> <instructions> <seconds> <mips> <ns per instruction>
+  // dispatch <program> <engine> <instructions> <handlers run> <handlers per instruction>
+  // opcode <program> <opcode> <count> <share>
+  fprintf (out, "# dcpu-bench count=%llu\n", count);
+
+  for (p = 0; p < sizeof(corpus) / sizeof(corpus[0]); ++p)
+    {
+      const program_t * program = &corpus[p];
+      unsigned long long mix [MIX_SIZE];
+      uint64_t expected = 0;
+      engine_t e = 0;
+      unsigned char i = 0;
+
+      if (NULL != only && 0 != strcmp (only, program->name))
+	{
+	  continue;
+	}
+
+      count_opcodes (program, cpu, count, mix);
+      expected = digest (cpu);
+
+      for (e = 0; e < ENGINE_COUNT; ++e)
+	{
+	  double elapsed = 0;
+	  unsigned long long dispatches = 0;
+
+	  if (0 == (engines & (1 << e)))
+	    {
+	      continue;
+	    }
+
+	  elapsed = time_engine (e, program, cpu, count, &dispatches);
+	  if (elapsed < 0)
+	    {
+	      fprintf (stderr, "%s: engine %s not available\n"
+		       , program->name
+		       , engine_names[e]);
+	      continue;
+	    }
+
+	  // fast but wrong does not count
+	  if (expected != digest (cpu))
+	    {
+	      fprintf (stderr, "%s: engine %s does not end in the state of"
+		       " execute_instruction\n"
+		       , program->name
+		       , engine_names[e]);
+	      ++mismatches;
+	    }
+
+	  fprintf (out, "run\t%s\t%s\t%llu\t%.6f\t%.2f\t%.3f\n"
+		   , program->name
+		   , engine_names[e]
+		   , count
+		   , elapsed
+		   , elapsed > 0 ? count / elapsed / 1e6 : 0.0
+		   , count > 0 ? elapsed * 1e9 / count : 0.0);
+
+	  printf ("%-10s %-10s %10.2f MIPS %8.3f ns/instruction\n"
+		  , program->name
+		  , engine_names[e]
+		  , elapsed > 0 ? count / elapsed / 1e6 : 0.0
+		  , count > 0 ? elapsed * 1e9 / count : 0.0);
+
+	  fprintf (out, "dispatch\t%s\t%s\t%llu\t%llu\t%.4f\n"
+		   , program->name
+		   , engine_names[e]
+		   , count
+		   , dispatches
+		   , count > 0 ? (double) dispatches / count : 0.0);
+
+	  // superinstructions run several instructions per dispatch
+	  if (dispatches != count)
+	    {
+	      printf ("%-10s %-10s %10.4f dispatches/instruction\n"
+		      , program->name
+		      , engine_names[e]
+		      , count > 0 ? (double) dispatches / count : 0.0);
+	    }
+	}
+
+      for (i = 0; i < MIX_SIZE; ++i)
+	{
+	  if (0 == mix[i])
+	    {
+	      continue;
+	    }
+
+	  fprintf (out, "opcode\t%s\t%s\t%llu\t%.4f\n"
+		   , program->name
+		   , mix_name (i)
+		   , mix[i]
+		   , count > 0 ? (double) mix[i] / count : 0.0);
+	}
+    }
+
+  free (cpu);
+
+  if (stdout != out)
+    {
+      fclose (out);
+    }
+
+  return 0 == mismatches ? 0 : 1;
+}
@@ -0,0 +1,801 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "disassembler.h"
+
+
+// per address flags of the walk
+#define WALK_START 0x1
+#define WALK_LEADER 0x2
+
+// how an instruction passes control on
+typedef enum exit_t
+  {
+    EXIT_NEXT,
+    EXIT_JUMP,
+    EXIT_BRANCH,
+    EXIT_CALL,
+    EXIT_RETURN,
+    EXIT_INDIRECT
+
+  } exit_t;
+
+typedef struct walk_t
+{
+  const word * program;
+  size_t size;
+  unsigned char * flags;
+
+  // instructions left to look at, each pushed once
+  size_t * stack;
+  size_t depth;
+
+} walk_t;
+
+
+// missing words are read as 0, like format_instruction
+static inline word
+word_at (const walk_t * walk, size_t address)
+{
+  return address < walk->size ? walk->program[address] : 0;
+}
+
+/**
+ * @param target set to the jump or call target, CFG_NONE if it is not
+ * a literal
+ */
+static exit_t
+classify (const walk_t * walk, size_t pc, size_t * target)
+{
+  word value = word_at (walk, pc);
+  unsigned char opcode = extract_opcode (value);
+  unsigned char a = extract_a (value);
+  unsigned char b = extract_b (value);
+  size_t next = pc + instruction_length (value);
+  // the literal of b is the last word of the instruction
+  word literal = 0x1f == b ? word_at (walk, next - 1) : b - 0x20;
+
+  *target = b >= 0x1f ? literal : CFG_NONE;
+
+  if (0 == opcode)
+    {
+      // unknown non basic opcodes do nothing
+      return 0x01 == a ? EXIT_CALL : EXIT_NEXT;
+    }
+  if (opcode >= OPCODE_IFE)
+    {
+      return EXIT_BRANCH;
+    }
+  if (0x1c != a)
+    {
+      return EXIT_NEXT;
+    }
+  if (OPCODE_SET == opcode && 0x18 == b)
+    {
+      return EXIT_RETURN;
+    }
+  if (CFG_NONE == *target)
+    {
+      return EXIT_INDIRECT;
+    }
+
+  // pc is already past the instruction when it is applied
+  switch (opcode)
+    {
+    case OPCODE_SET:
+      return EXIT_JUMP;
+
+    case OPCODE_ADD:
+      *target = (word) (next + literal);
+      return EXIT_JUMP;
+
+    case OPCODE_SUB:
+      *target = (word) (next - literal);
+      return EXIT_JUMP;
+
+    default:
+      *target = CFG_NONE;
+      return EXIT_INDIRECT;
+    }
+}
+
+/**
+ * The successors of the instruction at pc, the addresses past the end
+ * of the image being left out.
+ *
+ * @param flags CFG_BLOCK_* flags of the instruction
+ * @return the number of successors
+ */
+static unsigned char
+successors (const walk_t * walk
+	    , size_t pc
+	    , exit_t * exit
+	    , size_t addresses [2]
+	    , cfg_edge_kind_t kinds [2]
+	    , unsigned char * flags)
+{
+  size_t target = CFG_NONE;
+  size_t next = pc + instruction_length (word_at (walk, pc));
+  unsigned char count = 0;
+
+  void add (size_t address, cfg_edge_kind_t kind)
+  {
+    if (address >= walk->size)
+      {
+	*flags |= CFG_BLOCK_EXIT;
+	return;
+      }
+    addresses[count] = address;
+    kinds[count] = kind;
+    ++count;
+  }
+
+  *flags = 0;
+  *exit = classify (walk, pc, &target);
+
+  switch (*exit)
+    {
+    case EXIT_NEXT:
+      add (next, CFG_EDGE_FALLTHROUGH);
+      break;
+
+    case EXIT_JUMP:
+      add (target, CFG_EDGE_JUMP);
+      break;
+
+    case EXIT_BRANCH:
+      add (next, CFG_EDGE_FALLTHROUGH);
+      add (next + instruction_length (word_at (walk, next)), CFG_EDGE_SKIP);
+      break;
+
+    case EXIT_CALL:
+      if (CFG_NONE == target)
+	{
+	  *flags |= CFG_BLOCK_INDIRECT;
+	}
+      else
+	{
+	  add (target, CFG_EDGE_CALL);
+	}
+      add (next, CFG_EDGE_FALLTHROUGH);
+      break;
+
+    case EXIT_RETURN:
+      *flags |= CFG_BLOCK_RETURN;
+      break;
+
+    case EXIT_INDIRECT:
+      *flags |= CFG_BLOCK_INDIRECT;
+      break;
+    }
+
+  return count;
+}
+
+
+static void
+visit (walk_t * walk, size_t address, bool leader)
+{
+  if (0 != (walk->flags[address] & WALK_START))
+    {
+      // a second way in
+      walk->flags[address] |= WALK_LEADER;
+      return;
+    }
+
+  walk->flags[address] |= WALK_START | (leader ? WALK_LEADER : 0);
+  walk->stack[walk->depth++] = address;
+}
+
+// marks the reachable instructions and the block leaders
+static void
+walk_program (walk_t * walk)
+{
+  visit (walk, 0, true);
+
+  while (walk->depth > 0)
+    {
+      size_t pc = walk->stack[--walk->depth];
+      size_t addresses [2];
+      cfg_edge_kind_t kinds [2];
+      unsigned char flags = 0;
+      exit_t exit = EXIT_NEXT;
+      unsigned char count = successors (walk, pc, &exit, addresses, kinds, &flags);
+      unsigned char i = 0;
+
+      for (i = 0; i < count; ++i)
+	{
+	  // only the plain instructions flow into the next one's block
+	  visit (walk, addresses[i], EXIT_NEXT != exit);
+	}
+    }
+}
+
+
+size_t
+cfg_block_at (const cfg_t * cfg, word address)
+{
+  size_t low = 0;
+  size_t high = cfg->block_count;
+
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+
+      if (cfg->blocks[middle].start < address)
+	{
+	  low = middle + 1;
+	}
+      else
+	{
+	  high = middle;
+	}
+    }
+
+  return low < cfg->block_count && cfg->blocks[low].start == address
+    ? low
+    : CFG_NONE;
+}
+
+
+// @return the number of blocks, filling the blocks from the leaders and
+// last with the address of their last instruction
+static size_t
+form_blocks (const walk_t * walk, cfg_block_t * blocks, size_t * last)
+{
+  size_t count = 0;
+  size_t address = 0;
+
+  for (address = 0; address < walk->size; ++address)
+    {
+      cfg_block_t * block = &blocks[count];
+      size_t pc = address;
+      size_t next = address;
+
+      if (0 == (walk->flags[address] & WALK_LEADER))
+	{
+	  continue;
+	}
+
+      memset (block, 0, sizeof(*block));
+      block->start = address;
+      block->idom = CFG_NONE;
+      block->loop = CFG_NONE;
+
+      for (;;)
+	{
+	  size_t target = CFG_NONE;
+
+	  next = pc + instruction_length (walk->program[pc]);
+	  ++block->instructions;
+
+	  if (EXIT_NEXT != classify (walk, pc, &target)
+	      || next >= walk->size
+	      || 0 != (walk->flags[next] & WALK_LEADER))
+	    {
+	      break;
+	    }
+	  pc = next;
+	}
+
+      block->length = next - address;
+      last[count++] = pc;
+    }
+
+  return count;
+}
+
+static void
+link_blocks (cfg_t * cfg, const walk_t * walk, const size_t * last)
+{
+  size_t i = 0;
+
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      cfg_block_t * block = &cfg->blocks[i];
+      size_t addresses [2];
+      cfg_edge_kind_t kinds [2];
+      exit_t exit = EXIT_NEXT;
+      unsigned char count = successors (walk, last[i], &exit, addresses, kinds, &block->flags);
+      unsigned char s = 0;
+
+      for (s = 0; s < count; ++s)
+	{
+	  // every successor is a leader, or the block would go on
+	  block->successors[s].block = cfg_block_at (cfg, addresses[s]);
+	  block->successors[s].kind = kinds[s];
+	}
+      block->successor_count = count;
+    }
+}
+
+
+// the predecessors of block b are predecessors[offsets[b]..offsets[b + 1]]
+typedef struct predecessors_t
+{
+  size_t * offsets;
+  size_t * blocks;
+
+} predecessors_t;
+
+static bool
+find_predecessors (const cfg_t * cfg, predecessors_t * predecessors)
+{
+  size_t edges = 0;
+  size_t i = 0;
+
+  predecessors->offsets = calloc (cfg->block_count + 1, sizeof(size_t));
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      edges += cfg->blocks[i].successor_count;
+    }
+  predecessors->blocks = malloc ((edges > 0 ? edges : 1) * sizeof(size_t));
+  if (NULL == predecessors->offsets || NULL == predecessors->blocks)
+    {
+      return false;
+    }
+
+  // counted at offsets[b + 1], then turned into the end of the list of
+  // b while filling
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      unsigned char s = 0;
+
+      for (s = 0; s < cfg->blocks[i].successor_count; ++s)
+	{
+	  ++predecessors->offsets[cfg->blocks[i].successors[s].block + 1];
+	}
+    }
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      predecessors->offsets[i + 1] += predecessors->offsets[i];
+    }
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      unsigned char s = 0;
+
+      for (s = 0; s < cfg->blocks[i].successor_count; ++s)
+	{
+	  size_t b = cfg->blocks[i].successors[s].block;
+
+	  predecessors->blocks[predecessors->offsets[b]++] = i;
+	}
+    }
+  for (i = cfg->block_count; i > 0; --i)
+    {
+      predecessors->offsets[i] = predecessors->offsets[i - 1];
+    }
+  predecessors->offsets[0] = 0;
+
+  return true;
+}
+
+
+/**
+ * Numbers the blocks in post order from the entry.
+ *
+ * @param order filled with the blocks in reverse post order
+ * @return the number of blocks reached
+ */
+static size_t
+number_blocks (const cfg_t * cfg, size_t * postorder, size_t * order)
+{
+  typedef struct frame_t
+  {
+    size_t block;
+    unsigned char successor;
+
+  } frame_t;
+
+  frame_t * stack = malloc (cfg->block_count * sizeof(frame_t));
+  size_t depth = 0;
+  size_t count = 0;
+  size_t i = 0;
+
+  if (NULL == stack)
+    {
+      return 0;
+    }
+
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      postorder[i] = CFG_NONE;
+    }
+
+  // CFG_NONE - 1 marks the blocks on the stack
+  postorder[0] = CFG_NONE - 1;
+  stack[depth++] = (frame_t) { .block = 0, .successor = 0 };
+
+  while (depth > 0)
+    {
+      frame_t * frame = &stack[depth - 1];
+      const cfg_block_t * block = &cfg->blocks[frame->block];
+
+      if (frame->successor < block->successor_count)
+	{
+	  size_t next = block->successors[frame->successor++].block;
+
+	  if (CFG_NONE == postorder[next])
+	    {
+	      postorder[next] = CFG_NONE - 1;
+	      stack[depth++] = (frame_t) { .block = next, .successor = 0 };
+	    }
+	  continue;
+	}
+
+      postorder[frame->block] = count++;
+      --depth;
+    }
+
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      if (CFG_NONE != postorder[i])
+	{
+	  order[count - 1 - postorder[i]] = i;
+	}
+    }
+
+  free (stack);
+
+  return count;
+}
+
+// the iterative algorithm of Cooper, Harvey and Kennedy
+static bool
+find_dominators (cfg_t * cfg, const predecessors_t * predecessors)
+{
+  size_t * postorder = malloc (cfg->block_count * sizeof(size_t));
+  size_t * order = malloc (cfg->block_count * sizeof(size_t));
+  size_t reached = 0;
+  bool changed = true;
+
+  if (NULL == postorder || NULL == order)
+    {
+      free (postorder);
+      free (order);
+      return false;
+    }
+
+  reached = number_blocks (cfg, postorder, order);
+  cfg->blocks[0].idom = 0;
+
+  while (changed)
+    {
+      size_t i = 0;
+
+      changed = false;
+      // the entry first, it is its own dominator
+      for (i = 1; i < reached; ++i)
+	{
+	  size_t b = order[i];
+	  size_t idom = CFG_NONE;
+	  size_t p = 0;
+
+	  for (p = predecessors->offsets[b]; p < predecessors->offsets[b + 1]; ++p)
+	    {
+	      size_t other = predecessors->blocks[p];
+
+	      if (CFG_NONE == cfg->blocks[other].idom)
+		{
+		  continue;
+		}
+	      if (CFG_NONE == idom)
+		{
+		  idom = other;
+		  continue;
+		}
+
+	      // closest common dominator
+	      while (idom != other)
+		{
+		  while (postorder[idom] < postorder[other])
+		    {
+		      idom = cfg->blocks[idom].idom;
+		    }
+		  while (postorder[other] < postorder[idom])
+		    {
+		      other = cfg->blocks[other].idom;
+		    }
+		}
+	    }
+
+	  if (cfg->blocks[b].idom != idom)
+	    {
+	      cfg->blocks[b].idom = idom;
+	      changed = true;
+	    }
+	}
+    }
+
+  free (postorder);
+  free (order);
+
+  return true;
+}
+
+
+bool
+cfg_dominates (const cfg_t * cfg, size_t a, size_t b)
+{
+  if (CFG_NONE == cfg->blocks[b].idom)
+    {
+      return false;
+    }
+
+  while (a != b)
+    {
+      if (0 == b)
+	{
+	  return false;
+	}
+      b = cfg->blocks[b].idom;
+    }
+
+  return true;
+}
+
+
+/**
+ * Walks the natural loop of a header back from its back edges, calling
+ * func on each block, the header first.
+ *
+ * @param mark last loop each block was walked for
+ */
+static void
+walk_loop (const cfg_t * cfg
+	   , const predecessors_t * predecessors
+	   , size_t header
+	   , size_t stamp
+	   , size_t * mark
+	   , size_t * stack
+	   , void (* func) (size_t block))
+{
+  size_t depth = 0;
+  size_t p = 0;
+
+  mark[header] = stamp;
+  func (header);
+
+  for (p = predecessors->offsets[header]; p < predecessors->offsets[header + 1]; ++p)
+    {
+      size_t source = predecessors->blocks[p];
+
+      if (cfg_dominates (cfg, header, source) && mark[source] != stamp)
+	{
+	  mark[source] = stamp;
+	  stack[depth++] = source;
+	}
+    }
+
+  while (depth > 0)
+    {
+      size_t b = stack[--depth];
+
+      func (b);
+      for (p = predecessors->offsets[b]; p < predecessors->offsets[b + 1]; ++p)
+	{
+	  size_t source = predecessors->blocks[p];
+
+	  if (CFG_NONE != cfg->blocks[source].idom && mark[source] != stamp)
+	    {
+	      mark[source] = stamp;
+	      stack[depth++] = source;
+	    }
+	}
+    }
+}
+
+static int
+compare_loops (const void * a, const void * b)
+{
+  const cfg_loop_t * x = a;
+  const cfg_loop_t * y = b;
+
+  // an enclosing loop has more blocks than the loops it contains
+  if (x->blocks != y->blocks)
+    {
+      return x->blocks < y->blocks ? 1 : -1;
+    }
+
+  return x->header < y->header ? -1 : x->header > y->header;
+}
+
+static bool
+find_loops (cfg_t * cfg, const predecessors_t * predecessors)
+{
+  size_t * mark = calloc (cfg->block_count, sizeof(size_t));
+  size_t * stack = malloc (cfg->block_count * sizeof(size_t));
+  size_t h = 0;
+  size_t l = 0;
+
+  cfg->loops = malloc (cfg->block_count * sizeof(cfg_loop_t));
+  if (NULL == mark || NULL == stack || NULL == cfg->loops)
+    {
+      free (mark);
+      free (stack);
+      return false;
+    }
+
+  // a loop per block that dominates one of its predecessors
+  for (h = 0; h < cfg->block_count; ++h)
+    {
+      cfg_loop_t * loop = &cfg->loops[cfg->loop_count];
+      size_t p = 0;
+
+      void count (size_t block)
+      {
+	++loop->blocks;
+	loop->instructions += cfg->blocks[block].instructions;
+      }
+
+      for (p = predecessors->offsets[h]; p < predecessors->offsets[h + 1]; ++p)
+	{
+	  if (cfg_dominates (cfg, h, predecessors->blocks[p]))
+	    {
+	      break;
+	    }
+	}
+      if (p == predecessors->offsets[h + 1])
+	{
+	  continue;
+	}
+
+      memset (loop, 0, sizeof(*loop));
+      loop->header = h;
+      walk_loop (cfg, predecessors, h, ++cfg->loop_count, mark, stack, count);
+    }
+
+  qsort (cfg->loops, cfg->loop_count, sizeof(cfg_loop_t), compare_loops);
+
+  // from the outermost in, so the innermost loop of a block is the last
+  // one set
+  for (l = 0; l < cfg->loop_count; ++l)
+    {
+      cfg_loop_t * loop = &cfg->loops[l];
+
+      void enter (size_t block)
+      {
+	cfg->blocks[block].loop = l;
+      }
+
+      loop->parent = cfg->blocks[loop->header].loop;
+      loop->depth = CFG_NONE == loop->parent ? 1 : cfg->loops[loop->parent].depth + 1;
+      walk_loop (cfg, predecessors, loop->header, cfg->loop_count + 1 + l, mark, stack, enter);
+    }
+
+  free (mark);
+  free (stack);
+
+  return true;
+}
+
+
+cfg_t *
+cfg_build (const word program [], size_t size)
+{
+  cfg_t * cfg = calloc (1, sizeof(cfg_t));
+  walk_t walk = {
+    .program = program,
+    .size = size < RAM_SIZE ? size : RAM_SIZE,
+    .flags = NULL,
+    .stack = NULL,
+    .depth = 0
+  };
+  predecessors_t predecessors = { NULL, NULL };
+  size_t * last = NULL;
+  bool built = false;
+
+  if (NULL == cfg || 0 == walk.size)
+    {
+      return cfg;
+    }
+
+  walk.flags = calloc (walk.size, 1);
+  walk.stack = malloc (walk.size * sizeof(size_t));
+  if (NULL != walk.flags && NULL != walk.stack)
+    {
+      walk_program (&walk);
+
+      cfg->blocks = malloc (walk.size * sizeof(cfg_block_t));
+      last = malloc (walk.size * sizeof(size_t));
+      if (NULL != cfg->blocks && NULL != last)
+	{
+	  cfg->block_count = form_blocks (&walk, cfg->blocks, last);
+	  link_blocks (cfg, &walk, last);
+
+	  built = find_predecessors (cfg, &predecessors)
+	    && find_dominators (cfg, &predecessors)
+	    && find_loops (cfg, &predecessors);
+	}
+    }
+
+  free (walk.flags);
+  free (walk.stack);
+  free (last);
+  free (predecessors.offsets);
+  free (predecessors.blocks);
+
+  if (! built)
+    {
+      cfg_destroy (cfg);
+      return NULL;
+    }
+
+  return cfg;
+}
+
+
+void
+cfg_destroy (cfg_t * cfg)
+{
+  if (NULL == cfg)
+    {
+      return;
+    }
+
+  free (cfg->blocks);
+  free (cfg->loops);
+  free (cfg);
+}
+
+
+int
+cfg_write_dot (const cfg_t * cfg
+	       , const word program []
+	       , size_t size
+	       , FILE * out)
+{
+  static const char * const edge_styles [] = {
+    [CFG_EDGE_FALLTHROUGH] = "solid",
+    [CFG_EDGE_JUMP] = "bold",
+    [CFG_EDGE_SKIP] = "dashed",
+    [CFG_EDGE_CALL] = "dotted"
+  };
+  size_t i = 0;
+
+  fprintf (out, "digraph cfg {\n");
+  fprintf (out, "  node [shape=box, fontname=monospace];\n");
+
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      const cfg_block_t * block = &cfg->blocks[i];
+      bool header = CFG_NONE != block->loop && cfg->loops[block->loop].header == i;
+      size_t pc = block->start;
+      unsigned int n = 0;
+
+      fprintf (out, "  b%zu [label=\"", i);
+      for (n = 0; n < block->instructions; ++n)
+	{
+	  char text [DISASSEMBLED_INSTRUCTION_SIZE];
+
+	  fprintf (out, "0x%04zX: ", pc);
+	  pc += format_instruction (text, sizeof(text), &program[pc], size - pc);
+	  fprintf (out, "%s\\l", text);
+	}
+      if (header)
+	{
+	  fprintf (out, "loop depth %u\\l", cfg->loops[block->loop].depth);
+	}
+      fprintf (out, "\"%s];\n", header ? ", peripheries=2" : "");
+    }
+
+  for (i = 0; i < cfg->block_count; ++i)
+    {
+      const cfg_block_t * block = &cfg->blocks[i];
+      unsigned char s = 0;
+
+      for (s = 0; s < block->successor_count; ++s)
+	{
+	  fprintf (out
+		   , "  b%zu -> b%zu [style=%s];\n"
+		   , i
+		   , block->successors[s].block
+		   , edge_styles[block->successors[s].kind]);
+	}
+    }
+
+  fprintf (out, "}\n");
+
+  return ferror (out);
+}
@@ -0,0 +1,118 @@
+#if ! defined (CFG_H)
+#define CFG_H
+
+#include <stdio.h>
+
+#include "dcpu.h"
+
+// no block or no loop
+#define CFG_NONE ((size_t) -1)
+
+// how control gets from a block to a successor
+typedef enum cfg_edge_kind_t
+  {
+    // to the next instruction
+    CFG_EDGE_FALLTHROUGH,
+    // SET, ADD or SUB PC with a literal
+    CFG_EDGE_JUMP,
+    // over the instruction following an IF, when its test fails
+    CFG_EDGE_SKIP,
+    // JSR with a literal, the return site being a fallthrough
+    CFG_EDGE_CALL
+
+  } cfg_edge_kind_t;
+
+typedef struct cfg_edge_t
+{
+  size_t block;
+  cfg_edge_kind_t kind;
+
+} cfg_edge_t;
+
+// the block ends with SET PC, POP
+#define CFG_BLOCK_RETURN 0x1
+// the block ends with a jump or a call only known when running
+#define CFG_BLOCK_INDIRECT 0x2
+// a successor is past the end of the image
+#define CFG_BLOCK_EXIT 0x4
+
+typedef struct cfg_block_t
+{
+  word start;
+  // in words
+  size_t length;
+  unsigned int instructions;
+
+  unsigned char flags;
+  unsigned char successor_count;
+  cfg_edge_t successors [2];
+
+  // immediate dominator, the entry block being its own
+  size_t idom;
+  // innermost loop, CFG_NONE if in none
+  size_t loop;
+
+} cfg_block_t;
+
+typedef struct cfg_loop_t
+{
+  size_t header;
+  // enclosing loop, CFG_NONE for the outermost ones
+  size_t parent;
+  // 1 for the outermost loops
+  unsigned int depth;
+
+  // in the loop, nested loops included
+  size_t blocks;
+  size_t instructions;
+
+} cfg_loop_t;
+
+typedef struct cfg_t
+{
+  // sorted by start address, the entry block first
+  cfg_block_t * blocks;
+  size_t block_count;
+
+  // the parents before their children
+  cfg_loop_t * loops;
+  size_t loop_count;
+
+} cfg_t;
+
+/**
+ * Builds the control flow graph of the code reachable from address 0,
+ * without running it: the blocks start at the entry point, at the
+ * targets of the jumps and calls with a literal and after the IF
+ * instructions. The calls are edges of the graph, the returns have no
+ * successor.
+ *
+ * @param size in words, at most RAM_SIZE are analysed
+ * @return NULL if out of memory
+ */
+cfg_t * cfg_build (const word program [], size_t size);
+
+void cfg_destroy (cfg_t * cfg);
+
+/**
+ * @return the index of the block starting at address, CFG_NONE if none
+ */
+size_t cfg_block_at (const cfg_t * cfg, word address);
+
+/**
+ * @return true if every path from the entry to block b goes through a
+ */
+bool cfg_dominates (const cfg_t * cfg, size_t a, size_t b);
+
+/**
+ * Writes the graph in the DOT language of graphviz, one node per block
+ * with its disassembly, the loop headers being outlined twice.
+ *
+ * @return 0, or non zero if writing failed
+ */
+int cfg_write_dot (const cfg_t * cfg
+		   , const word program []
+		   , size_t size
+		   , FILE * out);
+
+#endif
@@ -5,41 +5,19 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <assert.h>
-
+#include <limits.h>
+
+#include "dcpu.h"
+#include "predecode.h"
+#include "journal.h"
+#include "watch.h"
+#include "trace.h"
+#include "disassembler.h"
+#include "jit/jit.h"
 #include "debugger/command_parser.h"
 #include "debugger/debugger.h"
 
 
-typedef uint16_t word;
-
-// in words
-#define RAM_SIZE 0x10000
-#define REGISTER_COUNT 8
-
-typedef struct dcpu_t_
-{
-  word pc;
-  word sp;
-  word o;
-  word registers [REGISTER_COUNT];
-  word ram [RAM_SIZE];
-  
-} dcpu_t;
-
-
-typedef word (*ValueConsumerFunc) (void);
-typedef void (* NextInstructionFunc) (dcpu_t * cpu
-				      , ValueConsumerFunc next_value);
-
-
-typedef word EncodedValue;
-
-#define DCPU_INST_OPCODE_MASK  0x000F
-#define DCPU_INST_OPERAND_MASK 0xFFF0
-#define DCPU_INST_A_MASK 0x03F0
-#define DCPU_INST_B_MASK 0xFC00
-
-
 void
 execute_jsr (dcpu_t * cpu
 	     , EncodedValue evalue_a
@@ -153,6 +131,23 @@ execute_ifb (dcpu_t * cpu
 	     , NextInstructionFunc next_instruction);
 
 
+bool apply_set (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_add (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_sub (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_mul (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_div (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_mod (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_shl (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_shr (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_and (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_bor (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_xor (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_ife (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_ifn (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_ifg (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_ifb (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+
+
 /*typedef enum operand_t_
   {
     
@@ -170,84 +165,51 @@ unsigned char extract_b (word w)
 {
   return (w & DCPU_INST_B_MASK) >> 10;
 }
-  
-typedef enum opcode_inst_t_
-  {
-    OPCODE_BASIC = 0x0,
-    OPCODE_SET = 0x1,
-    OPCODE_ADD = 0x2,
-    OPCODE_SUB = 0x3,
-    OPCODE_MUL = 0x4,
-    OPCODE_DIV = 0x5,
-    OPCODE_MOD = 0x6,
-    OPCODE_SHL = 0x7,
-    OPCODE_SHR = 0x8,
-    OPCODE_AND = 0x9,
-    OPCODE_BOR = 0xa,
-    OPCODE_XOR = 0xb,
-    OPCODE_IFE = 0xc,
-    OPCODE_IFN = 0xd,
-    OPCODE_IFG = 0xe,
-    OPCODE_IFB = 0xf
-    
-  } opcode_inst_t;
-
 
-typedef void (* OpcodeExecute) (dcpu_t * cpu
-				, EncodedValue evalue_a
-				, EncodedValue evalue_b
-				, ValueConsumerFunc next_value
-				, NextInstructionFunc next_instruction);
-
-
-typedef struct opcode_t_
-{
-  opcode_inst_t inst;
-  char * name;
-  OpcodeExecute execute;
-  
-} opcode_t;
 
-#define DEFINE_OPCODE(base_inst,execute_func) \
+#define DEFINE_OPCODE(base_inst,execute_func,apply_func,base_cycles) \
   { \
     .inst = OPCODE_ ## base_inst, \
     .name = #base_inst \
     , .execute = execute_func \
+    , .apply = apply_func \
+    , .cycles = base_cycles \
   }
 
+// cycles as in the 1.1 specification (JSR for BASIC)
 opcode_t
 opcodes [] = {
-  DEFINE_OPCODE(BASIC,NULL)
+  DEFINE_OPCODE(BASIC,NULL,NULL,2)
   ,
-  DEFINE_OPCODE(SET,execute_set)
+  DEFINE_OPCODE(SET,execute_set,apply_set,1)
   ,
-  DEFINE_OPCODE(ADD,execute_add)
+  DEFINE_OPCODE(ADD,execute_add,apply_add,2)
   ,
-  DEFINE_OPCODE(SUB,execute_sub)
+  DEFINE_OPCODE(SUB,execute_sub,apply_sub,2)
   ,
-  DEFINE_OPCODE(MUL,execute_mul)
+  DEFINE_OPCODE(MUL,execute_mul,apply_mul,2)
   ,
-  DEFINE_OPCODE(DIV,execute_div)
+  DEFINE_OPCODE(DIV,execute_div,apply_div,3)
   ,
-  DEFINE_OPCODE(MOD,execute_mod)
+  DEFINE_OPCODE(MOD,execute_mod,apply_mod,3)
   ,
-  DEFINE_OPCODE(SHL,execute_shl)
+  DEFINE_OPCODE(SHL,execute_shl,apply_shl,2)
   ,
-  DEFINE_OPCODE(SHR,execute_shr)
+  DEFINE_OPCODE(SHR,execute_shr,apply_shr,2)
   ,
-  DEFINE_OPCODE(AND,execute_and)
+  DEFINE_OPCODE(AND,execute_and,apply_and,1)
   ,
-  DEFINE_OPCODE(BOR,execute_bor)
+  DEFINE_OPCODE(BOR,execute_bor,apply_bor,1)
   ,
-  DEFINE_OPCODE(XOR,execute_xor)
+  DEFINE_OPCODE(XOR,execute_xor,apply_xor,1)
   ,
-  DEFINE_OPCODE(IFE,execute_ife)
+  DEFINE_OPCODE(IFE,execute_ife,apply_ife,2)
   ,
-  DEFINE_OPCODE(IFN,execute_ifn)
+  DEFINE_OPCODE(IFN,execute_ifn,apply_ifn,2)
   ,
-  DEFINE_OPCODE(IFG,execute_ifg)
+  DEFINE_OPCODE(IFG,execute_ifg,apply_ifg,2)
   ,
-  DEFINE_OPCODE(IFB,execute_ifb)
+  DEFINE_OPCODE(IFB,execute_ifb,apply_ifb,2)
 };
 
 
@@ -281,7 +243,7 @@ stringify_value (word value, ValueConsumerFunc next_value)
       char v[64] = {0};
       snprintf (&v[0], sizeof(v) / sizeof (v[0]), "[0x%04X + %s]"
 		, next
-		, register_from (value - 0x0f));
+		, register_from (value - 0x10));
       return strdup (v);
     }
   if (value == 0x18)
@@ -374,23 +336,6 @@ stringify_instruction (word value, ValueConsumerFunc next_value)
 }
 
 
-typedef enum TaggedValueType_t
-  {
-    UNKNOWN_VALUE,
-    PLAIN_VALUE,
-    MEMORY_REFERENCE,
-    DCPU_REFERENCE
-    
-  } TaggedValueType;
-
-typedef struct TaggedValue_t
-{
-  TaggedValueType type;
-  word value;
-  
-} TaggedValue;
-
-
 bool
 is_assignable (TaggedValue tvalue)
 {
@@ -407,16 +352,32 @@ assign_to_tagged_value (dcpu_t * cpu, TaggedValue tvalue, word value)
       return;
     }
   
+  TRACE_WRITE (cpu, tvalue, value);
+  
+  if (NULL != cpu->journal)
+    {
+      journal_record_write (cpu->journal, cpu, tvalue);
+    }
+  
   switch (tvalue.type)
     {
     case MEMORY_REFERENCE:
+      if (NULL != cpu->watch)
+	{
+	  watch_access (cpu->watch, tvalue.value, value, false);
+	}
+      
       // TODO validate memory assignment
       cpu->ram[tvalue.value] = value;
+      mark_dirty (cpu, tvalue.value);
+      if (NULL != cpu->decode_cache)
+	{
+	  decode_cache_invalidate (cpu->decode_cache, tvalue.value);
+	}
       break;
       
     case DCPU_REFERENCE:
       // TODO validate this stuff
-      printf ("Assigning offset %d - value 0x%04X, %d\n", tvalue.value, value, offsetof(dcpu_t,pc));
       *((word *) ((char*) cpu + tvalue.value)) = value;
       break;
       
@@ -438,6 +399,10 @@ value_from_tagged_value (dcpu_t * cpu, TaggedValue tvalue)
     case MEMORY_REFERENCE:
       // TODO validate memory assignment
       value = cpu->ram[tvalue.value];
+      if (NULL != cpu->watch)
+	{
+	  watch_access (cpu->watch, tvalue.value, value, true);
+	}
       break;
       
     case DCPU_REFERENCE:
@@ -454,8 +419,8 @@ value_from_tagged_value (dcpu_t * cpu, TaggedValue tvalue)
 }
 
 
-TaggedValue
-decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
+static inline TaggedValue
+decode_operand (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
 {
   TaggedValue tvalue = {.type = UNKNOWN_VALUE, .value = 0};
   
@@ -480,7 +445,7 @@ decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
       // TODO add ram validation checks & fallback
       word next = next_value ();
       tvalue.type = MEMORY_REFERENCE;
-      tvalue.value = cpu->registers[value - 0x0f] + next;
+      tvalue.value = cpu->registers[value - 0x10] + next;
       
       return tvalue;
     }
@@ -504,7 +469,7 @@ decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
     {
       // TODO add stack validation checks & fallback
       tvalue.type = MEMORY_REFERENCE;
-      tvalue.value = cpu->sp--;
+      tvalue.value = --cpu->sp;
       
       return tvalue;
     }
@@ -523,7 +488,6 @@ decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
       tvalue.type = DCPU_REFERENCE;
       // dangerous ...
       tvalue.value = (word) offsetof (dcpu_t, pc);
-      printf ("Tagged value PC: %d\n", tvalue.value);
       
       return tvalue;
     }
@@ -565,67 +529,72 @@ decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
 }
 
 
-// TODO refactor & group w/ stringify & execute
+TaggedValue
+decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value)
+{
+  TaggedValue tvalue = decode_operand (cpu, value, next_value);
+  
+  TRACE_DECODE (cpu, value, tvalue);
+  
+  return tvalue;
+}
+
+
+// a skipped instruction is not decoded, its words are only consumed:
+// decoding a POP or PUSH would move sp
 void
 next_instruction (dcpu_t * cpu, ValueConsumerFunc next_value)
 {
-  word value = next_value ();
-  
-  unsigned char opcode = extract_opcode (value);
+  unsigned char length = instruction_length (next_value ());
   
-  if (0 == opcode)
+  while (--length > 0)
     {
-      // handled as a special case
-      word code = extract_a (value);
-      decode_value (cpu, extract_b (value), next_value);
-    }
-  else
-    {
-      TaggedValue tvalue_a = decode_value (cpu, extract_a (value), next_value);
-      TaggedValue tvalue_b = decode_value (cpu, extract_b (value), next_value);
+      next_value ();
     }
 }
 
 
-void
-execute_jsr (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_jsr (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
   // TODO add stack validation
-  cpu->ram[cpu->sp--] = cpu->pc + 1;
-  cpu->pc = value_from_tagged_value (cpu, decode_value (cpu, evalue_a, next_value));
+  // the operand has been decoded, pc is the return address
+  assign_to_tagged_value (cpu
+			  , (TaggedValue) { .type = MEMORY_REFERENCE, .value = --cpu->sp }
+			  , cpu->pc);
+  cpu->pc = value_from_tagged_value (cpu, tvalue_a);
+  
+  return false;
 }
 
 
-void
-execute_set (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_nop (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
-  assign_to_tagged_value (cpu, tvalue_a, value_from_tagged_value (cpu, tvalue_b));
+  return false;
 }
 
 
-void
-execute_add (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_set (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
+  assign_to_tagged_value (cpu, tvalue_a, value_from_tagged_value (cpu, tvalue_b));
   
+  return false;
+}
+
+
+bool
+apply_add (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
+{
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
@@ -638,20 +607,16 @@ execute_add (dcpu_t * cpu
     {
       cpu->o = 0x00;
     }
+  
+  return false;
 }
 
 
-void
-execute_sub (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_sub (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
@@ -664,42 +629,34 @@ execute_sub (dcpu_t * cpu
     {
       cpu->o = 0x00;
     }
+  
+  return false;
 }
 
 
-void
-execute_mul (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_mul (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
-  word value_a = value_from_tagged_value (cpu, tvalue_a);
-  word value_b = value_from_tagged_value (cpu, tvalue_b);
+  uint32_t value_a = value_from_tagged_value (cpu, tvalue_a);
+  uint32_t value_b = value_from_tagged_value (cpu, tvalue_b);
   
   assign_to_tagged_value (cpu, tvalue_a, (value_a * value_b) % 65536);
   
   cpu->o = ((value_a * value_b) >> 16) & 0xffff;
+  
+  return false;
 }
 
 
-void
-execute_div (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_div (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
-  word value_a = value_from_tagged_value (cpu, tvalue_a);
-  word value_b = value_from_tagged_value (cpu, tvalue_b);
+  uint32_t value_a = value_from_tagged_value (cpu, tvalue_a);
+  uint32_t value_b = value_from_tagged_value (cpu, tvalue_b);
   
   if (0 != value_b)
     {
@@ -711,20 +668,16 @@ execute_div (dcpu_t * cpu
       assign_to_tagged_value (cpu, tvalue_a, 0);
       cpu->o = 0;
     }
+  
+  return false;
 }
 
 
-void
-execute_mod (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_mod (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
@@ -736,189 +689,196 @@ execute_mod (dcpu_t * cpu
     {
       assign_to_tagged_value (cpu, tvalue_a, 0);
     }
+  
+  return false;
 }
 
 
-void
-execute_shl (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_shl (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
+  uint32_t value_a = value_from_tagged_value (cpu, tvalue_a);
+  uint32_t value_b = value_from_tagged_value (cpu, tvalue_b);
   
-  word value_a = value_from_tagged_value (cpu, tvalue_a);
-  word value_b = value_from_tagged_value (cpu, tvalue_b);
+  // shifting a 32 bits value by 32 or more is undefined
+  uint32_t shifted = value_b < 32 ? value_a << value_b : 0;
   
-  assign_to_tagged_value (cpu, tvalue_a, (value_a << value_b));
-  cpu->o = ((value_a << value_b) >> 16) & 0xffff;
+  assign_to_tagged_value (cpu, tvalue_a, shifted);
+  cpu->o = (shifted >> 16) & 0xffff;
+  
+  return false;
 }
 
 
-void
-execute_shr (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_shr (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
+  uint32_t value_a = value_from_tagged_value (cpu, tvalue_a);
+  uint32_t value_b = value_from_tagged_value (cpu, tvalue_b);
   
-  word value_a = value_from_tagged_value (cpu, tvalue_a);
-  word value_b = value_from_tagged_value (cpu, tvalue_b);
+  // shifting a 32 bits value by 32 or more is undefined
+  if (value_b < 32)
+    {
+      assign_to_tagged_value (cpu, tvalue_a, (value_a >> value_b));
+      cpu->o = ((value_a << 16) >> value_b) & 0xffff;
+    }
+  else
+    {
+      assign_to_tagged_value (cpu, tvalue_a, 0);
+      cpu->o = 0;
+    }
   
-  assign_to_tagged_value (cpu, tvalue_a, (value_a >> value_b));
-  cpu->o = ((value_a << 16) >> value_b) & 0xffff;
+  return false;
 }
 
 
-void
-execute_and (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_and (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
   assign_to_tagged_value (cpu, tvalue_a, value_a & value_b);
+  
+  return false;
 }
 
 
-void
-execute_bor (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_bor (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
   assign_to_tagged_value (cpu, tvalue_a, value_a | value_b);
+  
+  return false;
 }
 
 
-void
-execute_xor (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_xor (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
   assign_to_tagged_value (cpu, tvalue_a, value_a ^ value_b);
+  
+  return false;
 }
 
 
-void
-execute_ife (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_ife (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
-  if (value_a != value_b)
-    {
-      // skip next instruction
-      next_instruction(cpu, next_value);
-    }
+  return value_a != value_b;
 }
 
 
-void
-execute_ifn (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_ifn (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
-  
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
-  if (value_a == value_b)
-    {
-      // skip next instruction
-      next_instruction(cpu, next_value);
-    }
+  return value_a == value_b;
 }
 
 
-void
-execute_ifg (dcpu_t * cpu
-	     , EncodedValue evalue_a
-	     , EncodedValue evalue_b
-	     , ValueConsumerFunc next_value
-	     , NextInstructionFunc next_instruction)
+bool
+apply_ifg (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
-  TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
+  word value_a = value_from_tagged_value (cpu, tvalue_a);
+  word value_b = value_from_tagged_value (cpu, tvalue_b);
   
+  return value_a <= value_b;
+}
+
+
+bool
+apply_ifb (dcpu_t * cpu
+	   , TaggedValue tvalue_a
+	   , TaggedValue tvalue_b)
+{
   word value_a = value_from_tagged_value (cpu, tvalue_a);
   word value_b = value_from_tagged_value (cpu, tvalue_b);
   
-  if (value_a <= value_b)
-    {
-      // skip next instruction
-      next_instruction(cpu, next_value);
-    }
+  return 0 == (value_a & value_b);
 }
 
 
 void
-execute_ifb (dcpu_t * cpu
+execute_jsr (dcpu_t * cpu
 	     , EncodedValue evalue_a
 	     , EncodedValue evalue_b
 	     , ValueConsumerFunc next_value
 	     , NextInstructionFunc next_instruction)
 {
-  // we want to preserve the eval order, value 'a' then 'b'
   TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);
-  TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);
   
-  word value_a = value_from_tagged_value (cpu, tvalue_a);
-  word value_b = value_from_tagged_value (cpu, tvalue_b);
-  
-  if (0 == (value_a & value_b))
-    {
-      // skip next instruction
-      next_instruction(cpu, next_value);
-    }
+  apply_jsr (cpu, tvalue_a, (TaggedValue) { .type = UNKNOWN_VALUE });
 }
 
 
+// the reference path: decodes the operands as they are read,
+// then applies the opcode semantics on them
+#define DEFINE_EXECUTE(name)						\
+  void									\
+  execute_ ## name (dcpu_t * cpu					\
+		    , EncodedValue evalue_a				\
+		    , EncodedValue evalue_b				\
+		    , ValueConsumerFunc next_value			\
+		    , NextInstructionFunc next_instruction)		\
+  {									\
+    /* we want to preserve the eval order, value 'a' then 'b' */	\
+    TaggedValue tvalue_a = decode_value (cpu, evalue_a, next_value);	\
+    TaggedValue tvalue_b = decode_value (cpu, evalue_b, next_value);	\
+									\
+    if (apply_ ## name (cpu, tvalue_a, tvalue_b))			\
+      {									\
+	/* skip next instruction */					\
+	next_instruction (cpu, next_value);				\
+      }									\
+  }
+
+DEFINE_EXECUTE(set)
+DEFINE_EXECUTE(add)
+DEFINE_EXECUTE(sub)
+DEFINE_EXECUTE(mul)
+DEFINE_EXECUTE(div)
+DEFINE_EXECUTE(mod)
+DEFINE_EXECUTE(shl)
+DEFINE_EXECUTE(shr)
+DEFINE_EXECUTE(and)
+DEFINE_EXECUTE(bor)
+DEFINE_EXECUTE(xor)
+DEFINE_EXECUTE(ife)
+DEFINE_EXECUTE(ifn)
+DEFINE_EXECUTE(ifg)
+DEFINE_EXECUTE(ifb)
+
+#undef DEFINE_EXECUTE
+
+
 void
 execute_instruction (dcpu_t * cpu
 		     , word value
@@ -956,118 +916,461 @@ void run_vm_with (dcpu_t * cpu
   cpu->pc = 0;
   cpu->sp = RAM_SIZE - 1;
   
-  word next_word (void)
-  {
-    return program [cpu->pc++];
-  }
+  memcpy (cpu->ram, program, psize * sizeof(program[0]));
+  mark_all_dirty (cpu);
   
+  // no debugger to stop at, straight-line code is run natively
+  // (run_jit falls back to the threaded interpreter without a jit)
+  jit_t * jit = jit_create ();
   
   while (1)
     {
-      execute_instruction (cpu
-			   , next_word ()
-			   , next_word
-			   , next_instruction);
+      run_jit (jit, cpu, ULLONG_MAX);
     }
 }
 
 
-// @param size in words
-void disassemble (word program [], size_t size)
+// instructions that can be stepped back in the debugger
+#define DEBUGGER_JOURNAL_CAPACITY (1 << 20)
+
+int run_with_debugger (word program[]
+		       , size_t size
+		       , dcpu_t * cpu
+		       , FILE * script
+		       , unsigned long long budget)
 {
-  unsigned int pc = 0;
+  int result = 0;
   
-  word next_value (void)
+  cpu->pc = 0;
+  cpu->sp = RAM_SIZE - 1;
+  
+  unsigned int value_from_register (expression_register_t reg)
   {
-    return program[pc++];
+    switch (reg)
+      {
+      case EXPRESSION_SP:
+	return cpu->sp;
+	
+      case EXPRESSION_PC:
+	return cpu->pc;
+	
+      case EXPRESSION_O:
+	return cpu->o;
+	
+      default:
+	return cpu->registers[reg];
+      }
   }
   
-  for (; pc < size; )
-    {
-      word curpc = pc;
-      
-      word value = next_value ();
-      char * stringified = stringify_instruction (value, next_value);
-      printf ("0x%08X: %s ", curpc, stringified);
-      free((void *) stringified);
-      
-      printf ("\n");
-    }
-}
-
-
-void run_with_debugger (word program[]
-			, size_t size
-			, dcpu_t * cpu)
-{
-  cpu->pc = 0;
-  cpu->sp = RAM_SIZE - 1;
+  unsigned int value_from_memory (unsigned int address)
+  {
+    return cpu->ram[(word) address];
+  }
+  
+  environment_t
+    env = {
+    .get_register_value = value_from_register,
+    .get_memory_value = value_from_memory
+  };
   
-  word next_word (void)
+  int should_be_stopped (compiled_command_t * condition)
   {
-    return cpu->ram[cpu->pc++];
+    unsigned int result = 0;
+    
+    if (0 != evaluate_compiled_command (condition, env, &result))
+      {
+	printf ("Could not properly evaluate condition\n");
+	return 1;
+      }
+    
+    return 0 != result;
   }
   
-  int should_be_stopped (dcpu_t * cpu
-			 , const char * const arguments)
+  int peek_next ()
   {
-    int value_from_symbol_name (const char * name)
-    {
-      // static list of symbols
-      if (0 == strncasecmp (name, "IP", strlen(name)))
-	{
-	  return cpu->pc;
-	}
-      return -1;
-    }
+    char stringified [DISASSEMBLED_INSTRUCTION_SIZE];
+    word words [DECODE_CACHE_MAX_SPAN];
+    unsigned char i = 0;
     
-    // try to parse
-    environment_t
-      env = {
-      .get_symbol_value = value_from_symbol_name
-    };
+    // the next words wrap around as pc does
+    for (i = 0; i < DECODE_CACHE_MAX_SPAN; ++i)
+      {
+	words[i] = cpu->ram[(word) (cpu->pc + i)];
+      }
+    
+    format_instruction (stringified, sizeof(stringified), words, DECODE_CACHE_MAX_SPAN);
+    printf ("0x%08X: %s\n", cpu->pc, stringified);
+    
+    return 0;
+  }
+  
+  // address of the last instruction stepped, for the watchpoints
+  word last_pc = 0;
+  
+  // every instruction run from the debugger is journaled
+  // by all the commands, against the budget
+  unsigned long long stepped = 0;
+  
+  void step (void)
+  {
+    last_pc = cpu->pc;
+    journal_begin (cpu->journal, cpu);
+    execute_cached_instruction (cpu);
+    ++stepped;
+  }
+  
+  int out_of_budget (void)
+  {
+    if (__builtin_expect (0 == budget || stepped < budget, 1))
+      {
+	return 0;
+      }
     
-    int result = execute_command ((const char *) arguments, env);
-    if (result < 0)
+    printf ("Budget of %llu instructions exhausted\n", budget);
+    return 1;
+  }
+  
+  // only attached to the cpu while it has watchpoints, the accesses
+  // are not checked otherwise
+  watch_t * watch = NULL;
+  
+  int watchpoint_hit (void)
+  {
+    if (__builtin_expect (NULL == cpu->watch || ! cpu->watch->hit, 1))
       {
-	printf ("Could not properly parse: %s\n", arguments);
+	return 0;
+      }
+    
+    printf ("Watchpoint: 0x%04X %s [0x%04X] = 0x%04X\n"
+	    , last_pc
+	    , watch->hit_read ? "read" : "wrote"
+	    , watch->hit_address
+	    , watch->hit_value);
+    watch_clear_hit (watch);
+    
+    return 1;
+  }
+  
+  int set_watchpoint (unsigned int address, unsigned int length, int reads)
+  {
+    if (address >= RAM_SIZE || 0 == length)
+      {
+	printf ("Invalid range: 0x%04X:%u\n", address, length);
 	return 1;
       }
     
-    return result;
+    if (NULL == watch)
+      {
+	watch = watch_create ();
+	if (NULL == watch)
+	  {
+	    return 1;
+	  }
+      }
+    
+    watch_set (watch, address, length, reads, true);
+    cpu->watch = watch;
+    
+    printf ("%s at 0x%04X:%u\n"
+	    , reads ? "Read watchpoint" : "Watchpoint"
+	    , address
+	    , length);
+    
+    return 0;
   }
   
-  int peek_next ()
+  int delete_watchpoint (unsigned int address, unsigned int length)
   {
-    // assume that the only side effect is PC
-    // TODO refactor this
-    word pc = cpu->pc;
-    char * stringified = stringify_instruction (next_word(), next_word);
-    printf ("0x%08X: %s\n", pc, stringified != NULL ? stringified : "??");
-    free((void *) stringified);
-    cpu->pc = pc;
+    if (NULL == watch)
+      {
+	return 0;
+      }
+    
+    if (0 == length)
+      {
+	address = 0;
+	length = RAM_SIZE;
+      }
+    if (address >= RAM_SIZE)
+      {
+	printf ("Invalid address: 0x%04X\n", address);
+	return 1;
+      }
+    
+    watch_set (watch, address, length, false, false);
+    watch_set (watch, address, length, true, false);
+    if (0 == watch->count)
+      {
+	cpu->watch = NULL;
+      }
     
     return 0;
   }
   
   int next ()
   {
+    if (out_of_budget ())
+      {
+	return 1;
+      }
+    
     peek_next ();
     
-    execute_instruction (cpu
-			 , next_word()
-			 , next_word
-			 , next_instruction);
+    step ();
+    
+    // only reported, the instruction is done anyway
+    watchpoint_hit ();
+    
+    return 0;
+  }
+  
+  unsigned long long progress_every = 0;
+  
+  int progress (unsigned long long every)
+  {
+    progress_every = every;
+    return 0;
+  }
+  
+  // one bit per address, tested before each instruction
+  unsigned char breakpoints [RAM_SIZE / CHAR_BIT];
+  
+  // only allocated once a conditional breakpoint is set
+  compiled_command_t ** conditions = NULL;
+  
+#define BREAKPOINT_IS_SET(address)					\
+  (breakpoints[(address) / CHAR_BIT] & (1 << ((address) % CHAR_BIT)))
+  
+  memset (breakpoints, 0, sizeof(breakpoints));
+  
+  int breakpoint_hit (void)
+  {
+    unsigned int result = 0;
+    
+    if (__builtin_expect (! BREAKPOINT_IS_SET (cpu->pc), 1))
+      {
+	return 0;
+      }
+    
+    // the expression is only evaluated at its own address
+    if (NULL == conditions || NULL == conditions[cpu->pc])
+      {
+	return 1;
+      }
+    
+    return 0 == evaluate_compiled_command (conditions[cpu->pc], env, &result)
+      && 0 != result;
+  }
+  
+  int delete_breakpoint (unsigned int address)
+  {
+    if (address >= RAM_SIZE)
+      {
+	printf ("Invalid address: 0x%04X\n", address);
+	return 1;
+      }
+    
+    breakpoints[address / CHAR_BIT] &= ~(1 << (address % CHAR_BIT));
+    
+    if (NULL != conditions)
+      {
+	free_compiled_command (conditions[address]);
+	conditions[address] = NULL;
+      }
+    
+    return 0;
+  }
+  
+  int delete_all_breakpoints (void)
+  {
+    unsigned int address = 0;
+    
+    for (address = 0; address < RAM_SIZE; ++address)
+      {
+	if (BREAKPOINT_IS_SET (address))
+	  {
+	    delete_breakpoint (address);
+	  }
+      }
+    
+    return 0;
+  }
+  
+  int set_breakpoint (unsigned int address
+		      , const char * const condition)
+  {
+    compiled_command_t * compiled = NULL;
+    
+    if (address >= RAM_SIZE)
+      {
+	printf ("Invalid address: 0x%04X\n", address);
+	return 1;
+      }
+    
+    if (NULL != condition)
+      {
+	compiled = compile_command (condition);
+	if (NULL == compiled)
+	  {
+	    printf ("Could not properly parse: %s\n", condition);
+	    return 1;
+	  }
+	
+	if (NULL == conditions)
+	  {
+	    conditions = calloc (RAM_SIZE, sizeof(conditions[0]));
+	    if (NULL == conditions)
+	      {
+		free_compiled_command (compiled);
+		return 1;
+	      }
+	  }
+      }
+    
+    // replaces any previous breakpoint at that address
+    delete_breakpoint (address);
+    
+    breakpoints[address / CHAR_BIT] |= 1 << (address % CHAR_BIT);
+    if (NULL != compiled)
+      {
+	conditions[address] = compiled;
+      }
+    
+    printf ("Breakpoint at 0x%04X%s%s\n"
+	    , address
+	    , NULL != condition ? " if " : ""
+	    , NULL != condition ? condition : "");
     
     return 0;
   }
   
   int run_until (const char * const arguments)
   {
-    while (0 == should_be_stopped (cpu, arguments))
+    unsigned long long executed = 0;
+    int result = 0;
+    
+    // parse once, only the compiled condition is evaluated per step
+    compiled_command_t * condition = compile_command (arguments);
+    if (NULL == condition)
+      {
+	printf ("Could not properly parse: %s\n", arguments);
+	return 1;
+      }
+    
+    // no disassembly on the way, only (optionally) every nth instruction
+    while (0 == should_be_stopped (condition))
+      {
+	if (out_of_budget ())
+	  {
+	    result = 1;
+	    break;
+	  }
+	
+	step ();
+	++executed;
+	
+	if (watchpoint_hit ())
+	  {
+	    break;
+	  }
+	
+	if (breakpoint_hit ())
+	  {
+	    printf ("Breakpoint hit\n");
+	    break;
+	  }
+	
+	if (0 != progress_every && 0 == executed % progress_every)
+	  {
+	    printf ("[%llu] ", executed);
+	    peek_next ();
+	  }
+      }
+    
+    free_compiled_command (condition);
+    
+    printf ("Stopped after %llu instructions at\n", executed);
+    peek_next ();
+    
+    return result;
+  }
+  
+  int cont (void)
+  {
+    unsigned long long executed = 0;
+    int result = 0;
+    
+    // always leaves the current address, even if it has a breakpoint
+    do
       {
-	next ();
+	if (out_of_budget ())
+	  {
+	    result = 1;
+	    break;
+	  }
+	
+	step ();
+	++executed;
+	
+	if (__builtin_expect (0 != progress_every, 0)
+	    && 0 == executed % progress_every)
+	  {
+	    printf ("[%llu] ", executed);
+	    peek_next ();
+	  }
+	
+	if (watchpoint_hit ())
+	  {
+	    break;
+	  }
       }
+    while (! breakpoint_hit ());
+    
+    printf ("Stopped after %llu instructions at\n", executed);
+    peek_next ();
+    
+    return result;
+  }
+  
+  int step_back (unsigned long long count)
+  {
+    unsigned long long undone = 0;
+    
+    for (undone = 0; undone < count; ++undone)
+      {
+	if ( ! journal_undo (cpu->journal, cpu))
+	  {
+	    printf ("Start of the journal\n");
+	    break;
+	  }
+      }
+    
+    printf ("Stepped back %llu instructions to\n", undone);
+    peek_next ();
+    
+    return 0;
+  }
+  
+  int reverse_continue (void)
+  {
+    unsigned long long undone = 0;
+    
+    // as continue, always leaves the current address
+    do
+      {
+	if ( ! journal_undo (cpu->journal, cpu))
+	  {
+	    printf ("Start of the journal\n");
+	    break;
+	  }
+	++undone;
+      }
+    while ( ! breakpoint_hit ());
+    
+    printf ("Stepped back %llu instructions to\n", undone);
+    peek_next ();
+    
+    return 0;
   }
   
   int where ()
@@ -1092,36 +1395,46 @@ void run_with_debugger (word program[]
     .where = where,
     .registers = registers,
     .run_until = run_until,
+    .progress = progress,
+    .set_breakpoint = set_breakpoint,
+    .delete_breakpoint = delete_breakpoint,
+    .delete_all_breakpoints = delete_all_breakpoints,
+    .set_watchpoint = set_watchpoint,
+    .delete_watchpoint = delete_watchpoint,
+    .cont = cont,
+    .step_back = step_back,
+    .reverse_continue = reverse_continue,
     .peek_next = peek_next
   };
   
-  memcpy (cpu->ram, program, size);
+  memcpy (cpu->ram, program, size * sizeof(program[0]));
+  mark_all_dirty (cpu);
+  
+  cpu->decode_cache = decode_cache_create ();
+  cpu->journal = journal_create (DEBUGGER_JOURNAL_CAPACITY);
   
-  run_debugger (&debugger);
+  result = NULL != script
+    ? run_debugger_script (&debugger, script)
+    : run_debugger (&debugger);
+  
+  delete_all_breakpoints ();
+  free (conditions);
+  
+  cpu->watch = NULL;
+  watch_destroy (watch);
+  
+#undef BREAKPOINT_IS_SET
+  
+  decode_cache_destroy (cpu->decode_cache);
+  cpu->decode_cache = NULL;
+  journal_destroy (cpu->journal);
+  cpu->journal = NULL;
   
   /*run_vm_with (cpu
 	       , program
 	       , sizeof(program) / sizeof(program[0])
 	       , &debugger);*/
-}
-
-
-
-int main (void)
-{
-  word program [] = {
-    0x7c01, 0x0030, 0x7de1, 0x1000, 0x0020, 0x7803, 0x1000, 0xc00d,
-    0x7dc1, 0x001a, 0xa861, 0x7c01, 0x2000, 0x2161, 0x2000, 0x8463,
-    0x806d, 0x7dc1, 0x000d, 0x9031, 0x7c10, 0x0018, 0x7dc1, 0x001a,
-    0x9037, 0x61c1, 0x7dc1, 0x001a, 0x0000, 0x0000, 0x0000, 0x0000
-  };
   
-  disassemble (program, sizeof(program) / sizeof(program[0]));
-  
-  dcpu_t cpu = {0};
-  run_with_debugger (program, sizeof(program) / sizeof(program[0]), &cpu);
-  
-  return 0;
+  return result;
 }
 
-
@@ -0,0 +1,221 @@
+#if ! defined (DCPU_H)
+#define DCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef uint16_t word;
+
+// in words
+#define RAM_SIZE 0x10000
+#define REGISTER_COUNT 8
+
+// ram writes are tracked per page for the snapshots (see snapshot.h)
+#define DCPU_PAGE_SHIFT 8
+#define DCPU_PAGE_SIZE (1 << DCPU_PAGE_SHIFT)
+#define DCPU_PAGE_COUNT (RAM_SIZE / DCPU_PAGE_SIZE)
+
+struct decode_cache_t;
+struct dcpu_snapshot_t;
+struct journal_t;
+struct watch_t;
+
+typedef struct dcpu_t_
+{
+  word pc;
+  word sp;
+  word o;
+  word registers [REGISTER_COUNT];
+  word ram [RAM_SIZE];
+
+  // predecoded instructions keyed by ram address, NULL if not used
+  struct decode_cache_t * decode_cache;
+
+  // records the writes to step instructions back, NULL if not used
+  struct journal_t * journal;
+
+  // watchpoints, NULL if there are none
+  struct watch_t * watch;
+
+  // non zero for the pages written since the last snapshot taken or
+  // restored (a byte rather than a bit, marking is a single store)
+  unsigned char dirty [DCPU_PAGE_COUNT];
+
+  // that snapshot, NULL if there is none
+  struct dcpu_snapshot_t * snapshot;
+
+} dcpu_t;
+
+
+static inline void
+mark_dirty (dcpu_t * cpu, word address)
+{
+  cpu->dirty[address >> DCPU_PAGE_SHIFT] = 1;
+}
+
+/**
+ * To be called when ram is changed other than by executing instructions.
+ */
+static inline void
+mark_all_dirty (dcpu_t * cpu)
+{
+  memset (cpu->dirty, 1, sizeof(cpu->dirty));
+}
+
+
+typedef word (*ValueConsumerFunc) (void);
+typedef void (* NextInstructionFunc) (dcpu_t * cpu
+				      , ValueConsumerFunc next_value);
+
+
+typedef word EncodedValue;
+
+#define DCPU_INST_OPCODE_MASK  0x000F
+#define DCPU_INST_OPERAND_MASK 0xFFF0
+#define DCPU_INST_A_MASK 0x03F0
+#define DCPU_INST_B_MASK 0xFC00
+
+
+typedef enum opcode_inst_t_
+  {
+    OPCODE_BASIC = 0x0,
+    OPCODE_SET = 0x1,
+    OPCODE_ADD = 0x2,
+    OPCODE_SUB = 0x3,
+    OPCODE_MUL = 0x4,
+    OPCODE_DIV = 0x5,
+    OPCODE_MOD = 0x6,
+    OPCODE_SHL = 0x7,
+    OPCODE_SHR = 0x8,
+    OPCODE_AND = 0x9,
+    OPCODE_BOR = 0xa,
+    OPCODE_XOR = 0xb,
+    OPCODE_IFE = 0xc,
+    OPCODE_IFN = 0xd,
+    OPCODE_IFG = 0xe,
+    OPCODE_IFB = 0xf
+
+  } opcode_inst_t;
+
+
+typedef enum TaggedValueType_t
+  {
+    UNKNOWN_VALUE,
+    PLAIN_VALUE,
+    MEMORY_REFERENCE,
+    DCPU_REFERENCE
+
+  } TaggedValueType;
+
+typedef struct TaggedValue_t
+{
+  TaggedValueType type;
+  word value;
+
+} TaggedValue;
+
+
+typedef void (* OpcodeExecute) (dcpu_t * cpu
+				, EncodedValue evalue_a
+				, EncodedValue evalue_b
+				, ValueConsumerFunc next_value
+				, NextInstructionFunc next_instruction);
+
+/**
+ * Applies the semantics of an opcode to already decoded operands.
+ *
+ * @return true if the next instruction has to be skipped
+ */
+typedef bool (* OpcodeApply) (dcpu_t * cpu
+			      , TaggedValue tvalue_a
+			      , TaggedValue tvalue_b);
+
+
+typedef struct opcode_t_
+{
+  opcode_inst_t inst;
+  char * name;
+  OpcodeExecute execute;
+  OpcodeApply apply;
+
+  // not counting the next words (one more each) nor the failed tests
+  // of the IF opcodes (one more)
+  unsigned char cycles;
+
+} opcode_t;
+
+extern opcode_t opcodes [];
+
+
+unsigned char extract_opcode (word w);
+unsigned char extract_a (word w);
+unsigned char extract_b (word w);
+
+// bit per encoded operand, set for those followed by a next word:
+// [next word + register] (0x10-0x17), [next word] and next word
+#define DCPU_NEXT_WORD_OPERANDS 0xc0ff0000ULL
+
+/**
+ * @return the number of next words consumed by an encoded operand
+ */
+static inline unsigned char
+operand_length (unsigned char value)
+{
+  return (DCPU_NEXT_WORD_OPERANDS >> (value & 0x3f)) & 1;
+}
+
+/**
+ * @return the number of words an instruction spans, as consumed when
+ * it is skipped
+ */
+static inline unsigned char
+instruction_length (word value)
+{
+  if (0 == (value & DCPU_INST_OPCODE_MASK))
+    {
+      return 1 + operand_length ((value & DCPU_INST_B_MASK) >> 10);
+    }
+  
+  return 1
+    + operand_length ((value & DCPU_INST_A_MASK) >> 4)
+    + operand_length ((value & DCPU_INST_B_MASK) >> 10);
+}
+
+const char * stringify_value (word value, ValueConsumerFunc next_value);
+char * stringify_instruction (word value, ValueConsumerFunc next_value);
+
+bool is_assignable (TaggedValue tvalue);
+void assign_to_tagged_value (dcpu_t * cpu, TaggedValue tvalue, word value);
+word value_from_tagged_value (dcpu_t * cpu, TaggedValue tvalue);
+TaggedValue decode_value (dcpu_t * cpu, word value, ValueConsumerFunc next_value);
+
+bool apply_jsr (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+bool apply_nop (dcpu_t * cpu, TaggedValue tvalue_a, TaggedValue tvalue_b);
+
+void next_instruction (dcpu_t * cpu, ValueConsumerFunc next_value);
+
+void execute_instruction (dcpu_t * cpu
+			  , word value
+			  , ValueConsumerFunc next_word
+			  , NextInstructionFunc next_instruction);
+
+/**
+ * Loads the program in ram and hands the cpu over to the interactive
+ * debugger console, or runs the commands of script if not NULL.
+ *
+ * @param size in words
+ * @param budget instructions the commands may execute in all, 0 for
+ * no limit: a command running out of it fails
+ * @return 0, or non zero if a command of the script failed
+ */
+int run_with_debugger (word program []
+		       , size_t size
+		       , dcpu_t * cpu
+		       , FILE * script
+		       , unsigned long long budget);
+
+#endif
@@ -1,23 +1,225 @@
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <assert.h>
 
-#include "parser.h"
+#include "command_parser.h"
 
 #define EOK 0
 
 #define gc_malloc malloc
 #define gc_free free
 
+
+// bump allocator for what only lives while a command is compiled (the
+// tree), released in one step once the code is generated
+typedef struct arena_block_t
+{
+  struct arena_block_t * next;
+  size_t used;
+  size_t size;
+  
+  char data [];
+  
+} arena_block_t;
+
+typedef struct arena_t
+{
+  arena_block_t * head;
+  
+} arena_t;
+
+#define ARENA_BLOCK_SIZE 4096
+
+static arena_t g_arena = { .head = NULL };
+
+static void * arena_alloc (arena_t * arena, size_t size)
+{
+  arena_block_t * block = arena->head;
+  void * p = NULL;
+  
+  // keeps every allocation aligned as malloc would
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  
+  if (NULL == block || block->size - block->used < size)
+    {
+      const size_t BLOCK_SIZE = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+      
+      block = gc_malloc (sizeof(arena_block_t) + BLOCK_SIZE);
+      if (NULL == block)
+	{
+	  return NULL;
+	}
+      
+      block->next = arena->head;
+      block->used = 0;
+      block->size = BLOCK_SIZE;
+      arena->head = block;
+    }
+  
+  p = block->data + block->used;
+  block->used += size;
+  
+  return p;
+}
+
+/**
+ * Frees everything allocated, keeping a block for the next command.
+ */
+static void arena_release (arena_t * arena)
+{
+  arena_block_t * block = arena->head;
+  
+  if (NULL == block)
+    {
+      return;
+    }
+  
+  while (NULL != block->next)
+    {
+      arena_block_t * next = block->next;
+      
+      gc_free (block);
+      block = next;
+    }
+  
+  block->used = 0;
+  arena->head = block;
+}
+
+
+// symbol names, interned once for the whole session rather than
+// allocated for every token
+typedef struct symbol_table_t
+{
+  char ** names;
+  size_t count;
+  size_t capacity;
+  
+} symbol_table_t;
+
+static symbol_table_t g_symbols = { .names = NULL, .count = 0, .capacity = 0 };
+
+/**
+ *
+ * @return the interned copy of the name or NULL if out of memory
+ */
+static const char * intern_symbol (const char * name, size_t size)
+{
+  size_t i = 0;
+  char * symbol = NULL;
+  
+  // there are only a handful of them (registers & the like)
+  for (i = 0; i < g_symbols.count; ++i)
+    {
+      if (0 == strncmp (g_symbols.names[i], name, size)
+	  && '\0' == g_symbols.names[i][size])
+	{
+	  return g_symbols.names[i];
+	}
+    }
+  
+  if (g_symbols.count == g_symbols.capacity)
+    {
+      size_t capacity = 0 == g_symbols.capacity ? 16 : 2 * g_symbols.capacity;
+      char ** names = realloc (g_symbols.names, capacity * sizeof(char *));
+      
+      if (NULL == names)
+	{
+	  return NULL;
+	}
+      
+      g_symbols.names = names;
+      g_symbols.capacity = capacity;
+    }
+  
+  symbol = gc_malloc (size + 1);
+  if (NULL == symbol)
+    {
+      return NULL;
+    }
+  
+  memcpy (symbol, name, size);
+  symbol[size] = '\0';
+  
+  g_symbols.names[g_symbols.count++] = symbol;
+  
+  return symbol;
+}
+
+
 typedef enum operator_symbol_t
   {
     OPERATOR_NONE = -1,
+    OPERATOR_OR,
+    OPERATOR_AND,
+    OPERATOR_BITWISE_OR,
+    OPERATOR_BITWISE_XOR,
+    OPERATOR_BITWISE_AND,
     OPERATOR_EQUAL,
+    OPERATOR_NOT_EQUAL,
+    OPERATOR_IS_LESS_THAN,
+    OPERATOR_IS_LESS_OR_EQUAL,
     OPERATOR_IS_GREATER_THAN,
-    OPERATOR_INC,
- 
+    OPERATOR_IS_GREATER_OR_EQUAL,
+    OPERATOR_SHIFT_LEFT,
+    OPERATOR_SHIFT_RIGHT,
+    OPERATOR_PLUS,
+    OPERATOR_MINUS,
+    OPERATOR_TIMES,
+    OPERATOR_DIVIDE,
+    OPERATOR_MODULO,
+    OPERATOR_NOT,
+    OPERATOR_COMPLEMENT,
+    OPERATOR_OPEN_PARENTHESIS,
+    OPERATOR_CLOSE_PARENTHESIS,
+    OPERATOR_OPEN_BRACKET,
+    OPERATOR_CLOSE_BRACKET,
+    
   } operator_symbol_t;
 
+
+// small register based VM
+
+typedef enum OpCode
+  {
+    DONE,
+    LOAD_REGISTER_VALUE,
+    LOAD_MEMORY_VALUE,
+    
+    // dst = a op b
+    OR,
+    AND,
+    BITWISE_OR,
+    BITWISE_XOR,
+    BITWISE_AND,
+    ISEQUAL,
+    IS_NOT_EQUAL,
+    IS_LESS_THAN,
+    IS_LESS_OR_EQUAL,
+    IS_GREATER_THAN,
+    IS_GREATER_OR_EQUAL,
+    SHIFT_LEFT,
+    SHIFT_RIGHT,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    MODULO,
+    
+    // dst = op a
+    NOT,
+    COMPLEMENT,
+    NEGATE,
+    
+  } OpCode;
+
+
 typedef struct operator_t
 {
   operator_symbol_t value;
@@ -25,12 +227,64 @@ typedef struct operator_t
   // original string representation
   char * repr;
   
+  // binary operators only, the higher the tighter it binds
+  int precedence;
+  OpCode opcode;
+  
 } operator_t;
 
+// the longest representations first, they are matched as prefixes
 static operator_t g_operators [] = {
-  { .value = OPERATOR_EQUAL, .repr = "=" }
-  , { .value = OPERATOR_IS_GREATER_THAN, .repr = ">" }
-  , { .value = OPERATOR_INC, .repr = "++" }
+  { .value = OPERATOR_OR, .repr = "||", .precedence = 1, .opcode = OR }
+  , { .value = OPERATOR_AND, .repr = "&&", .precedence = 2, .opcode = AND }
+  , { .value = OPERATOR_EQUAL, .repr = "==", .precedence = 6, .opcode = ISEQUAL }
+  , { .value = OPERATOR_NOT_EQUAL, .repr = "!=", .precedence = 6, .opcode = IS_NOT_EQUAL }
+  , { .value = OPERATOR_IS_LESS_OR_EQUAL, .repr = "<=", .precedence = 7, .opcode = IS_LESS_OR_EQUAL }
+  , { .value = OPERATOR_IS_GREATER_OR_EQUAL, .repr = ">=", .precedence = 7, .opcode = IS_GREATER_OR_EQUAL }
+  , { .value = OPERATOR_SHIFT_LEFT, .repr = "<<", .precedence = 8, .opcode = SHIFT_LEFT }
+  , { .value = OPERATOR_SHIFT_RIGHT, .repr = ">>", .precedence = 8, .opcode = SHIFT_RIGHT }
+  , { .value = OPERATOR_BITWISE_OR, .repr = "|", .precedence = 3, .opcode = BITWISE_OR }
+  , { .value = OPERATOR_BITWISE_XOR, .repr = "^", .precedence = 4, .opcode = BITWISE_XOR }
+  , { .value = OPERATOR_BITWISE_AND, .repr = "&", .precedence = 5, .opcode = BITWISE_AND }
+  // the original syntax
+  , { .value = OPERATOR_EQUAL, .repr = "=", .precedence = 6, .opcode = ISEQUAL }
+  , { .value = OPERATOR_IS_LESS_THAN, .repr = "<", .precedence = 7, .opcode = IS_LESS_THAN }
+  , { .value = OPERATOR_IS_GREATER_THAN, .repr = ">", .precedence = 7, .opcode = IS_GREATER_THAN }
+  , { .value = OPERATOR_PLUS, .repr = "+", .precedence = 9, .opcode = ADD }
+  , { .value = OPERATOR_MINUS, .repr = "-", .precedence = 9, .opcode = SUBTRACT }
+  , { .value = OPERATOR_TIMES, .repr = "*", .precedence = 10, .opcode = MULTIPLY }
+  , { .value = OPERATOR_DIVIDE, .repr = "/", .precedence = 10, .opcode = DIVIDE }
+  , { .value = OPERATOR_MODULO, .repr = "%", .precedence = 10, .opcode = MODULO }
+  , { .value = OPERATOR_NOT, .repr = "!" }
+  , { .value = OPERATOR_COMPLEMENT, .repr = "~" }
+  , { .value = OPERATOR_OPEN_PARENTHESIS, .repr = "(" }
+  , { .value = OPERATOR_CLOSE_PARENTHESIS, .repr = ")" }
+  , { .value = OPERATOR_OPEN_BRACKET, .repr = "[" }
+  , { .value = OPERATOR_CLOSE_BRACKET, .repr = "]" }
+};
+
+#define OPERATOR_COUNT (sizeof(g_operators) / sizeof(g_operators[0]))
+
+
+// the names of the registers, IP being the original name of PC
+static const struct
+{
+  const char * name;
+  expression_register_t reg;
+  
+} g_registers [] = {
+  { "A", EXPRESSION_A }
+  , { "B", EXPRESSION_B }
+  , { "C", EXPRESSION_C }
+  , { "X", EXPRESSION_X }
+  , { "Y", EXPRESSION_Y }
+  , { "Z", EXPRESSION_Z }
+  , { "I", EXPRESSION_I }
+  , { "J", EXPRESSION_J }
+  , { "SP", EXPRESSION_SP }
+  , { "PC", EXPRESSION_PC }
+  , { "IP", EXPRESSION_PC }
+  , { "O", EXPRESSION_O }
 };
 
 
@@ -46,8 +300,8 @@ typedef enum token_type_t
 typedef union token_value_t
 {
   unsigned int numeric;
-  char * symbol;
-  operator_symbol_t op;
+  const char * symbol;
+  const operator_t * op;
   
 } token_value_t;
 
@@ -63,21 +317,16 @@ typedef struct token_t
 } token_t;
 
 
-const char * eatwhitespace (const char * const s)
+const char * eatwhitespace (const char * s)
 {
-  if (NULL == s || 0 == strlen (s))
+  if (NULL == s)
     {
       return s;
     }
   
-  {
-    const char * r = s;
-    size_t i = 0;
-    
-    while (i < strlen(s) && isspace (s[i])) { ++r; ++i; }
-    
-    return r;
-  }
+  while (isspace (*s)) ++s;
+  
+  return s;
 }
 
  
@@ -109,44 +358,12 @@ static int find_operator_by_repr (const char * const r
   return i == operatorcnt ? -1 : i;
 }
 
-const char * next (const char * const s)
-{
-  const char * current = s;
-  if (NULL == current)
-    {
-      return NULL;
-    }
-  
-  current = eatwhitespace (current);
-  
-  if (NULL == current || *current == '\0')
-    {
-      return current;
-    }
-  
-  while ( ! isspace (*current)) ++current;
-  
-  return current;
-}
-
-const char peek (const char * const s)
-{
-  assert (NULL != s);
-  if (NULL == s)
-    {
-      // should abort! & kill all
-      return -1;
-    }
-  
-  return 'a';
-}
-
 #define VALIDATE_INPUT(s)			\
   if (NULL == (s))				\
     {						\
       return t;					\
     }						\
-  if (0 == strlen ((s)))			\
+  if ('\0' == *(s))				\
     {						\
       return t;					\
     }
@@ -179,20 +396,12 @@ token_t next_token_expect_symbol (const char * s)
   
   assert (t.repr_end > t.repr_start);
   
-  {
-    const size_t SYMBOL_SIZE =  t.repr_end - t.repr_start;
-    
-    t.value.symbol = gc_malloc (SYMBOL_SIZE+1);
-    
-    if (t.value.symbol == NULL)
-      {
-	return t;
-      }
-    
-    memset (t.value.symbol, 0, SYMBOL_SIZE+1);
-    
-    memcpy (t.value.symbol, t.repr_start, SYMBOL_SIZE);
-  }
+  t.value.symbol = intern_symbol (t.repr_start, t.repr_end - t.repr_start);
+  
+  if (t.value.symbol == NULL)
+    {
+      return t;
+    }
   
   t.type = SYMBOL;
   
@@ -202,8 +411,7 @@ token_t next_token_expect_symbol (const char * s)
 token_t next_token_expect_operator (const char * s)
 {
   token_t t = { .type = NONE };
-  
-  size_t inputsize = 0;
+  int idx = -1;
   
   VALIDATE_INPUT (s);
   
@@ -211,45 +419,21 @@ token_t next_token_expect_operator (const char * s)
   
   t.repr_start = s;
   
-  // search for end of input
-  while ('\0' != *s
-	 && ! isalnum (*s)
-	 && ! isspace (*s)
-	 )
-    {
-      ++inputsize;
-      ++s;
-    }
-  
-  if (s == t.repr_start)
+  idx = find_operator_by_repr (s
+			       , g_operators
+			       , OPERATOR_COUNT
+			       );
+  if (-1 == idx)
     {
+      // oops
       return t;
     }
   
-  // C99 VLA
-  {
-    char symbolrepr [inputsize + 1];
-    int idx = -1;
-    
-    strncpy (symbolrepr, t.repr_start, inputsize);
-    symbolrepr[inputsize] = '\0';
-    
-    idx = find_operator_by_repr (symbolrepr
-				 , g_operators
-				 , sizeof(g_operators) / sizeof(g_operators[0])
-				 );
-    if (-1 == idx)
-      {
-	// oops
-	return t;
-      }
-    
-    t.repr_end = s;
-    
-    t.value.op = g_operators[idx].value;
-    
-    t.type = OPERATOR;
-  }
+  t.repr_end = s + strlen (g_operators[idx].repr);
+  
+  t.value.op = &g_operators[idx];
+  
+  t.type = OPERATOR;
   
   return t;
 }
@@ -265,40 +449,27 @@ next_token_expect_immediate_value (const char * s)
   
   s = eatwhitespace (s);
   
-  assert (NULL != s);
-  if (NULL == s)
-    {
-      // should abort
-      return t;
-    }
-  
   {
-    size_t i = 0;
+    char * end = NULL;
     
     t.repr_start = s;
     
-    while (*s != '\0'
-	   && isdigit (*s)
-	   )
+    if ( ! isdigit (*s))
       {
-	++s;
+	return t;
       }
     
-    t.repr_end = s;
+    // decimal, 0x hexadecimal or 0 octal
+    t.value.numeric = strtoul (s, &end, 0);
     
-    if (s != t.repr_start)
+    // '12ab' is neither a number nor a symbol
+    if (isalnum (*end))
       {
-	const size_t VALUE_SIZE = t.repr_end - t.repr_start;
-	char v[VALUE_SIZE + 1];
-	
-	assert (s > t.repr_start);
-	
-	memcpy (&v[0], t.repr_start, VALUE_SIZE);
-	v[VALUE_SIZE] = '\0';
-	
-	t.type = IMMEDIATE;
-	t.value.numeric = strtoul (&v[0], NULL, 0);
+	return t;
       }
+    
+    t.repr_end = end;
+    t.type = IMMEDIATE;
   }
   
   return t;
@@ -317,38 +488,41 @@ token_t next_token (const char * s)
   char next_char = *s;
   if (isdigit (next_char))
     {
-      t = next_token_expect_immediate_value (s);
-      
-      if (t.type != IMMEDIATE)
-	{
-	  // fail!
-	  return t;
-	}
-      
-      return t;
+      return next_token_expect_immediate_value (s);
     }
   else if (isalpha (next_char))
     {
-      t = next_token_expect_symbol (s);
-      
-      if (t.type != SYMBOL)
-	{
-	  // fail!
-	  return t;
-	}
-      
-      return t;
+      return next_token_expect_symbol (s);
     }
   
   return next_token_expect_operator (s);
 }
 
 
+typedef enum node_type_t
+  {
+    NODE_IMMEDIATE,
+    NODE_REGISTER,
+    // [left]
+    NODE_MEMORY,
+    // opcode left
+    NODE_UNARY,
+    // left opcode right
+    NODE_BINARY,
+    
+  } node_type_t;
+
 typedef struct Node
 {
-  token_type_t type;
+  node_type_t type;
   
-  token_value_t value;
+  union
+  {
+    unsigned int numeric;
+    expression_register_t reg;
+    OpCode opcode;
+    
+  } value;
   
   struct Node * left;
   struct Node * right;
@@ -356,6 +530,21 @@ typedef struct Node
 } Node;
 
 
+static Node * new_node (node_type_t type)
+{
+  Node * node = arena_alloc (&g_arena, sizeof(Node));
+  if (NULL == node)
+    {
+      return NULL;
+    }
+  
+  memset (node, 0, sizeof(Node));
+  node->type = type;
+  
+  return node;
+}
+
+
 void parse_error (const char * s)
 {
   printf ("Parse error: %s\n", s);
@@ -363,325 +552,547 @@ void parse_error (const char * s)
 }
 
 
-Node * parse_symbol (const char ** s)
+typedef struct bytecode_t
 {
-  token_t t = next_token (*s);
-  if (t.type != SYMBOL)
+  // OpCode
+  unsigned char op;
+  
+  // VM registers
+  unsigned char dst;
+  unsigned char a;
+  unsigned char b;
+  
+  union
+  {
+    expression_register_t reg;
+    
+  } value;
+  
+} bytecode_t;
+
+typedef struct VM
+{
+  enum
     {
-      parse_error (*s);
-      return NULL;
-    }
+      REGISTER_COUNT = 32,
+      CONSTANT_COUNT = 32,
+      CODE_SIZE = 256,
+    };
   
-  assert (t.repr_start < t.repr_end);
+  // the numbers are not loaded by the code, they are in the registers
+  // above REGISTER_COUNT from the start
+  unsigned int constants [CONSTANT_COUNT];
+  unsigned char constant_count;
   
-  *s = t.repr_end;
+  bytecode_t code [CODE_SIZE];
+  unsigned short size;
   
-  {
-    const size_t SYMBOL_SIZE = t.repr_end - t.repr_start;
+} VM;
 
-    Node * node = gc_malloc (sizeof(Node));
-    if (NULL == node) { return NULL; }
-    
-    node->type = SYMBOL;
-    
-    node->value.symbol = t.value.symbol;
-    
-    return node;
-  }
+
+static unsigned int
+vm_execute (const unsigned int * constants
+	    , unsigned char constant_count
+	    , const bytecode_t * code
+	    , environment_t env)
+{
+  // threaded dispatch, as the interpreter: conditions run on every step
+  static const void * const handlers [] = {
+    [DONE] = &&done,
+    [LOAD_REGISTER_VALUE] = &&load_register_value,
+    [LOAD_MEMORY_VALUE] = &&load_memory_value,
+    [OR] = &&or,
+    [AND] = &&and,
+    [BITWISE_OR] = &&bitwise_or,
+    [BITWISE_XOR] = &&bitwise_xor,
+    [BITWISE_AND] = &&bitwise_and,
+    [ISEQUAL] = &&isequal,
+    [IS_NOT_EQUAL] = &&is_not_equal,
+    [IS_LESS_THAN] = &&is_less_than,
+    [IS_LESS_OR_EQUAL] = &&is_less_or_equal,
+    [IS_GREATER_THAN] = &&is_greater_than,
+    [IS_GREATER_OR_EQUAL] = &&is_greater_or_equal,
+    [SHIFT_LEFT] = &&shift_left,
+    [SHIFT_RIGHT] = &&shift_right,
+    [ADD] = &&add,
+    [SUBTRACT] = &&subtract,
+    [MULTIPLY] = &&multiply,
+    [DIVIDE] = &&divide,
+    [MODULO] = &&modulo,
+    [NOT] = &&not,
+    [COMPLEMENT] = &&complement,
+    [NEGATE] = &&negate,
+  };
+  
+  unsigned int r [REGISTER_COUNT + CONSTANT_COUNT];
+  const bytecode_t * ip = code;
+  
+  memcpy (&r[REGISTER_COUNT], constants, constant_count * sizeof(constants[0]));
+  
+#define DISPATCH() goto *handlers[(++ip)->op]
+  
+#define OPERATION(label, expression)		\
+  label:					\
+  r[ip->dst] = (expression);			\
+  DISPATCH ()
+  
+#define A (r[ip->a])
+#define B (r[ip->b])
+  
+  goto *handlers[ip->op];
+  
+  OPERATION (load_register_value, env.get_register_value (ip->value.reg));
+  OPERATION (load_memory_value, env.get_memory_value (A));
+  
+  OPERATION (or, A || B);
+  OPERATION (and, A && B);
+  OPERATION (bitwise_or, A | B);
+  OPERATION (bitwise_xor, A ^ B);
+  OPERATION (bitwise_and, A & B);
+  OPERATION (isequal, A == B);
+  OPERATION (is_not_equal, A != B);
+  OPERATION (is_less_than, A < B);
+  OPERATION (is_less_or_equal, A <= B);
+  OPERATION (is_greater_than, A > B);
+  OPERATION (is_greater_or_equal, A >= B);
+  
+  // out of range shifts and divisions by 0 give 0
+  OPERATION (shift_left, B < 32 ? A << B : 0);
+  OPERATION (shift_right, B < 32 ? A >> B : 0);
+  OPERATION (add, A + B);
+  OPERATION (subtract, A - B);
+  OPERATION (multiply, A * B);
+  OPERATION (divide, 0 != B ? A / B : 0);
+  OPERATION (modulo, 0 != B ? A % B : 0);
+  
+  OPERATION (not, ! A);
+  OPERATION (complement, ~ A);
+  OPERATION (negate, - A);
+  
+#undef B
+#undef A
+#undef OPERATION
+#undef DISPATCH
   
-  assert (0 && "not reachable");
-  return NULL;
+ done:
+  return r[ip->a];
 }
 
-Node * parse_immediate (const char ** s)
+
+/**
+ * Evaluates an operation on constants with the VM itself, so that
+ * folding and execution can not disagree.
+ */
+static unsigned int fold (OpCode opcode, unsigned int a, unsigned int b)
 {
-  token_t t = next_token (*s);
-  if (t.type != IMMEDIATE)
+  const environment_t env = { NULL, NULL };
+  const unsigned int constants [] = { a, b };
+  const bytecode_t code [] = {
+    { .op = opcode, .dst = 0, .a = REGISTER_COUNT, .b = REGISTER_COUNT + 1 }
+    , { .op = DONE, .a = 0 }
+  };
+  
+  return vm_execute (constants, 2, code, env);
+}
+
+static Node * new_operation (node_type_t type
+			     , OpCode opcode
+			     , Node * left
+			     , Node * right)
+{
+  Node * node = NULL;
+  
+  if (NULL == left || (NODE_BINARY == type && NULL == right))
     {
-      parse_error (*s);
       return NULL;
     }
   
-  assert (t.repr_start < t.repr_end);
-    
-  *s = t.repr_end;
+  // constant folding, the tree is only built out of constants for it
+  // only for operators: [constant] is a load
+  if (NODE_IMMEDIATE == left->type
+      && (NODE_UNARY == type
+	  || (NODE_BINARY == type && NODE_IMMEDIATE == right->type)))
+    {
+      left->value.numeric = fold (opcode
+				  , left->value.numeric
+				  , NODE_BINARY == type ? right->value.numeric : 0);
+      return left;
+    }
   
-  {
-    Node * node = gc_malloc (sizeof(Node));
-    if (NULL == node) { return NULL; }
-        
-    node->type = IMMEDIATE;
-    node->value.numeric = t.value.numeric;
-    
-    return node;
-  }
-    
-  assert (0 && "not reachable");
-  return NULL;
+  node = new_node (type);
+  if (NULL == node) { return NULL; }
+  
+  node->value.opcode = opcode;
+  node->left = left;
+  node->right = right;
+  
+  return node;
 }
 
-Node * parse_operator (const char ** s)
+
+static bool expect_operator (const char ** s, operator_symbol_t value)
 {
   token_t t = next_token (*s);
-  if (t.type != OPERATOR)
+  if (t.type != OPERATOR || t.value.op->value != value)
     {
       parse_error (*s);
-      return NULL;
+      return false;
     }
-    
-  assert (t.repr_start < t.repr_end);
   
   *s = t.repr_end;
   
-  {
-    const size_t SYMBOL_SIZE = t.repr_end - t.repr_start;
-    
-    Node * node = gc_malloc (sizeof(Node));
-    if (NULL == node) { return NULL; }
-        
-    node->type = OPERATOR;
-    node->value.op = t.value.op;
-    
-    return node;
-  }
+  return true;
+}
+
+static Node * parse_binary (const char ** s, int min_precedence);
+
+// number, register, ( expression ) or [ expression ]
+static Node * parse_primary (const char ** s)
+{
+  Node * node = NULL;
+  token_t t = next_token (*s);
+  
+  switch (t.type)
+    {
+    case IMMEDIATE:
+      *s = t.repr_end;
+      node = new_node (NODE_IMMEDIATE);
+      if (NULL == node) { return NULL; }
+      
+      node->value.numeric = t.value.numeric;
+      return node;
+      
+    case SYMBOL:
+      {
+	size_t i = 0;
+	
+	*s = t.repr_end;
+	for (i = 0; i < sizeof(g_registers) / sizeof(g_registers[0]); ++i)
+	  {
+	    if (0 == strcasecmp (g_registers[i].name, t.value.symbol))
+	      {
+		node = new_node (NODE_REGISTER);
+		if (NULL == node) { return NULL; }
+		
+		node->value.reg = g_registers[i].reg;
+		return node;
+	      }
+	  }
+	
+	// there is no other symbol, it could never be evaluated
+	parse_error (t.repr_start);
+	return NULL;
+      }
+      
+    case OPERATOR:
+      if (OPERATOR_OPEN_PARENTHESIS == t.value.op->value)
+	{
+	  *s = t.repr_end;
+	  node = parse_binary (s, 1);
+	  
+	  return NULL != node && expect_operator (s, OPERATOR_CLOSE_PARENTHESIS)
+	    ? node
+	    : NULL;
+	}
+      if (OPERATOR_OPEN_BRACKET == t.value.op->value)
+	{
+	  *s = t.repr_end;
+	  node = new_operation (NODE_MEMORY, DONE, parse_binary (s, 1), NULL);
+	  
+	  return NULL != node && expect_operator (s, OPERATOR_CLOSE_BRACKET)
+	    ? node
+	    : NULL;
+	}
+      break;
+      
+    default:
+      break;
+    }
   
-  assert (0 && "not reachable");
+  parse_error (*s);
   return NULL;
 }
 
-Node * parse_expression (const char ** s)
+static Node * parse_unary (const char ** s)
 {
-  Node * op = NULL;
-  Node * immediate = NULL;
-  Node * symbol = parse_symbol (&s);
+  token_t t = next_token (*s);
   
-  if (NULL == symbol)
+  if (t.type == OPERATOR)
     {
-      return NULL;
+      OpCode opcode = DONE;
+      
+      switch (t.value.op->value)
+	{
+	case OPERATOR_NOT:
+	  opcode = NOT;
+	  break;
+	  
+	case OPERATOR_COMPLEMENT:
+	  opcode = COMPLEMENT;
+	  break;
+	  
+	case OPERATOR_MINUS:
+	  opcode = NEGATE;
+	  break;
+	  
+	default:
+	  break;
+	}
+      
+      if (DONE != opcode)
+	{
+	  *s = t.repr_end;
+	  return new_operation (NODE_UNARY, opcode, parse_unary (s), NULL);
+	}
     }
   
-  op = parse_operator (&s);
-  if (NULL == op)
+  return parse_primary (s);
+}
+
+/**
+ * Precedence climbing: parses the operators binding at least as tight
+ * as min_precedence, all of them being left associative.
+ */
+static Node * parse_binary (const char ** s, int min_precedence)
+{
+  Node * left = parse_unary (s);
+  
+  while (NULL != left)
     {
-      return NULL;
+      token_t t = next_token (*s);
+      
+      if (t.type != OPERATOR
+	  || 0 == t.value.op->precedence
+	  || t.value.op->precedence < min_precedence)
+	{
+	  break;
+	}
+      
+      *s = t.repr_end;
+      left = new_operation (NODE_BINARY
+			    , t.value.op->opcode
+			    , left
+			    , parse_binary (s, t.value.op->precedence + 1));
     }
   
-  immediate = parse_immediate (&s);
-  if (NULL == immediate)
+  return left;
+}
+
+Node * parse_expression (const char ** s)
+{
+  // the nodes are released with the arena
+  Node * node = parse_binary (s, 1);
+  
+  if (NULL != node && '\0' != *eatwhitespace (*s))
     {
+      parse_error (*s);
       return NULL;
     }
   
-  op->left = symbol;
-  op->right = immediate;
-  
-  return op;
+  return node;
 }
 
 Node * parse (const char * s)
 {
-  return parse_expression (s);
+  return parse_expression (&s);
 }
 
-void post_order_traverse (Node * node, void (*do_me) (Node *))
+
+/**
+ * Generates the code computing node in the VM register dst, the
+ * registers above it being free.
+ *
+ * @param result set to the register holding the value, dst or the
+ * constant register of a number
+ * @return 0 on success, non zero if the expression is too complex
+ */
+static int generate_opcodes (const Node * node
+			     , VM * vm
+			     , unsigned char dst
+			     , unsigned char * result)
 {
-  if (NULL == node)
+  bytecode_t * code = NULL;
+  unsigned char a = dst;
+  unsigned char b = dst + 1;
+  
+  if (NODE_IMMEDIATE == node->type)
     {
-      return;
+      if (vm->constant_count >= CONSTANT_COUNT)
+	{
+	  return 1;
+	}
+      
+      *result = REGISTER_COUNT + vm->constant_count;
+      vm->constants[vm->constant_count++] = node->value.numeric;
+      return EOK;
     }
   
-  if (node->left) post_order_traverse (node->left, do_me);
-  if (node->right) post_order_traverse (node->right, do_me);
+  if (dst + 1 >= REGISTER_COUNT)
+    {
+      return 1;
+    }
   
-  do_me (node);
-}
-
-// TBD my schorr-waite version
-void post_order_traverse_schorr_waite (Node * node, void (*do_me) (Node *))
-{
-  if (NULL == node)
+  if (NULL != node->left && EOK != generate_opcodes (node->left, vm, dst, &a))
     {
-      return;
+      return 1;
+    }
+  if (NULL != node->right && EOK != generate_opcodes (node->right, vm, dst + 1, &b))
+    {
+      return 1;
+    }
+  
+  // one more for DONE
+  if (vm->size + 1 >= CODE_SIZE)
+    {
+      return 1;
+    }
+  
+  code = &vm->code[vm->size++];
+  memset (code, 0, sizeof(*code));
+  code->dst = dst;
+  code->a = a;
+  code->b = b;
+  
+  switch (node->type)
+    {
+    case NODE_REGISTER:
+      code->op = LOAD_REGISTER_VALUE;
+      code->value.reg = node->value.reg;
+      break;
+      
+    case NODE_MEMORY:
+      code->op = LOAD_MEMORY_VALUE;
+      break;
+      
+    case NODE_IMMEDIATE:
+    case NODE_UNARY:
+    case NODE_BINARY:
+      code->op = node->value.opcode;
+      break;
     }
   
-  if (node->left) post_order_traverse (node->left, do_me);
-  if (node->right) post_order_traverse (node->right, do_me);
+  *result = dst;
   
-  do_me (node);
+  return EOK;
 }
 
 
-// small stack based VM
-// 32bits stack
 
-typedef enum OpCode
-  {
-    DONE = -1,
-    ISEQUAL,
-    IS_GREATER_THAN,
-    INC,
-    PUSH_IMMEDIATE_VALUE,
-    PUSH_SYMBOL_VALUE,
-    
-  } OpCode;
+////////////////////////////////////////
+//
+//     public
+// 
+//////////////////////////////////////// 
 
-typedef unsigned long long opcode_t;
-typedef unsigned long long stack_element_t;
 
-typedef struct VM
+struct compiled_command_t
 {
-  enum
-    {
-      STACK_SIZE = 1024,
-      CODE_SIZE = 1024,
-    };
-  
-  stack_element_t stack[STACK_SIZE];
-  unsigned short sp;
+  unsigned int constants [CONSTANT_COUNT];
+  unsigned char constant_count;
   
-  opcode_t opcodes[CODE_SIZE];
-  unsigned short ip;
-
-} VM;
+  // only as long as needed
+  unsigned short size;
+  bytecode_t code [];
+};
 
 
-int vm_push_stack (VM * vm, stack_element_t e)
+/**
+ * Parses & generates the code of a command in vm.
+ *
+ * @return 0 on success
+ */
+static int compile_into (const char * const command, VM * vm)
 {
-  assert (NULL != vm);
+  int result = 1;
+  unsigned char value = 0;
+  Node * tree = parse (command);
   
-  if (vm->sp >= STACK_SIZE)
+  vm->size = 0;
+  vm->constant_count = 0;
+  if (NULL != tree)
     {
-      // overflow
-      return 1;
+      result = generate_opcodes (tree, vm, 0, &value);
+      if (EOK != result)
+	{
+	  parse_error ("expression too complex");
+	}
+      else
+	{
+	  vm->code[vm->size++] = (bytecode_t) { .op = DONE, .a = value };
+	}
     }
   
-  vm->stack[vm->sp++] = e;
+  // the symbol names are interned, not in there
+  arena_release (&g_arena);
   
-  return EOK;
+  return result;
 }
 
-stack_element_t vm_pop_stack (VM * vm)
-{
-  assert (NULL != vm);
-  
-  if (vm->sp == 0)
-    {
-      // mmmh better way to report underflow
-      return (stack_element_t) -1;
-    }
-    
-  return vm->stack[--vm->sp];
-}
 
-unsigned int
-vm_execute (VM * vm, environment_t env)
+compiled_command_t * compile_command (const char * const command)
 {
-  if (NULL == vm)
+  // reused from one command to the next
+  static VM vm;
+  compiled_command_t * compiled = NULL;
+  
+  if (EOK != compile_into (command, &vm))
     {
-      // need a proper way to report
-      return;
+      return NULL;
     }
   
-  vm->ip = 0;
-  
-  for (;;)
+  compiled = gc_malloc (sizeof(compiled_command_t) + vm.size * sizeof(bytecode_t));
+  if (NULL == compiled)
     {
-      switch (vm->opcodes[vm->ip++])
-        {
-        case OPERATOR_EQUAL:
-	  {
-	    stack_element_t s1 = vm_pop_stack(vm);
-	    stack_element_t s2 = vm_pop_stack(vm);
-	    
-	    vm_push_stack (vm, s1 == s2);
-	  }
-	  break;
-	  
-	case OPERATOR_IS_GREATER_THAN:
-	  {
-	    stack_element_t top = vm_pop_stack(vm);
-	    stack_element_t bottom = vm_pop_stack(vm);
-	    
-	    vm_push_stack (vm, bottom > top);
-	  }
-	  break;
-	  
-        case PUSH_IMMEDIATE_VALUE:
-	  vm_push_stack (vm, vm->opcodes[vm->ip++]);
-	  break;
-	  
-        case PUSH_SYMBOL_VALUE:
-	  vm_push_stack (vm, env.get_symbol_value (vm->opcodes[vm->ip++]));
-	  break;
-	  
-	default:
-	  goto done;
-	  break;
-        }
+      return NULL;
     }
   
- done:
-  return vm_pop_stack (vm);
+  memcpy (compiled->constants, vm.constants, vm.constant_count * sizeof(vm.constants[0]));
+  compiled->constant_count = vm.constant_count;
+  compiled->size = vm.size;
+  memcpy (compiled->code, vm.code, vm.size * sizeof(bytecode_t));
+  
+  return compiled;
 }
 
-void generate_opcodes (Node * node, VM * vm)
+
+int evaluate_compiled_command (compiled_command_t * compiled
+			       , environment_t env
+			       , unsigned int * result)
 {
-  void build_stack_from_node (Node * node)
-  {
-#define VALIDATE_VM_CODE_ARRAY(vm)
-    
-    if (NULL == node)
-      {
-	return;
-      }
-    
-    // pretty lamely use the ip as a "sp"
-    
-    switch (node->type)
-      {
-      case IMMEDIATE:
-	
-	vm->opcodes[vm->ip++] = PUSH_IMMEDIATE_VALUE;
-	vm->opcodes[vm->ip++] = node->value.numeric;
-	break;
-        
-      case SYMBOL:
-        
-	vm->opcodes[vm->ip++] = PUSH_SYMBOL_VALUE;
-	vm->opcodes[vm->ip++] = node->value.symbol;
-	break;
-	
-      case OPERATOR:
-        
-	vm->opcodes[vm->ip++] = node->value.op;
-	break;
-      }
-  }
-  
-  vm->ip = 0;
-  vm->opcodes[vm->ip] = DONE;
-  
-  post_order_traverse (node, build_stack_from_node);
+  if (NULL == compiled)
+    {
+      return -1;
+    }
   
-  // pretty hacky
-  vm->opcodes[vm->ip++] = DONE;
+  *result = vm_execute (compiled->constants
+			, compiled->constant_count
+			, compiled->code
+			, env);
+  return EOK;
 }
 
 
-
-////////////////////////////////////////
-//
-//     public
-// 
-//////////////////////////////////////// 
+void free_compiled_command (compiled_command_t * compiled)
+{
+  // the code references nothing else
+  gc_free (compiled);
+}
 
 
 int execute_command (const char * const command
-		     , environment_t env)
+		     , environment_t env
+		     , unsigned int * result)
 {
-  VM vm = {0};
-  generate_opcodes (parse (command), &vm);
-  return vm_execute (&vm, env);
+  // reused from one command to the next, rather than a new one
+  static VM vm;
+  
+  if (EOK != compile_into (command, &vm))
+    {
+      return -1;
+    }
+  
+  *result = vm_execute (vm.constants, vm.constant_count, vm.code, env);
+  return EOK;
 }
 
 
@@ -691,38 +1102,41 @@ int execute_command (const char * const command
 
 #include <stdio.h>
 
+static unsigned int register_value (expression_register_t reg)
+{
+  return reg;
+}
+
+static unsigned int memory_value (unsigned int address)
+{
+  return address + 1;
+}
+
 int main ()
 {
-  token_t t;
-  const char * s = "";
-  
-  VM vm;
-  
-  printf ("0 - testing '%s'\n", s);
-  generate_opcodes (parse (""), &vm);
-  printf ("0 - %d\n", vm_execute (&vm));
-  
-  s = "d";
-  printf ("1 - testing '%s'\n", s);
-  generate_opcodes (parse (s), &vm);
-  printf ("1 - %d\n", vm_execute (&vm));
-  
-  s = "IP = 12";
-  printf ("2 - testing '%s'\n", s);
-  generate_opcodes (parse (s), &vm);
-  printf ("2 - %d\n", vm_execute (&vm));
-  printf ("IP = 0x%08X\n", vm.ip);
-  
-  s = "IP > 0";
-  printf ("2.5 - testing '%s'\n", s);
-  generate_opcodes (parse (s), &vm);
-  printf ("2.5 - %d\n", vm_execute (&vm));
-  printf ("IP = 0x%08X\n", vm.ip);
+  static const char * const tests [] = {
+    "", "d", "IP = 12", "IP > 0", " 2 33 4 =", "A + B * 2 == 2", "[SP] == 9 && !(J < 7)"
+    , "[0x1000]", "[4000] = 5", "[0x10+2]", "PX == 3"
+  };
+  environment_t env = {
+    .get_register_value = register_value,
+    .get_memory_value = memory_value
+  };
+  size_t i = 0;
+  unsigned int result = 0;
   
-  s = " 2 33 4 =";
-  printf ("3 - testing '%s'\n", s);
-  generate_opcodes (parse (s), &vm);
-  printf ("3 - %d\n", vm_execute (&vm));
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+    {
+      printf ("%zu - testing '%s'\n", i, tests[i]);
+      if (EOK == execute_command (tests[i], env, &result))
+	{
+	  printf ("%zu - %u\n", i, result);
+	}
+      else
+	{
+	  printf ("%zu - error\n", i);
+	}
+    }
   
   return 0;
 }
@@ -1,21 +1,75 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+// registers an expression can refer to, A to J in the order of the dcpu
+typedef enum expression_register_t
+  {
+    EXPRESSION_A,
+    EXPRESSION_B,
+    EXPRESSION_C,
+    EXPRESSION_X,
+    EXPRESSION_Y,
+    EXPRESSION_Z,
+    EXPRESSION_I,
+    EXPRESSION_J,
+    EXPRESSION_SP,
+    EXPRESSION_PC,
+    EXPRESSION_O,
+    
+  } expression_register_t;
+
 typedef struct environment_t
 {
-  unsigned int (*get_symbol_value) (const char * const symbol);
+  unsigned int (*get_register_value) (expression_register_t reg);
+  
+  // [address]
+  unsigned int (*get_memory_value) (unsigned int address);
   
 } environment_t;
 
 
 /**
+ * A command is an expression of registers (A to J, SP, PC or IP, O),
+ * memory ([expression]) and numbers, combined by the C operators
+ * || && | ^ & == != < <= > >= << >> + - * / % and the unary ! ~ -,
+ * with their C precedence ('=' being the same as '=='). The values are
+ * unsigned, a division by 0 gives 0.
  *
  * @param command the command that needs to be parsed / executed
  * @param env the environment sink that is to be used to retrieved data "about the outside"
- * @return result of the execution
+ * @param result where the value of the command is stored, any
+ *   unsigned value being valid
+ * @return 0 on success, -1 if the command could not be parsed
  */
 int execute_command (const char * const command
-		     , environment_t env);
+		     , environment_t env
+		     , unsigned int * result);
+
+
+typedef struct compiled_command_t compiled_command_t;
+
+/**
+ * Parses a command once so that it can be evaluated repeatedly
+ * without going through the parser again.
+ *
+ * @param command the command that needs to be parsed
+ * @return the compiled command or NULL if it could not be parsed
+ */
+compiled_command_t * compile_command (const char * const command);
+
+/**
+ * Evaluates a compiled command, true if its result is not 0.
+ *
+ * @param compiled a command returned by compile_command
+ * @param env the environment sink that is to be used to retrieved data "about the outside"
+ * @param result where the value of the command is stored
+ * @return 0 on success, -1 if compiled is NULL
+ */
+int evaluate_compiled_command (compiled_command_t * compiled
+			       , environment_t env
+			       , unsigned int * result);
+
+void free_compiled_command (compiled_command_t * compiled);
 
 #endif // #ifndef PARSER_H
 
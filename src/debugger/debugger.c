@@ -1,3 +1,5 @@
+#include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,10 +12,6 @@
 #endif
 
 
-static int debugger_console (debugger_t * debugger);
-static int handle_command (debugger_t * debugger, const char * command);
-
-
 static int trim_end (char * const s, const char * const seps)
 {
   if (NULL == s || NULL == seps)
@@ -39,113 +37,491 @@ static int trim_end (char * const s, const char * const seps)
   return EOK;
 }
 
-static int debugger_console (debugger_t * debugger)
+// returned by a command to leave the debugger
+#define QUIT (-1)
+
+
+// @return true if only blanks are left in s
+static int at_end (const char * s)
+{
+  while (isspace ((unsigned char) *s))
+    {
+      ++s;
+    }
+  
+  return '\0' == *s;
+}
+
+// parses a number (in any base strtoull knows) at *s, then moves *s
+// past it, @return 0 if there is none
+static int parse_number (const char ** s, unsigned long long * value)
 {
-  static const char * const prompt = "> ";
+  char * end = NULL;
   
-  printf ("Debugger console (h to help)\n");
+  *value = strtoull (*s, &end, 0);
+  if (end == *s)
+    {
+      return 0;
+    }
   
-  while (1)
+  *s = end;
+  return 1;
+}
+
+// parses address<:length>, length being 1 if not given
+static int parse_range (const char * arguments
+			, unsigned long long * address
+			, unsigned long long * length)
+{
+  *length = 1;
+  
+  if (! parse_number (&arguments, address))
+    {
+      return 0;
+    }
+  
+  if (':' == *arguments)
+    {
+      ++arguments;
+      if (! parse_number (&arguments, length))
+	{
+	  return 0;
+	}
+    }
+  
+  return at_end (arguments);
+}
+
+
+// the command handlers, returning EINVAL to have the usage printed
+
+static int help (debugger_t * debugger, const char * arguments)
+{
+  printf ("where: printf the current IP location\n");
+  printf ("next: executes the next instruction\n");
+  printf ("peek-next (pn): prints the next instruction\n");
+  printf ("registers: dumps the current state of registers\n");
+  printf ("run-until [expression]: runs the program until the expression\n"
+	  "\tevaluates to true.\n"
+	  "\tThe expression uses the registers (A to J, SP, PC, O), memory\n"
+	  "\t('[SP + 1]'), numbers and the C operators, e.g.\n"
+	  "\t'PC == 0x1a && [0x8000 + I] != 0 || !(A < 3)'.\n"
+	  "\tOnly the instruction it stops at is printed.\n");
+  printf ("progress [n]: during run-until, prints the current instruction\n"
+	  "\tevery n instructions (0 to disable)\n");
+  printf ("break [address] <if [condition]>: stops before executing the\n"
+	  "\tinstruction at address, only if the condition (same syntax\n"
+	  "\tas run-until) evaluates to true when given\n");
+  printf ("delete <address>: removes the breakpoint at address\n"
+	  "\t(all breakpoints if no address is given)\n");
+  printf ("watch [address]<:length>: stops after an instruction writes\n"
+	  "\tone of the length (1 by default) words from address\n");
+  printf ("rwatch [address]<:length>: same as watch, for the reads\n");
+  printf ("unwatch <address<:length>>: removes the watchpoints of\n"
+	  "\tthese words (all watchpoints if no address is given)\n");
+  printf ("continue: runs the program until a breakpoint is hit\n");
+  printf ("step-back <n>: undoes the last n instructions (1 by default)\n");
+  printf ("reverse-continue: undoes instructions until a breakpoint is hit\n");
+  printf ("q: quit\n");
+  printf ("Any unambiguous prefix of a command can be used, e.g. 'c'.\n");
+  
+  return EOK;
+}
+
+static int quit (debugger_t * debugger, const char * arguments)
+{
+  return QUIT;
+}
+
+static int where (debugger_t * debugger, const char * arguments)
+{
+  return debugger->where ();
+}
+
+static int peek_next (debugger_t * debugger, const char * arguments)
+{
+  return debugger->peek_next ();
+}
+
+static int next (debugger_t * debugger, const char * arguments)
+{
+  return debugger->next ();
+}
+
+static int cont (debugger_t * debugger, const char * arguments)
+{
+  return debugger->cont ();
+}
+
+static int registers (debugger_t * debugger, const char * arguments)
+{
+  return debugger->registers ();
+}
+
+static int reverse_continue (debugger_t * debugger, const char * arguments)
+{
+  return debugger->reverse_continue ();
+}
+
+static int run_until (debugger_t * debugger, const char * arguments)
+{
+  if (at_end (arguments))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->run_until (arguments);
+}
+
+static int progress (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long every = 0;
+  
+  if (! parse_number (&arguments, &every) || ! at_end (arguments))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->progress (every);
+}
+
+static int set_breakpoint (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long address = 0;
+  
+  if (! parse_number (&arguments, &address))
+    {
+      return EINVAL;
+    }
+  
+  if (at_end (arguments))
+    {
+      return debugger->set_breakpoint (address, NULL);
+    }
+  
+  while (isspace ((unsigned char) *arguments))
+    {
+      ++arguments;
+    }
+  if (0 != strncmp (arguments, "if", 2)
+      || ! isspace ((unsigned char) arguments[2])
+      || at_end (arguments + 2))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->set_breakpoint (address, arguments + 3);
+}
+
+static int delete_breakpoint (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long address = 0;
+  
+  if (at_end (arguments))
+    {
+      return debugger->delete_all_breakpoints ();
+    }
+  
+  if (! parse_number (&arguments, &address) || ! at_end (arguments))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->delete_breakpoint (address);
+}
+
+static int set_watchpoint (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long address = 0;
+  unsigned long long length = 0;
+  
+  if (! parse_range (arguments, &address, &length))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->set_watchpoint (address, length, 0);
+}
+
+static int set_read_watchpoint (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long address = 0;
+  unsigned long long length = 0;
+  
+  if (! parse_range (arguments, &address, &length))
     {
-      char buf[64] = {0};
+      return EINVAL;
+    }
+  
+  return debugger->set_watchpoint (address, length, 1);
+}
+
+static int delete_watchpoint (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long address = 0;
+  unsigned long long length = 0;
+  
+  if (at_end (arguments))
+    {
+      return debugger->delete_watchpoint (0, 0);
+    }
+  
+  if (! parse_range (arguments, &address, &length) || 0 == length)
+    {
+      return EINVAL;
+    }
+  
+  return debugger->delete_watchpoint (address, length);
+}
+
+static int step_back (debugger_t * debugger, const char * arguments)
+{
+  unsigned long long count = 1;
+  
+  if (! at_end (arguments)
+      && (! parse_number (&arguments, &count) || ! at_end (arguments)))
+    {
+      return EINVAL;
+    }
+  
+  return debugger->step_back (count);
+}
+
+
+typedef struct command_t
+{
+  const char * name;
+  // NULL for the commands without arguments
+  const char * usage;
+  int (* handle) (debugger_t * debugger, const char * arguments);
+  
+} command_t;
+
+// a prefix shared by several commands selects the first one, e.g. 'r'
+// is registers and 'rev' reverse-continue
+static const command_t COMMANDS [] = {
+  { "help", NULL, help },
+  { "q", NULL, quit },
+  { "where", NULL, where },
+  { "peek-next", NULL, peek_next },
+  { "pn", NULL, peek_next },
+  { "next", NULL, next },
+  { "continue", NULL, cont },
+  { "registers", NULL, registers },
+  { "reverse-continue", NULL, reverse_continue },
+  { "run-until", "[expression]", run_until },
+  { "break", "[address] <if [condition]>", set_breakpoint },
+  { "delete", "<address>", delete_breakpoint },
+  { "watch", "[address]<:length>", set_watchpoint },
+  { "rwatch", "[address]<:length>", set_read_watchpoint },
+  { "unwatch", "<address<:length>>", delete_watchpoint },
+  { "step-back", "<n>", step_back },
+  { "progress", "[n]", progress }
+};
+
+#define COMMAND_COUNT (sizeof(COMMANDS) / sizeof(COMMANDS[0]))
+
+
+// the command names are made of 'a' to 'z' and '-'
+#define TRIE_ALPHABET 27
+// at most one per character of the names, plus the root
+#define TRIE_CAPACITY 128
+
+typedef struct trie_node_t
+{
+  // 0 if no name goes on with this character, the root being no child
+  unsigned char children [TRIE_ALPHABET];
+  // in COMMANDS, -1 if no command starts with this prefix
+  signed char command;
+  
+} trie_node_t;
+
+// every prefix of every name, built before the first command is run
+static trie_node_t g_trie [TRIE_CAPACITY];
+static size_t g_trie_size = 0;
+
+// @return the child index of c, -1 if no name has it
+static int trie_index (char c)
+{
+  if (c >= 'a' && c <= 'z')
+    {
+      return c - 'a';
+    }
+  
+  return '-' == c ? TRIE_ALPHABET - 1 : -1;
+}
+
+static void build_trie (void)
+{
+  size_t c = 0;
+  
+  g_trie_size = 1;
+  g_trie[0].command = -1;
+  
+  for (c = 0; c < COMMAND_COUNT; ++c)
+    {
+      trie_node_t * node = &g_trie[0];
+      const char * name = NULL;
       
-      printf (prompt);
+      for (name = COMMANDS[c].name; '\0' != *name; ++name)
+	{
+	  int index = trie_index (*name);
+	  
+	  assert (index >= 0);
+	  if (0 == node->children[index])
+	    {
+	      assert (g_trie_size < TRIE_CAPACITY);
+	      g_trie[g_trie_size].command = -1;
+	      node->children[index] = (unsigned char) g_trie_size++;
+	    }
+	  node = &g_trie[node->children[index]];
+	  
+	  if (-1 == node->command)
+	    {
+	      node->command = (signed char) c;
+	    }
+	}
+      
+      // a whole name always selects its command
+      node->command = (signed char) c;
+    }
+}
+
+// looks up the word at the start of line, @return NULL if unknown,
+// moving *arguments past it otherwise
+static const command_t * find_command (const char * line
+				       , const char ** arguments)
+{
+  const trie_node_t * node = &g_trie[0];
+  
+  for (; '\0' != *line && ! isspace ((unsigned char) *line); ++line)
+    {
+      int index = trie_index (*line);
       
-      if (fgets (buf, sizeof(buf), stdin))
+      if (index < 0 || 0 == node->children[index])
 	{
-	  trim_end (buf, "\r\n");
-	  handle_command (debugger, buf);
+	  return NULL;
 	}
+      node = &g_trie[node->children[index]];
     }
   
-  return EOK;
+  if (-1 == node->command)
+    {
+      return NULL;
+    }
+  
+  *arguments = line;
+  return &COMMANDS[node->command];
 }
 
 static int handle_command (debugger_t * debugger, const char * command)
 {
+  const command_t * found = NULL;
+  const char * arguments = NULL;
+  int result = EOK;
+  
   if (NULL == command || NULL == debugger)
     {
       return EINVAL;
     }
   
-  if (0 == strncmp (command, "h", strlen(command)))
+  if (0 == g_trie_size)
     {
-      // TODO should be handled better
-      printf ("where: printf the current IP location\n");
-      printf ("next: executes the next instruction\n");
-      printf ("registers: dumps the current state of registers\n");
-      printf ("run-until [symbol] [=|>] [value]: runs the program until the command\n"
-	      "\tevaluates to true.\n"
-	      "\tThe command is a symbol ('IP') followed by an operator ('=' or '>')\n"
-	      "\tfollowed by a value.\n");
-      printf ("q: quit\n");
-      return EOK;
+      build_trie ();
     }
   
-  if (0 == strncmp (command, "q", strlen(command)))
+  while (isspace ((unsigned char) *command))
     {
-      return 1;
+      ++command;
     }
   
-  if (0 == strncmp (command, "where", strlen(command))
-      && NULL != debugger->where)
+  // blank lines and comments
+  if ('\0' == *command || '#' == *command)
     {
-      debugger->where ();
       return EOK;
     }
   
-  if (0 == strncmp (command, "peek-next", strlen(command))
-       || 0 == strncmp (command, "pn", strlen(command))
-      && NULL != debugger->peek_next)
+  found = find_command (command, &arguments);
+  if (NULL == found)
     {
-      debugger->peek_next ();
-      return EOK;
+      printf ("'%s' is an unknown command (type 'h' for help)\n", command);
+      return EINVAL;
     }
   
-  if (
-      (0 == strncmp (command, "next", strlen(command))
-       || 0 == strncmp (command, "n", strlen(command)))
-      && NULL != debugger->next)
+  if (NULL == found->usage && ! at_end (arguments))
     {
-      debugger->next ();
-      return EOK;
+      printf ("%s takes no argument\n", found->name);
+      return EINVAL;
     }
   
-  if (0 == strncmp (command, "registers", strlen(command))
-      && NULL != debugger->registers)
+  result = found->handle (debugger, arguments);
+  if (EINVAL == result)
     {
-      debugger->registers ();
-      return EOK;
+      printf ("usage: %s %s\n", found->name, found->usage);
     }
   
-  {
-    // bad usage of macro (multiple eval of a and b)
-#if defined(MIN)
-#error MIN already defined
-#endif
-    
-#define MIN(a,b) ((a) > (b) ? (b) : (a))
-    
-    const char * COMMAND_NAME = "run-until";
-    
-    if (0 == strncmp (command
-		      , COMMAND_NAME
-		      , MIN (strlen(command)
-			     , strlen(COMMAND_NAME)
-			     )
-		      )
-	&& NULL != debugger->run_until)
-      {
-	debugger->run_until (command + strlen(COMMAND_NAME));
-	return EOK;
-      }
-    
-#undef MIN
-  }
+  return result;
+}
+
+
+// runs the commands of input, one per line, prompting for each one if
+// interactive, until the end of input or q
+static int debugger_console (debugger_t * debugger
+			     , FILE * input
+			     , int interactive)
+{
+  char * line = NULL;
+  size_t capacity = 0;
+  unsigned long number = 0;
+  int result = EOK;
+  
+  if (interactive)
+    {
+      printf ("Debugger console (h to help)\n");
+    }
   
-  printf ("'%s' is an unknown command (type 'h' for help)\n", command);
+  while (1)
+    {
+      if (interactive)
+	{
+	  printf ("> ");
+	  fflush (stdout);
+	}
+      
+      if (-1 == getline (&line, &capacity, input))
+	{
+	  if (interactive)
+	    {
+	      printf ("\n");
+	    }
+	  break;
+	}
+      ++number;
+      trim_end (line, "\r\n");
+      
+      result = handle_command (debugger, line);
+      
+      // the output of a command is only written once it is done
+      fflush (stdout);
+      
+      if (QUIT == result)
+	{
+	  result = EOK;
+	  break;
+	}
+      
+      // a script does not go on with a state it did not expect
+      if (EOK != result && ! interactive)
+	{
+	  fprintf (stderr, "line %lu failed: %s\n", number, line);
+	  break;
+	}
+      result = EOK;
+    }
   
-  return EOK;
+  free (line);
+  
+  return result;
 }
 
 
@@ -156,5 +532,16 @@ int run_debugger (debugger_t * debugger)
       return EINVAL;
     }
   
-  return debugger_console (debugger);
+  return debugger_console (debugger, stdin, 1);
+}
+
+
+int run_debugger_script (debugger_t * debugger, FILE * script)
+{
+  if (NULL == debugger || NULL == script)
+    {
+      return EINVAL;
+    }
+  
+  return debugger_console (debugger, script, 0);
 }
@@ -1,6 +1,8 @@
 #if ! defined (DEBUGGER_H)
 #define DEBUGGER_H
 
+#include <stdio.h>
+
 typedef struct instruction_t
 {
   unsigned int v;
@@ -15,11 +17,46 @@ typedef struct debugger_t
   int (* registers) (void);
   int (* run_until) (const char * const arguments);
   
+  // print the current instruction every 'every' instructions during
+  // a run-until (0 to only print where it stops)
+  int (* progress) (unsigned long long every);
+  
+  // condition is NULL for an unconditional breakpoint
+  int (* set_breakpoint) (unsigned int address, const char * const condition);
+  int (* delete_breakpoint) (unsigned int address);
+  int (* delete_all_breakpoints) (void);
+  
+  // stops after an instruction writes (or, if reads is non zero, reads)
+  // ram in address to address + length - 1
+  int (* set_watchpoint) (unsigned int address, unsigned int length, int reads);
+  // both kinds, all of them if length is 0
+  int (* delete_watchpoint) (unsigned int address, unsigned int length);
+  
+  // runs until a breakpoint is hit
+  int (* cont) (void);
+  
+  // undo the last executed instructions
+  int (* step_back) (unsigned long long count);
+  int (* reverse_continue) (void);
+  
   instruction_t * instructions;
   
 } debugger_t;
 
+/**
+ * Prompts for commands on the standard input until q or its end.
+ */
 int run_debugger (debugger_t *);
 
+/**
+ * Runs the commands of script, one per line, without prompting. The
+ * blank lines and the lines starting with '#' are skipped, any command
+ * can be abbreviated as on the console.
+ *
+ * @return 0, or the status of the first command that failed, which
+ * stops the script
+ */
+int run_debugger_script (debugger_t *, FILE * script);
+
 #endif
 
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "disassembler.h"
+#include "predecode.h"
+
+
+// output chunk of disassemble_to_file
+#define DISASSEMBLER_BUFFER_SIZE (64 * 1024)
+
+// longest line: address, instruction and separators
+#define DISASSEMBLED_LINE_SIZE (DISASSEMBLED_INSTRUCTION_SIZE + 16)
+
+// words per chunk of disassemble_to_file_parallel
+#define DISASSEMBLER_CHUNK_WORDS (64 * 1024)
+
+static const char * const register_names [REGISTER_COUNT] = {
+  "A", "B", "C", "X", "Y", "Z", "I", "J"
+};
+
+static const char hex_digits [] = "0123456789ABCDEF";
+
+
+// the writers below return the new end of the text, the caller
+// providing enough room
+
+static inline char *
+put_string (char * p, const char * s)
+{
+  while ('\0' != *s)
+    {
+      *p++ = *s++;
+    }
+  return p;
+}
+
+// "0x" followed by 'digits' upper case hex digits
+static inline char *
+put_hex (char * p, unsigned int value, unsigned char digits)
+{
+  *p++ = '0';
+  *p++ = 'x';
+  while (digits-- > 0)
+    {
+      *p++ = hex_digits[(value >> (4 * digits)) & 0xf];
+    }
+  return p;
+}
+
+
+// same text as stringify_value
+static char *
+put_operand (char * p, unsigned char value, const word * words, size_t count, size_t * used)
+{
+#define NEXT_WORD() (*used < count ? words[(*used)++] : ((*used)++, 0))
+
+  if (value <= 0x07)
+    {
+      return put_string (p, register_names[value]);
+    }
+  if (value <= 0x0f)
+    {
+      *p++ = '[';
+      p = put_string (p, register_names[value - 0x08]);
+      *p++ = ']';
+      return p;
+    }
+  if (value <= 0x17)
+    {
+      *p++ = '[';
+      p = put_hex (p, NEXT_WORD (), 4);
+      p = put_string (p, " + ");
+      p = put_string (p, register_names[value - 0x10]);
+      *p++ = ']';
+      return p;
+    }
+
+  switch (value)
+    {
+    case 0x18:
+      return put_string (p, "POP");
+
+    case 0x19:
+      return put_string (p, "PEEK");
+
+    case 0x1a:
+      return put_string (p, "PUSH");
+
+    case 0x1b:
+      return put_string (p, "SP");
+
+    case 0x1c:
+      return put_string (p, "PC");
+
+    case 0x1d:
+      return put_string (p, "O");
+
+    case 0x1e:
+      *p++ = '[';
+      p = put_hex (p, NEXT_WORD (), 4);
+      *p++ = ']';
+      return p;
+
+    case 0x1f:
+      return put_hex (p, NEXT_WORD (), 4);
+
+    default:
+      return put_hex (p, value - 0x20, 4);
+    }
+
+#undef NEXT_WORD
+}
+
+
+// writes the instruction (not terminated), @return the new end
+static char *
+put_instruction (char * p, const word * words, size_t count, size_t * used)
+{
+  word value = count > 0 ? words[0] : 0;
+  unsigned char opcode = extract_opcode (value);
+
+  *used = 1;
+
+  if (0 == opcode)
+    {
+      p = put_string (p, 0x01 == extract_a (value) ? "JSR " : "UNKNOWN ");
+      return put_operand (p, extract_b (value), words, count, used);
+    }
+
+  p = put_string (p, opcodes[opcode].name);
+  *p++ = ' ';
+  p = put_operand (p, extract_a (value), words, count, used);
+  *p++ = ',';
+  *p++ = ' ';
+  return put_operand (p, extract_b (value), words, count, used);
+}
+
+
+unsigned char
+format_instruction (char * buffer
+		    , size_t size
+		    , const word * words
+		    , size_t count)
+{
+  char text [DISASSEMBLED_INSTRUCTION_SIZE];
+  size_t used = 0;
+  size_t length = put_instruction (text, words, count, &used) - text;
+
+  if (NULL != buffer && size > 0)
+    {
+      if (length >= size)
+	{
+	  length = size - 1;
+	}
+      memcpy (buffer, text, length);
+      buffer[length] = '\0';
+    }
+
+  return (unsigned char) used;
+}
+
+
+// writes the line of the instruction at pc, @return the new end
+static char *
+put_line (char * p, const word program [], size_t size, size_t pc, size_t * used)
+{
+  // same layout as the original printf ("0x%08X: %s \n")
+  p = put_hex (p, (unsigned int) pc, 8);
+  *p++ = ':';
+  *p++ = ' ';
+  p = put_instruction (p, &program[pc], size - pc, used);
+  *p++ = ' ';
+  *p++ = '\n';
+
+  return p;
+}
+
+
+int
+disassemble_to_file (const word program []
+		     , size_t size
+		     , FILE * out)
+{
+  char buffer [DISASSEMBLER_BUFFER_SIZE];
+  char * p = buffer;
+  size_t pc = 0;
+
+  while (pc < size)
+    {
+      size_t used = 0;
+
+      p = put_line (p, program, size, pc, &used);
+      pc += used;
+
+      // keep room for a full line
+      if ((size_t) (p - buffer) > sizeof(buffer) - DISASSEMBLED_LINE_SIZE)
+	{
+	  if (1 != fwrite (buffer, p - buffer, 1, out))
+	    {
+	      return 1;
+	    }
+	  p = buffer;
+	}
+    }
+
+  if (p != buffer && 1 != fwrite (buffer, p - buffer, 1, out))
+    {
+      return 1;
+    }
+
+  return 0;
+}
+
+
+// the program is cut in fixed size chunks. Instructions span up to
+// DECODE_CACHE_MAX_SPAN words, so the first instruction of a chunk
+// starts at one of its first DECODE_CACHE_MAX_SPAN words, depending on
+// where the last instruction of the previous chunk ends. All the chunks
+// first work out, from the instruction lengths only, where decoding
+// leaves them for each of these entries; chaining the exits gives the
+// real entry of every chunk, then the chunks are formatted.
+
+typedef struct chunk_t
+{
+  const word * program;
+  size_t size;
+
+  // [start, end) of program
+  size_t start;
+  size_t end;
+
+  // for each entry offset, the offset past end where decoding leaves
+  unsigned char exits [DECODE_CACHE_MAX_SPAN];
+
+  // real entry offset, once known
+  unsigned char entry;
+
+  // formatted text, room for a line per word
+  char * text;
+  size_t length;
+
+} chunk_t;
+
+typedef struct chunk_worker_t
+{
+  pthread_t thread;
+
+  chunk_t * chunks;
+  // chunks [first, last) by steps of 'stride'
+  size_t first;
+  size_t last;
+  size_t stride;
+
+} chunk_worker_t;
+
+
+static void *
+find_exits (void * data)
+{
+  chunk_worker_t * worker = data;
+  // instruction starts decoded from the entry 0 of the current chunk
+  static __thread uint64_t starts [DISASSEMBLER_CHUNK_WORDS / 64];
+  size_t c = 0;
+
+  for (c = worker->first; c < worker->last; c += worker->stride)
+    {
+      chunk_t * chunk = &worker->chunks[c];
+      size_t pc = chunk->start;
+      unsigned char entry = 0;
+
+      memset (starts, 0, sizeof(starts));
+
+      while (pc < chunk->end)
+	{
+	  starts[(pc - chunk->start) / 64] |= (uint64_t) 1 << ((pc - chunk->start) % 64);
+	  pc += instruction_length (chunk->program[pc]);
+	}
+      chunk->exits[0] = (unsigned char) (pc - chunk->end);
+
+      // the other entries usually fall in step with entry 0 after a
+      // few instructions, from then on they leave at the same place
+      for (entry = 1; entry < DECODE_CACHE_MAX_SPAN; ++entry)
+	{
+	  pc = chunk->start + entry;
+	  while (pc < chunk->end
+		 && 0 == (starts[(pc - chunk->start) / 64]
+			  & ((uint64_t) 1 << ((pc - chunk->start) % 64))))
+	    {
+	      pc += instruction_length (chunk->program[pc]);
+	    }
+
+	  chunk->exits[entry] = pc < chunk->end
+	    ? chunk->exits[0]
+	    : (unsigned char) (pc - chunk->end);
+	}
+    }
+
+  return NULL;
+}
+
+
+static void *
+format_chunks (void * data)
+{
+  chunk_worker_t * worker = data;
+  size_t c = 0;
+
+  for (c = worker->first; c < worker->last; c += worker->stride)
+    {
+      chunk_t * chunk = &worker->chunks[c];
+      size_t pc = chunk->start + chunk->entry;
+      char * p = chunk->text;
+
+      while (pc < chunk->end)
+	{
+	  size_t used = 0;
+
+	  p = put_line (p, chunk->program, chunk->size, pc, &used);
+	  pc += used;
+	}
+
+      chunk->length = p - chunk->text;
+    }
+
+  return NULL;
+}
+
+
+// runs func on count workers, the caller's thread being the first one
+static void
+run_chunk_workers (chunk_worker_t * workers
+		   , unsigned int count
+		   , void * (* func) (void *))
+{
+  unsigned int started = 1;
+  unsigned int i = 0;
+
+  for (started = 1; started < count; ++started)
+    {
+      if (0 != pthread_create (&workers[started].thread, NULL, func, &workers[started]))
+	{
+	  break;
+	}
+    }
+
+  func (&workers[0]);
+
+  // the chunks of the workers that could not be started
+  for (i = started; i < count; ++i)
+    {
+      func (&workers[i]);
+    }
+
+  for (i = 1; i < started; ++i)
+    {
+      pthread_join (workers[i].thread, NULL);
+    }
+}
+
+
+int
+disassemble_to_file_parallel (const word program []
+			      , size_t size
+			      , FILE * out
+			      , unsigned int threads)
+{
+  size_t count = (size + DISASSEMBLER_CHUNK_WORDS - 1) / DISASSEMBLER_CHUNK_WORDS;
+  chunk_t * chunks = NULL;
+  chunk_worker_t * workers = NULL;
+  size_t c = 0;
+  unsigned int i = 0;
+  int result = 0;
+
+  if (0 == threads)
+    {
+      long online = sysconf (_SC_NPROCESSORS_ONLN);
+      threads = online > 0 ? (unsigned int) online : 1;
+    }
+  if (threads > count)
+    {
+      threads = count;
+    }
+  if (threads <= 1)
+    {
+      return disassemble_to_file (program, size, out);
+    }
+
+  chunks = calloc (count, sizeof(chunk_t));
+  workers = calloc (threads, sizeof(chunk_worker_t));
+  if (NULL == chunks || NULL == workers)
+    {
+      free (chunks);
+      free (workers);
+      return 1;
+    }
+
+  for (c = 0; c < count; ++c)
+    {
+      chunks[c].program = program;
+      chunks[c].size = size;
+      chunks[c].start = c * DISASSEMBLER_CHUNK_WORDS;
+      chunks[c].end = c + 1 < count ? (c + 1) * DISASSEMBLER_CHUNK_WORDS : size;
+    }
+
+  for (i = 0; i < threads; ++i)
+    {
+      workers[i].chunks = chunks;
+      workers[i].first = i;
+      workers[i].last = count;
+      workers[i].stride = threads;
+    }
+  run_chunk_workers (workers, threads, find_exits);
+
+  for (c = 1; c < count; ++c)
+    {
+      chunks[c].entry = chunks[c - 1].exits[chunks[c - 1].entry];
+    }
+
+  // rounds of one chunk per thread, a text buffer per thread
+  for (i = 0; i < threads && 0 == result; ++i)
+    {
+      workers[i].stride = 1;
+      chunks[i].text = malloc (DISASSEMBLER_CHUNK_WORDS * DISASSEMBLED_LINE_SIZE);
+      if (NULL == chunks[i].text)
+	{
+	  result = 1;
+	}
+    }
+
+  for (c = 0; c < count && 0 == result; c += threads)
+    {
+      unsigned int round = count - c < threads ? count - c : threads;
+
+      for (i = 0; i < round; ++i)
+	{
+	  // hand the buffers over from the previous round
+	  chunks[c + i].text = chunks[i].text;
+	  workers[i].first = c + i;
+	  workers[i].last = c + i + 1;
+	}
+      run_chunk_workers (workers, round, format_chunks);
+
+      for (i = 0; i < round && 0 == result; ++i)
+	{
+	  if (0 != chunks[c + i].length
+	      && 1 != fwrite (chunks[c + i].text, chunks[c + i].length, 1, out))
+	    {
+	      result = 1;
+	    }
+	}
+    }
+
+  for (i = 0; i < threads; ++i)
+    {
+      free (chunks[i].text);
+    }
+  free (chunks);
+  free (workers);
+
+  return result;
+}
+
+
+void
+disassemble (word program [], size_t size)
+{
+  disassemble_to_file (program, size, stdout);
+  fflush (stdout);
+}
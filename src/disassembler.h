@@ -0,0 +1,56 @@
+#if ! defined (DISASSEMBLER_H)
+#define DISASSEMBLER_H
+
+#include <stdio.h>
+
+#include "dcpu.h"
+
+// longest formatted instruction, e.g. "SET [0x0000 + A], [0x0000 + B]"
+#define DISASSEMBLED_INSTRUCTION_SIZE 48
+
+/**
+ * Formats the instruction at words[0] (the next words of its operands
+ * following it) into buffer, without allocating.
+ *
+ * @param size of buffer, the text is truncated (but always terminated)
+ * if it does not fit
+ * @param count number of words readable from words, missing next
+ * words are read as 0
+ * @return the number of words the instruction spans
+ */
+unsigned char format_instruction (char * buffer
+				  , size_t size
+				  , const word * words
+				  , size_t count);
+
+/**
+ * Writes the disassembly of a program to out, one line per
+ * instruction, through an internal buffer.
+ *
+ * @param size in words
+ * @return 0, or non zero if writing failed
+ */
+int disassemble_to_file (const word program []
+			 , size_t size
+			 , FILE * out);
+
+/**
+ * Same output as disassemble_to_file, for large dumps: the program is
+ * split in chunks disassembled on several threads.
+ *
+ * @param threads number of threads, 0 for one per online cpu
+ * @return 0, or non zero if writing failed
+ */
+int disassemble_to_file_parallel (const word program []
+				  , size_t size
+				  , FILE * out
+				  , unsigned int threads);
+
+/**
+ * Prints the disassembly of a program.
+ *
+ * @param size in words
+ */
+void disassemble (word program [], size_t size);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "predecode.h"
+#include "threaded.h"
+#include "lockstep.h"
+#include "jit/jit.h"
+
+// checks that every engine ends random programs in the state
+// execute_instruction does, run in chunks of random sizes for the
+// budget to end anywhere
+
+#define CHECK_SEEDS 64
+#define CHECK_BUDGET 5000
+// the code, the rest of the ram being small values
+#define CHECK_CODE_SIZE 256
+
+typedef enum engine_t
+  {
+    ENGINE_REFERENCE,
+    ENGINE_CACHED,
+    ENGINE_FUSED,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    ENGINE_COUNT
+
+  } engine_t;
+
+static const char * const engine_names [ENGINE_COUNT] = {
+  "reference", "cached", "fused", "threaded", "jit"
+};
+
+
+static uint32_t
+next_random (uint32_t * state)
+{
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+#define INSTRUCTION(o, a, b) ((word) ((o) | ((a) << 4) | ((b) << 10)))
+
+// writes at address one of the sequences made into superinstructions
+// (fusion_t), @return its length in words
+static unsigned int
+plant_fusion (dcpu_t * cpu, word address, uint32_t * state)
+{
+  word * code = &cpu->ram[address];
+  unsigned char test = OPCODE_IFE + next_random (state) % 4;
+  unsigned char reg = next_random (state) % REGISTER_COUNT;
+  // of the JSR, a short literal
+  unsigned char target = 0x20 + next_random (state) % 0x20;
+
+  switch (next_random (state) % 4)
+    {
+    case 0:
+      // IFx reg, literal then SET PC, target
+      code[0] = INSTRUCTION (test, reg, 0x20 + next_random (state) % 0x20);
+      code[1] = INSTRUCTION (OPCODE_SET, 0x1c, 0x1f);
+      code[2] = (word) (next_random (state) % CHECK_CODE_SIZE);
+      return 3;
+
+    case 1:
+      // IFx reg, reg then SET PC, POP
+      code[0] = INSTRUCTION (test, reg, next_random (state) % REGISTER_COUNT);
+      code[1] = INSTRUCTION (OPCODE_SET, 0x1c, 0x18);
+      return 2;
+
+    case 2:
+      // SET PUSH, reg then JSR target
+      code[0] = INSTRUCTION (OPCODE_SET, 0x1a, reg);
+      code[1] = INSTRUCTION (0, 0x01, target);
+      return 2;
+
+    default:
+      // SET PC, POP
+      code[0] = INSTRUCTION (OPCODE_SET, 0x1c, 0x18);
+      return 1;
+    }
+}
+
+
+// random code, which writes over itself and jumps around, the
+// registers of each lane being different
+static void
+load_random (dcpu_t * cpu, uint32_t seed, unsigned int lane)
+{
+  uint32_t state = seed * 2654435761u + 1;
+  unsigned int i = 0;
+
+  memset (cpu, 0, sizeof(*cpu));
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      word value = (word) next_random (&state);
+
+      if (i >= CHECK_CODE_SIZE)
+	{
+	  value &= 0xff;
+	}
+      else if (0x1c == extract_a (value) && 0 != (next_random (&state) & 3))
+	{
+	  // fewer jumps, for longer blocks
+	  value &= ~DCPU_INST_A_MASK;
+	}
+      cpu->ram[i] = value;
+    }
+  for (i = 0; i < CHECK_CODE_SIZE - 3; ++i)
+    {
+      if (0 == next_random (&state) % 8)
+	{
+	  i += plant_fusion (cpu, i, &state);
+	}
+    }
+
+  // some code wrapping around the end of the ram
+  if (0 == seed % 5)
+    {
+      memcpy (&cpu->ram[RAM_SIZE - 64], cpu->ram, 64 * sizeof(word));
+      cpu->pc = RAM_SIZE - 56;
+    }
+
+  state += lane;
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      cpu->registers[i] = (word) (next_random (&state) & 0xff);
+    }
+  cpu->sp = RAM_SIZE - 1;
+  mark_all_dirty (cpu);
+}
+
+
+static unsigned long long
+run_chunk (engine_t engine, dcpu_t * cpu, jit_t * jit, unsigned long long budget)
+{
+  unsigned long long i = 0;
+
+  switch (engine)
+    {
+    case ENGINE_REFERENCE:
+    case ENGINE_CACHED:
+      for (i = 0; i < budget; ++i)
+	{
+	  execute_cached_instruction (cpu);
+	}
+      return budget;
+
+    case ENGINE_FUSED:
+      return run_cached (cpu, budget, NULL);
+
+    case ENGINE_THREADED:
+      return run_threaded (cpu, budget);
+
+    default:
+      return run_jit (jit, cpu, budget);
+    }
+}
+
+
+static bool
+same_state (const dcpu_t * cpu, const dcpu_t * expected)
+{
+  return cpu->pc == expected->pc
+    && cpu->sp == expected->sp
+    && cpu->o == expected->o
+    && 0 == memcmp (cpu->registers, expected->registers, sizeof(cpu->registers))
+    && 0 == memcmp (cpu->ram, expected->ram, sizeof(cpu->ram));
+}
+
+
+static unsigned int
+report (const char * engine, uint32_t seed, unsigned int lane, bool same)
+{
+  if (same)
+    {
+      return 0;
+    }
+
+  fprintf (stderr
+	   , "%s, seed %u, lane %u: not the state of execute_instruction\n"
+	   , engine
+	   , seed
+	   , lane);
+  return 1;
+}
+
+
+// @return the number of engines and lanes ending in another state
+static unsigned int
+check (uint32_t seed
+       , jit_t * jit
+       , lockstep_t * lockstep
+       , dcpu_t * cpu
+       , dcpu_t expected [LOCKSTEP_LANES])
+{
+  unsigned long long executed [LOCKSTEP_LANES];
+  unsigned int mismatches = 0;
+  unsigned int lane = 0;
+  unsigned int i = 0;
+  engine_t engine = ENGINE_CACHED;
+
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      load_random (&expected[lane], seed, lane);
+      for (i = 0; i < CHECK_BUDGET; ++i)
+	{
+	  execute_cached_instruction (&expected[lane]);
+	}
+
+      load_random (cpu, seed, lane);
+      lockstep_load (lockstep, lane, cpu);
+    }
+
+  run_lockstep (lockstep, LOCKSTEP_LANES, CHECK_BUDGET, executed);
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      lockstep_store (lockstep, lane, cpu);
+      mismatches += report ("lockstep"
+			    , seed
+			    , lane
+			    , CHECK_BUDGET == executed[lane]
+			    && same_state (cpu, &expected[lane]));
+    }
+
+  // the other scalar engines on the first lane only
+  for (engine = ENGINE_CACHED; engine < ENGINE_COUNT; ++engine)
+    {
+      uint32_t state = seed;
+      unsigned long long done = 0;
+      bool counted = true;
+
+      load_random (cpu, seed, 0);
+      if (ENGINE_CACHED == engine || ENGINE_FUSED == engine)
+	{
+	  cpu->decode_cache = decode_cache_create ();
+	}
+      if (ENGINE_JIT == engine)
+	{
+	  jit_flush (jit);
+	}
+
+      while (done < CHECK_BUDGET)
+	{
+	  unsigned long long chunk = 1 + next_random (&state) % 700;
+
+	  if (chunk > CHECK_BUDGET - done)
+	    {
+	      chunk = CHECK_BUDGET - done;
+	    }
+	  counted = counted && chunk == run_chunk (engine, cpu, jit, chunk);
+	  done += chunk;
+	}
+
+      mismatches += report (engine_names[engine]
+			    , seed
+			    , 0
+			    , counted && same_state (cpu, &expected[0]));
+
+      decode_cache_destroy (cpu->decode_cache);
+      cpu->decode_cache = NULL;
+    }
+
+  return mismatches;
+}
+
+
+// a failing IFE A, 1 then an instruction with POP or PUSH operands,
+// which it skips without moving sp
+static unsigned int
+check_skip (jit_t * jit, lockstep_t * lockstep, dcpu_t * cpu)
+{
+  static const word skipped [][2] = {
+    { INSTRUCTION (OPCODE_SET, 0x18, 0x21), 0 },
+    { INSTRUCTION (OPCODE_SET, 0x1a, 0x21), 0 },
+    { INSTRUCTION (OPCODE_SET, 0x00, 0x18), 0 },
+    { INSTRUCTION (OPCODE_SET, 0x1a, 0x18), 0 },
+    { INSTRUCTION (OPCODE_ADD, 0x1a, 0x1f), 0x1234 },
+    { INSTRUCTION (0, 0x01, 0x18), 0 },
+    { INSTRUCTION (0, 0x01, 0x1a), 0 }
+  };
+  unsigned int mismatches = 0;
+  unsigned long long executed = 0;
+  size_t s = 0;
+  engine_t engine = ENGINE_REFERENCE;
+
+  for (s = 0; s < sizeof(skipped) / sizeof(skipped[0]); ++s)
+    {
+      dcpu_t expected;
+
+      memset (&expected, 0, sizeof(expected));
+      expected.ram[0] = INSTRUCTION (OPCODE_IFE, 0x00, 0x21);
+      expected.ram[1] = skipped[s][0];
+      expected.ram[2] = skipped[s][1];
+      expected.sp = 0x1000;
+      mark_all_dirty (&expected);
+
+      for (engine = ENGINE_REFERENCE; engine < ENGINE_COUNT; ++engine)
+	{
+	  memcpy (cpu, &expected, sizeof(expected));
+	  if (ENGINE_CACHED == engine || ENGINE_FUSED == engine)
+	    {
+	      cpu->decode_cache = decode_cache_create ();
+	    }
+	  if (ENGINE_JIT == engine)
+	    {
+	      jit_flush (jit);
+	    }
+
+	  executed = run_chunk (engine, cpu, jit, 1);
+	  if (1 != executed
+	      || 0x1000 != cpu->sp
+	      || 1 + instruction_length (skipped[s][0]) != cpu->pc)
+	    {
+	      fprintf (stderr
+		       , "%s: skipping 0x%04X moved sp to 0x%04X, pc to 0x%04X\n"
+		       , engine_names[engine]
+		       , skipped[s][0]
+		       , cpu->sp
+		       , cpu->pc);
+	      ++mismatches;
+	    }
+
+	  decode_cache_destroy (cpu->decode_cache);
+	  cpu->decode_cache = NULL;
+	}
+
+      lockstep_load (lockstep, 0, &expected);
+      run_lockstep (lockstep, 1, 1, &executed);
+      lockstep_store (lockstep, 0, cpu);
+      if (1 != executed
+	  || 0x1000 != cpu->sp
+	  || 1 + instruction_length (skipped[s][0]) != cpu->pc)
+	{
+	  fprintf (stderr
+		   , "lockstep: skipping 0x%04X moved sp to 0x%04X, pc to 0x%04X\n"
+		   , skipped[s][0]
+		   , cpu->sp
+		   , cpu->pc);
+	  ++mismatches;
+	}
+    }
+
+  return mismatches;
+}
+
+
+int
+main (void)
+{
+  unsigned int mismatches = 0;
+  uint32_t seed = 0;
+
+  dcpu_t * cpu = calloc (1, sizeof(dcpu_t));
+  dcpu_t * expected = calloc (LOCKSTEP_LANES, sizeof(dcpu_t));
+  lockstep_t * lockstep = lockstep_create ();
+  // NULL if the host has no jit, run_jit is then the threaded engine
+  jit_t * jit = jit_create ();
+
+  if (NULL == cpu || NULL == expected || NULL == lockstep)
+    {
+      return EXIT_FAILURE;
+    }
+
+  mismatches += check_skip (jit, lockstep, cpu);
+  for (seed = 1; seed <= CHECK_SEEDS; ++seed)
+    {
+      mismatches += check (seed, jit, lockstep, cpu, expected);
+    }
+
+  jit_destroy (jit);
+  lockstep_destroy (lockstep);
+  free (expected);
+  free (cpu);
+
+  printf ("%u mismatches over %u programs\n", mismatches, CHECK_SEEDS);
+
+  return 0 == mismatches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
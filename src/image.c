@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "image.h"
+
+
+// reads a file of little endian words, a trailing odd byte being ignored
+// @param limit maximum number of words, 0 for none
+static word *
+load_words (const char * path, size_t * size, size_t limit)
+{
+  FILE * file = NULL;
+  word * words = NULL;
+  size_t capacity = RAM_SIZE;
+  size_t count = 0;
+  unsigned char bytes [8192];
+  size_t read = 0;
+
+  file = fopen (path, "rb");
+  if (NULL == file)
+    {
+      return NULL;
+    }
+
+  words = malloc (capacity * sizeof(word));
+  if (NULL == words)
+    {
+      fclose (file);
+      return NULL;
+    }
+
+  // the buffer size is even, only the last read can end on an odd byte
+  while (0 < (read = fread (bytes, 1, sizeof(bytes), file)))
+    {
+      size_t i = 0;
+
+      if (0 != limit && count + read / 2 > limit)
+	{
+	  // does not fit
+	  free (words);
+	  fclose (file);
+	  return NULL;
+	}
+
+      if (count + read / 2 > capacity)
+	{
+	  word * grown = NULL;
+
+	  while (count + read / 2 > capacity)
+	    {
+	      capacity *= 2;
+	    }
+
+	  grown = realloc (words, capacity * sizeof(word));
+	  if (NULL == grown)
+	    {
+	      free (words);
+	      fclose (file);
+	      return NULL;
+	    }
+	  words = grown;
+	}
+
+      for (i = 0; i + 1 < read; i += 2)
+	{
+	  words[count++] = (word) (bytes[i] | (bytes[i + 1] << 8));
+	}
+    }
+
+  fclose (file);
+
+  *size = count;
+  return words;
+}
+
+
+word *
+load_image (const char * path, size_t * size)
+{
+  return load_words (path, size, RAM_SIZE);
+}
+
+
+word *
+load_dump (const char * path, size_t * size)
+{
+  return load_words (path, size, 0);
+}
+
+
+int
+write_image (FILE * out, const word image [], size_t size)
+{
+  unsigned char bytes [8192];
+  size_t i = 0;
+
+  while (i < size)
+    {
+      size_t count = 0;
+
+      for (count = 0; count < sizeof(bytes) && i < size; count += 2, ++i)
+	{
+	  bytes[count] = image[i] & 0xff;
+	  bytes[count + 1] = image[i] >> 8;
+	}
+
+      if (1 != fwrite (bytes, count, 1, out))
+	{
+	  return 1;
+	}
+    }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+#if ! defined (IMAGE_H)
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "dcpu.h"
+
+/**
+ * Loads a program image: raw 16 bits words, little endian.
+ *
+ * @param size set to the number of words of the image
+ * @return the malloc'ed image, or NULL if it could not be read or is
+ * larger than the ram
+ */
+word * load_image (const char * path, size_t * size);
+
+/**
+ * Loads a dump of any size, e.g. several ram images put end to end.
+ *
+ * @param size set to the number of words of the dump
+ * @return the malloc'ed words, or NULL if they could not be read
+ */
+word * load_dump (const char * path, size_t * size);
+
+/**
+ * Writes a program image in the format read by load_image.
+ *
+ * @param size in words
+ * @return 0, or non zero if writing failed
+ */
+int write_image (FILE * out, const word image [], size_t size);
+
+#endif
@@ -0,0 +1,997 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "jit.h"
+#include "../threaded.h"
+#include "../predecode.h"
+
+
+#if defined (__x86_64__)
+
+#include <sys/mman.h>
+
+#include "x86_64.h"
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS 8192
+
+// a block stops after this many instructions...
+#define JIT_BLOCK_INSTRUCTIONS 64
+// ... unless it still has to translate the instruction an IFx skips
+#define JIT_BLOCK_MAX_INSTRUCTIONS (2 * JIT_BLOCK_INSTRUCTIONS)
+
+// upper bound of the native code size of one guest instruction,
+// prologue and epilogue
+#define JIT_MAX_INSTRUCTION_CODE 192
+
+// blocks stay clear of the end of the ram (no wrap around), keeping
+// room for an instruction skipped by the last one
+#define JIT_RAM_GUARD (2 * DECODE_CACHE_MAX_SPAN)
+
+// set in the exit status when a block wrote into translated code,
+// the low 16 bits being the written address
+#define JIT_EXIT_WRITE 0x10000
+
+
+// returned in rax:rdx
+typedef struct jit_exit_t
+{
+  uint64_t status;
+  uint64_t executed;
+
+} jit_exit_t;
+
+typedef jit_exit_t (* jit_block_func) (dcpu_t * cpu);
+
+typedef struct jit_block_t
+{
+  jit_block_func entry;
+  word start;
+  // in words, including the instructions that are only skipped
+  unsigned int length;
+  bool valid;
+
+} jit_block_t;
+
+struct jit_t
+{
+  // never writable and executable at once: read-write while blocks
+  // are emitted, read-execute while they run
+  unsigned char * code;
+  size_t used;
+  bool executable;
+  // the protection of the code could not be changed, e.g. under a
+  // W^X policy, everything runs on run_threaded
+  bool disabled;
+
+  jit_block_t blocks [JIT_MAX_BLOCKS];
+  unsigned int block_count;
+
+  jit_block_t * block_by_pc [RAM_SIZE];
+
+  // non zero for the ram words translated in a valid block,
+  // checked by the generated code on every ram store
+  unsigned char covered [RAM_SIZE];
+
+  // ram as it was when the blocks have been translated
+  word shadow [RAM_SIZE];
+};
+
+
+// guest registers live in host registers for the whole block:
+// A-J in r8-r15, SP in rbx, O in rbp and the cpu pointer in rdi.
+// rax, rcx, rdx and rsi are scratch.
+static const x86_register_t
+guest_registers [REGISTER_COUNT] = {
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define HOST_CPU RDI
+#define HOST_SP RBX
+#define HOST_O RBP
+
+#define RAM_OFFSET ((int32_t) offsetof (dcpu_t, ram))
+#define PC_OFFSET ((int32_t) offsetof (dcpu_t, pc))
+#define SP_OFFSET ((int32_t) offsetof (dcpu_t, sp))
+#define O_OFFSET ((int32_t) offsetof (dcpu_t, o))
+#define DIRTY_OFFSET ((int32_t) offsetof (dcpu_t, dirty))
+#define REGISTER_OFFSET(i) ((int32_t) (offsetof (dcpu_t, registers) + (i) * sizeof(word)))
+
+// 'none' value for a jump to patch
+#define NO_PATCH ((size_t) -1)
+
+
+typedef struct translation_t
+{
+  jit_t * jit;
+  emitter_t * e;
+
+  size_t epilogue;
+
+  // guest instructions translated so far, i.e. executed when an exit
+  // is taken (minus the skipped ones, accounted for at run time)
+  unsigned int count;
+
+} translation_t;
+
+
+typedef enum jit_operand_kind_t
+  {
+    JIT_REGISTER,
+    // address in the register given to translate_operand
+    JIT_MEMORY,
+    JIT_LITERAL,
+    JIT_SP,
+    JIT_PC,
+    JIT_O
+
+  } jit_operand_kind_t;
+
+typedef struct jit_operand_t
+{
+  jit_operand_kind_t kind;
+  x86_register_t host;
+  word value;
+
+} jit_operand_t;
+
+
+static void
+emit_prologue (emitter_t * e)
+{
+  unsigned char i = 0;
+
+  emit_push (e, RBX);
+  emit_push (e, RBP);
+  emit_push (e, R12);
+  emit_push (e, R13);
+  emit_push (e, R14);
+  emit_push (e, R15);
+
+  // push 0: number of skipped instructions (negated)
+  emit8 (e, 0x6a);
+  emit8 (e, 0x00);
+
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      emit_load16 (e, guest_registers[i], HOST_CPU, REGISTER_OFFSET (i));
+    }
+  emit_load16 (e, HOST_SP, HOST_CPU, SP_OFFSET);
+  emit_load16 (e, HOST_O, HOST_CPU, O_OFFSET);
+}
+
+
+// expects the exit status in eax, the new pc in ecx and the number
+// of translated instructions the exit accounts for in edx
+static void
+emit_epilogue (emitter_t * e)
+{
+  unsigned char i = 0;
+
+  // add rdx, [rsp]
+  emit8 (e, 0x48);
+  emit8 (e, 0x03);
+  emit8 (e, 0x14);
+  emit8 (e, 0x24);
+
+  emit_store16 (e, RCX, HOST_CPU, PC_OFFSET);
+  emit_store16 (e, HOST_SP, HOST_CPU, SP_OFFSET);
+  emit_store16 (e, HOST_O, HOST_CPU, O_OFFSET);
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      emit_store16 (e, guest_registers[i], HOST_CPU, REGISTER_OFFSET (i));
+    }
+
+  // add rsp, 8
+  emit8 (e, 0x48);
+  emit8 (e, 0x83);
+  emit8 (e, 0xc4);
+  emit8 (e, 0x08);
+
+  emit_pop (e, R15);
+  emit_pop (e, R14);
+  emit_pop (e, R13);
+  emit_pop (e, R12);
+  emit_pop (e, RBP);
+  emit_pop (e, RBX);
+  emit_ret (e);
+}
+
+
+// adds delta to the skipped instructions counter
+static void
+emit_adjust_count (emitter_t * e, int8_t delta)
+{
+  // add qword [rsp], imm8
+  emit8 (e, 0x48);
+  emit8 (e, 0x83);
+  emit8 (e, 0x04);
+  emit8 (e, 0x24);
+  emit8 (e, (uint8_t) delta);
+}
+
+
+static void
+emit_exit_dynamic (translation_t * t)
+{
+  emit_alu_rr (t->e, ALU_XOR, RAX, RAX);
+  emit_mov_ri (t->e, RDX, t->count);
+  patch_rel32 (t->e, emit_jmp (t->e), t->epilogue);
+}
+
+
+static void
+emit_exit_static (translation_t * t, word pc)
+{
+  emit_mov_ri (t->e, RCX, pc);
+  emit_exit_dynamic (t);
+}
+
+
+// marks the page of the ram word at 'address' as written (uses eax)
+static void
+emit_mark_dirty (translation_t * t, x86_register_t address)
+{
+  emit_mov_rr (t->e, RAX, address);
+  emit_shift_ri (t->e, SHIFT_SHR, RAX, DCPU_PAGE_SHIFT);
+  emit_store8i_indexed (t->e, 1, HOST_CPU, RAX, DIRTY_OFFSET);
+}
+
+
+// leaves the block if the ram word at 'address' has been translated,
+// with the new pc in ecx if 'dynamic', 'pc' otherwise
+static void
+emit_write_check (translation_t * t
+		  , x86_register_t address
+		  , bool dynamic
+		  , word pc)
+{
+  emitter_t * e = t->e;
+  size_t untranslated = NO_PATCH;
+
+  emit_movabs (e, RAX, (uint64_t) (uintptr_t) t->jit->covered);
+  emit_cmp_byte_zero (e, RAX, address);
+  untranslated = emit_jcc (e, CC_E);
+
+  if ( ! dynamic)
+    {
+      emit_mov_ri (e, RCX, pc);
+    }
+  emit_mov_rr (e, RAX, address);
+  emit_alu_ri (e, ALU_OR, RAX, JIT_EXIT_WRITE);
+  emit_mov_ri (e, RDX, t->count);
+  patch_rel32 (e, emit_jmp (e), t->epilogue);
+
+  patch_rel32 (e, untranslated, e->used);
+}
+
+
+// emits the decoding of an operand (in order, for the SP side effects),
+// a memory operand gets its address in 'address'
+static jit_operand_t
+translate_operand (translation_t * t
+		   , const dcpu_t * cpu
+		   , unsigned char value
+		   , unsigned int * pc
+		   , x86_register_t address)
+{
+  emitter_t * e = t->e;
+  jit_operand_t operand = { .kind = JIT_MEMORY, .host = address, .value = 0 };
+
+  if (value <= 0x07)
+    {
+      operand.kind = JIT_REGISTER;
+      operand.host = guest_registers[value];
+    }
+  else if (value <= 0x0f)
+    {
+      emit_mov_rr (e, address, guest_registers[value - 0x08]);
+    }
+  else if (value <= 0x17)
+    {
+      emit_mov_rr (e, address, guest_registers[value - 0x10]);
+      emit_alu_ri (e, ALU_ADD, address, cpu->ram[(*pc)++]);
+      emit_movzx_rr (e, address, address);
+    }
+  else if (value == 0x18)
+    {
+      emit_mov_rr (e, address, HOST_SP);
+      emit_alu_ri (e, ALU_ADD, HOST_SP, 1);
+      emit_movzx_rr (e, HOST_SP, HOST_SP);
+    }
+  else if (value == 0x19)
+    {
+      emit_mov_rr (e, address, HOST_SP);
+    }
+  else if (value == 0x1a)
+    {
+      emit_alu_ri (e, ALU_SUB, HOST_SP, 1);
+      emit_movzx_rr (e, HOST_SP, HOST_SP);
+      emit_mov_rr (e, address, HOST_SP);
+    }
+  else if (value == 0x1b)
+    {
+      operand.kind = JIT_SP;
+    }
+  else if (value == 0x1c)
+    {
+      operand.kind = JIT_PC;
+    }
+  else if (value == 0x1d)
+    {
+      operand.kind = JIT_O;
+    }
+  else if (value == 0x1e)
+    {
+      emit_mov_ri (e, address, cpu->ram[(*pc)++]);
+    }
+  else if (value == 0x1f)
+    {
+      operand.kind = JIT_LITERAL;
+      operand.value = cpu->ram[(*pc)++];
+    }
+  else
+    {
+      operand.kind = JIT_LITERAL;
+      operand.value = value - 0x20;
+    }
+
+  return operand;
+}
+
+
+// @param next the address of the next instruction, i.e. the value of PC
+static void
+load_operand (translation_t * t
+	      , const jit_operand_t * operand
+	      , x86_register_t dst
+	      , word next)
+{
+  emitter_t * e = t->e;
+
+  switch (operand->kind)
+    {
+    case JIT_REGISTER:
+      emit_mov_rr (e, dst, operand->host);
+      break;
+
+    case JIT_MEMORY:
+      emit_load16_indexed (e, dst, HOST_CPU, operand->host, RAM_OFFSET);
+      break;
+
+    case JIT_LITERAL:
+      emit_mov_ri (e, dst, operand->value);
+      break;
+
+    case JIT_SP:
+      emit_mov_rr (e, dst, HOST_SP);
+      break;
+
+    case JIT_PC:
+      emit_mov_ri (e, dst, next);
+      break;
+
+    case JIT_O:
+      emit_mov_rr (e, dst, HOST_O);
+      break;
+    }
+}
+
+
+// stores eax into the operand, then the overflow computed in edx if
+// 'sets_o'. @return true if the block ends (PC written)
+static bool
+store_operand (translation_t * t
+	       , const jit_operand_t * operand
+	       , bool sets_o
+	       , word next)
+{
+  emitter_t * e = t->e;
+
+  switch (operand->kind)
+    {
+    case JIT_REGISTER:
+      emit_movzx_rr (e, operand->host, RAX);
+      break;
+
+    case JIT_MEMORY:
+      emit_store16_indexed (e, RAX, HOST_CPU, operand->host, RAM_OFFSET);
+      if (sets_o)
+	{
+	  emit_mov_rr (e, HOST_O, RDX);
+	}
+      emit_mark_dirty (t, operand->host);
+      emit_write_check (t, operand->host, false, next);
+      return false;
+
+    case JIT_LITERAL:
+      // silently ignored
+      break;
+
+    case JIT_SP:
+      emit_movzx_rr (e, HOST_SP, RAX);
+      break;
+
+    case JIT_PC:
+      emit_movzx_rr (e, RCX, RAX);
+      if (sets_o)
+	{
+	  emit_mov_rr (e, HOST_O, RDX);
+	}
+      emit_exit_dynamic (t);
+      return true;
+
+    case JIT_O:
+      emit_movzx_rr (e, HOST_O, RAX);
+      break;
+    }
+
+  if (sets_o)
+    {
+      emit_mov_rr (e, HOST_O, RDX);
+    }
+
+  return false;
+}
+
+
+// 'a' in eax, 'b' in ecx, result in eax and overflow in edx
+// @return true if the opcode sets O
+static bool
+translate_arithmetic (emitter_t * e, unsigned char opcode)
+{
+  size_t zero = NO_PATCH;
+  size_t done = NO_PATCH;
+
+  switch (opcode)
+    {
+    case OPCODE_SET:
+      emit_mov_rr (e, RAX, RCX);
+      return false;
+
+    case OPCODE_ADD:
+      emit_alu_rr (e, ALU_ADD, RAX, RCX);
+      emit_mov_rr (e, RDX, RAX);
+      emit_shift_ri (e, SHIFT_SHR, RDX, 16);
+      return true;
+
+    case OPCODE_SUB:
+      emit_alu_rr (e, ALU_SUB, RAX, RCX);
+      emit_mov_rr (e, RDX, RAX);
+      emit_shift_ri (e, SHIFT_SAR, RDX, 31);
+      emit_alu_ri (e, ALU_AND, RDX, 0xffff);
+      return true;
+
+    case OPCODE_MUL:
+      emit_imul_rr (e, RAX, RCX);
+      emit_mov_rr (e, RDX, RAX);
+      emit_shift_ri (e, SHIFT_SHR, RDX, 16);
+      return true;
+
+    case OPCODE_DIV:
+      emit_test_rr (e, RCX, RCX);
+      zero = emit_jcc (e, CC_E);
+      emit_push (e, RAX);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      emit_div_r (e, RCX);
+      // xchg rax, [rsp]
+      emit8 (e, 0x48);
+      emit8 (e, 0x87);
+      emit8 (e, 0x04);
+      emit8 (e, 0x24);
+      emit_shift_ri (e, SHIFT_SHL, RAX, 16);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      emit_div_r (e, RCX);
+      emit_movzx_rr (e, RDX, RAX);
+      emit_pop (e, RAX);
+      done = emit_jmp (e);
+      patch_rel32 (e, zero, e->used);
+      emit_alu_rr (e, ALU_XOR, RAX, RAX);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      patch_rel32 (e, done, e->used);
+      return true;
+
+    case OPCODE_MOD:
+      emit_test_rr (e, RCX, RCX);
+      zero = emit_jcc (e, CC_E);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      emit_div_r (e, RCX);
+      emit_mov_rr (e, RAX, RDX);
+      done = emit_jmp (e);
+      patch_rel32 (e, zero, e->used);
+      emit_alu_rr (e, ALU_XOR, RAX, RAX);
+      patch_rel32 (e, done, e->used);
+      return false;
+
+    case OPCODE_SHL:
+      emit_alu_ri (e, ALU_CMP, RCX, 31);
+      zero = emit_jcc (e, CC_A);
+      emit_shift_cl (e, SHIFT_SHL, RAX);
+      emit_mov_rr (e, RDX, RAX);
+      emit_shift_ri (e, SHIFT_SHR, RDX, 16);
+      done = emit_jmp (e);
+      patch_rel32 (e, zero, e->used);
+      emit_alu_rr (e, ALU_XOR, RAX, RAX);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      patch_rel32 (e, done, e->used);
+      return true;
+
+    case OPCODE_SHR:
+      emit_alu_ri (e, ALU_CMP, RCX, 31);
+      zero = emit_jcc (e, CC_A);
+      emit_mov_rr (e, RDX, RAX);
+      emit_shift_ri (e, SHIFT_SHL, RDX, 16);
+      emit_shift_cl (e, SHIFT_SHR, RDX);
+      emit_alu_ri (e, ALU_AND, RDX, 0xffff);
+      emit_shift_cl (e, SHIFT_SHR, RAX);
+      done = emit_jmp (e);
+      patch_rel32 (e, zero, e->used);
+      emit_alu_rr (e, ALU_XOR, RAX, RAX);
+      emit_alu_rr (e, ALU_XOR, RDX, RDX);
+      patch_rel32 (e, done, e->used);
+      return true;
+
+    case OPCODE_AND:
+      emit_alu_rr (e, ALU_AND, RAX, RCX);
+      return false;
+
+    case OPCODE_BOR:
+      emit_alu_rr (e, ALU_OR, RAX, RCX);
+      return false;
+
+    case OPCODE_XOR:
+      emit_alu_rr (e, ALU_XOR, RAX, RCX);
+      return false;
+    }
+
+  assert (0 && "not an arithmetic opcode");
+  return false;
+}
+
+
+// @param skip set to the jump to patch to the end of the next
+// instruction, if the instruction is an IFx
+// @return true if the instruction leaves the block
+static bool
+translate_instruction (translation_t * t
+		       , const dcpu_t * cpu
+		       , unsigned int * pc
+		       , size_t * skip)
+{
+  emitter_t * e = t->e;
+  word instruction = cpu->ram[(*pc)++];
+  unsigned char opcode = extract_opcode (instruction);
+  jit_operand_t a;
+  jit_operand_t b;
+  word next = 0;
+
+  ++t->count;
+
+  if (0 == opcode)
+    {
+      if (0x01 != extract_a (instruction))
+	{
+	  // unknown, only consumes the instruction word
+	  return false;
+	}
+
+      // JSR: push the return address, then jump
+      a = translate_operand (t, cpu, extract_b (instruction), pc, RCX);
+      next = *pc;
+
+      emit_alu_ri (e, ALU_SUB, HOST_SP, 1);
+      emit_movzx_rr (e, HOST_SP, HOST_SP);
+      emit_store16i_indexed (e, next, HOST_CPU, HOST_SP, RAM_OFFSET);
+      load_operand (t, &a, RCX, next);
+      emit_mark_dirty (t, HOST_SP);
+      emit_write_check (t, HOST_SP, true, 0);
+      emit_exit_dynamic (t);
+      return true;
+    }
+
+  // we want to preserve the eval order, value 'a' then 'b'
+  a = translate_operand (t, cpu, extract_a (instruction), pc, RSI);
+  b = translate_operand (t, cpu, extract_b (instruction), pc, RCX);
+  next = *pc;
+
+  load_operand (t, &b, RCX, next);
+  if (OPCODE_SET != opcode)
+    {
+      load_operand (t, &a, RAX, next);
+    }
+
+  if (opcode >= OPCODE_IFE)
+    {
+      x86_condition_t execute = CC_E;
+      size_t executed = NO_PATCH;
+
+      switch (opcode)
+	{
+	case OPCODE_IFE:
+	  emit_alu_rr (e, ALU_CMP, RAX, RCX);
+	  execute = CC_E;
+	  break;
+
+	case OPCODE_IFN:
+	  emit_alu_rr (e, ALU_CMP, RAX, RCX);
+	  execute = CC_NE;
+	  break;
+
+	case OPCODE_IFG:
+	  emit_alu_rr (e, ALU_CMP, RAX, RCX);
+	  execute = CC_A;
+	  break;
+
+	case OPCODE_IFB:
+	  emit_test_rr (e, RAX, RCX);
+	  execute = CC_NE;
+	  break;
+	}
+
+      executed = emit_jcc (e, execute);
+      emit_adjust_count (e, -1);
+      *skip = emit_jmp (e);
+      patch_rel32 (e, executed, e->used);
+      return false;
+    }
+
+  return store_operand (t, &a, translate_arithmetic (e, opcode), next);
+}
+
+
+// an unknown instruction only consumes its first word when executed,
+// but is skipped as a whole: the skip cannot land after its translation
+static inline bool
+is_unknown_instruction (word instruction)
+{
+  return 0 == extract_opcode (instruction) && 0x01 != extract_a (instruction);
+}
+
+
+static void
+mark_covered (jit_t * jit)
+{
+  unsigned int i = 0;
+
+  memset (jit->covered, 0, sizeof(jit->covered));
+  for (i = 0; i < jit->block_count; ++i)
+    {
+      const jit_block_t * block = &jit->blocks[i];
+      if (block->valid)
+	{
+	  memset (&jit->covered[block->start], 1, block->length);
+	}
+    }
+}
+
+
+static void
+invalidate_block (jit_t * jit, jit_block_t * block)
+{
+  block->valid = false;
+  if (jit->block_by_pc[block->start] == block)
+    {
+      jit->block_by_pc[block->start] = NULL;
+    }
+}
+
+
+// drops the blocks translated from 'address'
+static void
+invalidate_address (jit_t * jit, word address)
+{
+  unsigned int i = 0;
+
+  for (i = 0; i < jit->block_count; ++i)
+    {
+      jit_block_t * block = &jit->blocks[i];
+      if (block->valid
+	  && address >= block->start
+	  && address < block->start + block->length)
+	{
+	  invalidate_block (jit, block);
+	}
+    }
+
+  mark_covered (jit);
+}
+
+
+// drops the blocks whose ram has been modified behind our back
+static void
+verify_blocks (jit_t * jit, const dcpu_t * cpu)
+{
+  unsigned int i = 0;
+  bool changed = false;
+
+  for (i = 0; i < jit->block_count; ++i)
+    {
+      jit_block_t * block = &jit->blocks[i];
+      if (block->valid
+	  && 0 != memcmp (&cpu->ram[block->start]
+			  , &jit->shadow[block->start]
+			  , block->length * sizeof(word)))
+	{
+	  invalidate_block (jit, block);
+	  changed = true;
+	}
+    }
+
+  if (changed)
+    {
+      mark_covered (jit);
+    }
+}
+
+
+// @return false if the code could not be given that protection
+static bool
+protect_code (jit_t * jit, bool executable)
+{
+  if (jit->executable == executable)
+    {
+      return true;
+    }
+
+  if (0 != mprotect (jit->code
+		     , JIT_CODE_SIZE
+		     , executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE))
+    {
+      jit->disabled = true;
+      return false;
+    }
+
+  jit->executable = executable;
+  return true;
+}
+
+
+static jit_block_t *
+translate_block (jit_t * jit, const dcpu_t * cpu, word start)
+{
+  jit_block_t * block = NULL;
+  emitter_t e = { .code = NULL, .size = JIT_CODE_SIZE, .used = 0, .overflow = 0 };
+  translation_t t = { .jit = jit, .e = &e, .epilogue = 0, .count = 0 };
+  size_t entry = 0;
+  unsigned int pc = start;
+  unsigned int end = start;
+  size_t skip = NO_PATCH;
+
+  if (start > RAM_SIZE - JIT_RAM_GUARD)
+    {
+      return NULL;
+    }
+
+  if (jit->block_count == JIT_MAX_BLOCKS
+      || JIT_CODE_SIZE - jit->used
+      < (JIT_BLOCK_MAX_INSTRUCTIONS + 2) * JIT_MAX_INSTRUCTION_CODE)
+    {
+      jit_flush (jit);
+    }
+
+  if ( ! protect_code (jit, false))
+    {
+      return NULL;
+    }
+
+  e.code = jit->code;
+  e.used = jit->used;
+
+  // exits jump back to the epilogue
+  t.epilogue = e.used;
+  emit_epilogue (&e);
+  entry = e.used;
+  emit_prologue (&e);
+
+  for (;;)
+    {
+      size_t pending = NO_PATCH;
+      bool leaves = false;
+
+      if (pc > RAM_SIZE - JIT_RAM_GUARD
+	  || t.count >= JIT_BLOCK_MAX_INSTRUCTIONS
+	  || (NO_PATCH == skip && t.count >= JIT_BLOCK_INSTRUCTIONS)
+	  || (NO_PATCH != skip && is_unknown_instruction (cpu->ram[pc])))
+	{
+	  emit_exit_static (&t, pc);
+	  if (NO_PATCH != skip)
+	    {
+	      // the skipped instruction has not been translated (nor counted)
+	      unsigned int skipped = instruction_length (cpu->ram[pc]);
+	      patch_rel32 (&e, skip, e.used);
+	      emit_adjust_count (&e, 1);
+	      emit_exit_static (&t, pc + skipped);
+	      end = pc + skipped;
+	    }
+	  break;
+	}
+
+      pending = skip;
+      skip = NO_PATCH;
+
+      leaves = translate_instruction (&t, cpu, &pc, &skip);
+      end = pc;
+
+      if (NO_PATCH != pending)
+	{
+	  // the previous IFx lands here when skipping this instruction
+	  patch_rel32 (&e, pending, e.used);
+	  leaves = false;
+	}
+
+      if (leaves)
+	{
+	  break;
+	}
+    }
+
+  assert ( ! e.overflow);
+  if (e.overflow)
+    {
+      return NULL;
+    }
+
+  block = &jit->blocks[jit->block_count++];
+  block->entry = (jit_block_func) (void *) &jit->code[entry];
+  block->start = start;
+  block->length = end - start;
+  block->valid = true;
+
+  jit->used = e.used;
+  jit->block_by_pc[start] = block;
+  memcpy (&jit->shadow[start], &cpu->ram[start], block->length * sizeof(word));
+  memset (&jit->covered[start], 1, block->length);
+
+  return block;
+}
+
+
+jit_t *
+jit_create (void)
+{
+  jit_t * jit = calloc (1, sizeof(jit_t));
+  if (NULL == jit)
+    {
+      return NULL;
+    }
+
+  jit->code = mmap (NULL
+		    , JIT_CODE_SIZE
+		    , PROT_READ | PROT_WRITE
+		    , MAP_PRIVATE | MAP_ANONYMOUS
+		    , -1
+		    , 0);
+  if (MAP_FAILED == jit->code)
+    {
+      free (jit);
+      return NULL;
+    }
+
+  return jit;
+}
+
+
+void
+jit_destroy (jit_t * jit)
+{
+  if (NULL == jit)
+    {
+      return;
+    }
+
+  munmap (jit->code, JIT_CODE_SIZE);
+  free (jit);
+}
+
+
+void
+jit_flush (jit_t * jit)
+{
+  if (NULL == jit)
+    {
+      return;
+    }
+
+  jit->used = 0;
+  jit->block_count = 0;
+  memset (jit->block_by_pc, 0, sizeof(jit->block_by_pc));
+  memset (jit->covered, 0, sizeof(jit->covered));
+}
+
+
+unsigned long long
+run_jit (jit_t * jit
+	 , dcpu_t * cpu
+	 , unsigned long long budget)
+{
+  unsigned long long executed = 0;
+
+  if (NULL == jit || jit->disabled)
+    {
+      return run_threaded (cpu, budget);
+    }
+
+  verify_blocks (jit, cpu);
+
+  while (executed < budget)
+    {
+      jit_block_t * block = NULL;
+      jit_exit_t exit = { 0, 0 };
+
+      if (budget - executed <= JIT_BLOCK_MAX_INSTRUCTIONS)
+	{
+	  // a block could go over the budget
+	  executed += run_threaded (cpu, budget - executed);
+	  break;
+	}
+
+      block = jit->block_by_pc[cpu->pc];
+      if (NULL == block)
+	{
+	  block = translate_block (jit, cpu, cpu->pc);
+	}
+
+      if (jit->disabled || ! protect_code (jit, true))
+	{
+	  executed += run_threaded (cpu, budget - executed);
+	  break;
+	}
+
+      if (NULL == block)
+	{
+	  executed += run_threaded (cpu, 1);
+	  verify_blocks (jit, cpu);
+	  continue;
+	}
+
+      exit = block->entry (cpu);
+      executed += exit.executed;
+
+      if (exit.status & JIT_EXIT_WRITE)
+	{
+	  invalidate_address (jit, (word) exit.status);
+	}
+    }
+
+  // ram has been written behind the back of the cache
+  if (NULL != cpu->decode_cache)
+    {
+      decode_cache_flush (cpu->decode_cache);
+    }
+
+  return executed;
+}
+
+
+#else // ! defined (__x86_64__)
+
+
+jit_t *
+jit_create (void)
+{
+  return NULL;
+}
+
+
+void
+jit_destroy (jit_t * jit)
+{
+}
+
+
+void
+jit_flush (jit_t * jit)
+{
+}
+
+
+unsigned long long
+run_jit (jit_t * jit
+	 , dcpu_t * cpu
+	 , unsigned long long budget)
+{
+  return run_threaded (cpu, budget);
+}
+
+#endif
@@ -0,0 +1,34 @@
+#if ! defined (JIT_H)
+#define JIT_H
+
+#include "../dcpu.h"
+
+typedef struct jit_t jit_t;
+
+/**
+ * @return a new jit with an empty block cache, or NULL if its code
+ * buffer could not be mapped (or the host is not x86-64)
+ */
+jit_t * jit_create (void);
+
+void jit_destroy (jit_t * jit);
+
+/**
+ * Drops every compiled block.
+ */
+void jit_flush (jit_t * jit);
+
+/**
+ * Executes the program in ram from cpu->pc, translating straight-line
+ * runs of instructions to native code on their first execution.
+ * Runs on run_threaded if jit is NULL, or if its code buffer cannot be
+ * switched between writable and executable.
+ *
+ * @param budget maximum number of instructions to execute
+ * @return the number of executed instructions
+ */
+unsigned long long run_jit (jit_t * jit
+			    , dcpu_t * cpu
+			    , unsigned long long budget);
+
+#endif
@@ -0,0 +1,355 @@
+#if ! defined (X86_64_H)
+#define X86_64_H
+
+// minimal x86-64 encoder, only what the translator needs
+// (32 bits operand size unless stated otherwise)
+
+#include <stdint.h>
+#include <string.h>
+
+typedef enum x86_register_t
+  {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+
+  } x86_register_t;
+
+typedef enum x86_condition_t
+  {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7
+
+  } x86_condition_t;
+
+typedef enum x86_alu_t
+  {
+    // value of the /digit of the 0x81 (imm32) form,
+    // the register form being 0x01 + 8 * digit
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+
+  } x86_alu_t;
+
+typedef enum x86_shift_t
+  {
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7
+
+  } x86_shift_t;
+
+
+typedef struct emitter_t
+{
+  unsigned char * code;
+  size_t size;
+  size_t used;
+
+  // set if the code buffer has been exhausted
+  int overflow;
+
+} emitter_t;
+
+
+static inline void
+emit8 (emitter_t * e, uint8_t v)
+{
+  if (e->used < e->size)
+    {
+      e->code[e->used++] = v;
+    }
+  else
+    {
+      e->overflow = 1;
+    }
+}
+
+static inline void
+emit16 (emitter_t * e, uint16_t v)
+{
+  emit8 (e, v & 0xff);
+  emit8 (e, v >> 8);
+}
+
+static inline void
+emit32 (emitter_t * e, uint32_t v)
+{
+  emit16 (e, v & 0xffff);
+  emit16 (e, v >> 16);
+}
+
+static inline void
+emit64 (emitter_t * e, uint64_t v)
+{
+  emit32 (e, v & 0xffffffff);
+  emit32 (e, v >> 32);
+}
+
+static inline void
+emit_rex (emitter_t * e, int w, int r, int x, int b)
+{
+  uint8_t rex = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+  if (rex != 0x40)
+    {
+      emit8 (e, rex);
+    }
+}
+
+static inline void
+emit_modrm (emitter_t * e, int mod, int reg, int rm)
+{
+  emit8 (e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + index * 2 + disp32]
+static inline void
+emit_sib_disp32 (emitter_t * e, int reg, int base, int index, int32_t disp)
+{
+  emit_modrm (e, 2, reg, RSP);
+  emit8 (e, (1 << 6) | ((index & 7) << 3) | (base & 7));
+  emit32 (e, disp);
+}
+
+
+// mov dst, src
+static inline void
+emit_mov_rr (emitter_t * e, x86_register_t dst, x86_register_t src)
+{
+  emit_rex (e, 0, src, 0, dst);
+  emit8 (e, 0x89);
+  emit_modrm (e, 3, src, dst);
+}
+
+// movzx dst, src (16 bits)
+static inline void
+emit_movzx_rr (emitter_t * e, x86_register_t dst, x86_register_t src)
+{
+  emit_rex (e, 0, dst, 0, src);
+  emit8 (e, 0x0f);
+  emit8 (e, 0xb7);
+  emit_modrm (e, 3, dst, src);
+}
+
+// mov dst, imm32
+static inline void
+emit_mov_ri (emitter_t * e, x86_register_t dst, uint32_t imm)
+{
+  emit_rex (e, 0, 0, 0, dst);
+  emit8 (e, 0xb8 + (dst & 7));
+  emit32 (e, imm);
+}
+
+// mov dst, imm64
+static inline void
+emit_movabs (emitter_t * e, x86_register_t dst, uint64_t imm)
+{
+  emit_rex (e, 1, 0, 0, dst);
+  emit8 (e, 0xb8 + (dst & 7));
+  emit64 (e, imm);
+}
+
+// op dst, src
+static inline void
+emit_alu_rr (emitter_t * e, x86_alu_t op, x86_register_t dst, x86_register_t src)
+{
+  emit_rex (e, 0, src, 0, dst);
+  emit8 (e, 0x01 + 8 * op);
+  emit_modrm (e, 3, src, dst);
+}
+
+// op dst, imm32
+static inline void
+emit_alu_ri (emitter_t * e, x86_alu_t op, x86_register_t dst, uint32_t imm)
+{
+  emit_rex (e, 0, 0, 0, dst);
+  emit8 (e, 0x81);
+  emit_modrm (e, 3, op, dst);
+  emit32 (e, imm);
+}
+
+// test a, b
+static inline void
+emit_test_rr (emitter_t * e, x86_register_t a, x86_register_t b)
+{
+  emit_rex (e, 0, b, 0, a);
+  emit8 (e, 0x85);
+  emit_modrm (e, 3, b, a);
+}
+
+// imul dst, src
+static inline void
+emit_imul_rr (emitter_t * e, x86_register_t dst, x86_register_t src)
+{
+  emit_rex (e, 0, dst, 0, src);
+  emit8 (e, 0x0f);
+  emit8 (e, 0xaf);
+  emit_modrm (e, 3, dst, src);
+}
+
+// div src (edx:eax / src)
+static inline void
+emit_div_r (emitter_t * e, x86_register_t src)
+{
+  emit_rex (e, 0, 0, 0, src);
+  emit8 (e, 0xf7);
+  emit_modrm (e, 3, 6, src);
+}
+
+// shift dst, cl
+static inline void
+emit_shift_cl (emitter_t * e, x86_shift_t op, x86_register_t dst)
+{
+  emit_rex (e, 0, 0, 0, dst);
+  emit8 (e, 0xd3);
+  emit_modrm (e, 3, op, dst);
+}
+
+// shift dst, imm8
+static inline void
+emit_shift_ri (emitter_t * e, x86_shift_t op, x86_register_t dst, uint8_t imm)
+{
+  emit_rex (e, 0, 0, 0, dst);
+  emit8 (e, 0xc1);
+  emit_modrm (e, 3, op, dst);
+  emit8 (e, imm);
+}
+
+// movzx dst, word [base + index * 2 + disp]
+static inline void
+emit_load16_indexed (emitter_t * e, x86_register_t dst
+		     , x86_register_t base, x86_register_t index, int32_t disp)
+{
+  emit_rex (e, 0, dst, index, base);
+  emit8 (e, 0x0f);
+  emit8 (e, 0xb7);
+  emit_sib_disp32 (e, dst, base, index, disp);
+}
+
+// mov word [base + index * 2 + disp], src
+static inline void
+emit_store16_indexed (emitter_t * e, x86_register_t src
+		      , x86_register_t base, x86_register_t index, int32_t disp)
+{
+  emit8 (e, 0x66);
+  emit_rex (e, 0, src, index, base);
+  emit8 (e, 0x89);
+  emit_sib_disp32 (e, src, base, index, disp);
+}
+
+// mov word [base + index * 2 + disp], imm16
+static inline void
+emit_store16i_indexed (emitter_t * e, uint16_t imm
+		       , x86_register_t base, x86_register_t index, int32_t disp)
+{
+  emit8 (e, 0x66);
+  emit_rex (e, 0, 0, index, base);
+  emit8 (e, 0xc7);
+  emit_sib_disp32 (e, 0, base, index, disp);
+  emit16 (e, imm);
+}
+
+// movzx dst, word [base + disp] (base is neither rsp nor r12)
+static inline void
+emit_load16 (emitter_t * e, x86_register_t dst, x86_register_t base, int32_t disp)
+{
+  emit_rex (e, 0, dst, 0, base);
+  emit8 (e, 0x0f);
+  emit8 (e, 0xb7);
+  emit_modrm (e, 2, dst, base);
+  emit32 (e, disp);
+}
+
+// mov word [base + disp], src (base is neither rsp nor r12)
+static inline void
+emit_store16 (emitter_t * e, x86_register_t src, x86_register_t base, int32_t disp)
+{
+  emit8 (e, 0x66);
+  emit_rex (e, 0, src, 0, base);
+  emit8 (e, 0x89);
+  emit_modrm (e, 2, src, base);
+  emit32 (e, disp);
+}
+
+// mov byte [base + index + disp], imm8
+static inline void
+emit_store8i_indexed (emitter_t * e, uint8_t imm
+		      , x86_register_t base, x86_register_t index, int32_t disp)
+{
+  emit_rex (e, 0, 0, index, base);
+  emit8 (e, 0xc6);
+  emit_modrm (e, 2, 0, RSP);
+  emit8 (e, ((index & 7) << 3) | (base & 7));
+  emit32 (e, disp);
+  emit8 (e, imm);
+}
+
+// cmp byte [base + index], 0
+static inline void
+emit_cmp_byte_zero (emitter_t * e, x86_register_t base, x86_register_t index)
+{
+  emit_rex (e, 0, 0, index, base);
+  emit8 (e, 0x80);
+  emit_modrm (e, 0, 7, RSP);
+  emit8 (e, ((index & 7) << 3) | (base & 7));
+  emit8 (e, 0);
+}
+
+static inline void
+emit_push (emitter_t * e, x86_register_t r)
+{
+  emit_rex (e, 0, 0, 0, r);
+  emit8 (e, 0x50 + (r & 7));
+}
+
+static inline void
+emit_pop (emitter_t * e, x86_register_t r)
+{
+  emit_rex (e, 0, 0, 0, r);
+  emit8 (e, 0x58 + (r & 7));
+}
+
+static inline void
+emit_ret (emitter_t * e)
+{
+  emit8 (e, 0xc3);
+}
+
+// jcc rel32, @return the offset of the rel32 to patch
+static inline size_t
+emit_jcc (emitter_t * e, x86_condition_t cc)
+{
+  emit8 (e, 0x0f);
+  emit8 (e, 0x80 + cc);
+  emit32 (e, 0);
+  return e->used - 4;
+}
+
+// jmp rel32, @return the offset of the rel32 to patch
+static inline size_t
+emit_jmp (emitter_t * e)
+{
+  emit8 (e, 0xe9);
+  emit32 (e, 0);
+  return e->used - 4;
+}
+
+// makes the rel32 at offset 'at' point to offset 'target'
+static inline void
+patch_rel32 (emitter_t * e, size_t at, size_t target)
+{
+  int32_t rel = (int32_t) (target - (at + 4));
+  if (at + 4 <= e->size)
+    {
+      memcpy (&e->code[at], &rel, sizeof(rel));
+    }
+}
+
+#endif
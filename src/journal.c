@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "journal.h"
+#include "predecode.h"
+
+
+typedef struct journal_record_t
+{
+  word pc;
+  word sp;
+  word o;
+
+  // the word written by the instruction, a ram address for a
+  // MEMORY_REFERENCE or a dcpu_t offset for a DCPU_REFERENCE
+  // (UNKNOWN_VALUE if it did not write anything but pc, sp or o)
+  unsigned char type;
+  word location;
+  word value;
+
+} journal_record_t;
+
+struct journal_t
+{
+  // index of the next record, wraps around
+  unsigned long long head;
+  unsigned int size;
+  unsigned int mask;
+
+  journal_record_t records [];
+};
+
+
+journal_t *
+journal_create (unsigned int capacity)
+{
+  unsigned int rounded = 1;
+  journal_t * journal = NULL;
+
+  while (rounded < capacity && rounded < (1u << 31))
+    {
+      rounded <<= 1;
+    }
+
+  journal = malloc (sizeof(journal_t) + rounded * sizeof(journal_record_t));
+  if (NULL == journal)
+    {
+      return NULL;
+    }
+
+  journal->head = 0;
+  journal->size = 0;
+  journal->mask = rounded - 1;
+
+  return journal;
+}
+
+
+void
+journal_destroy (journal_t * journal)
+{
+  free (journal);
+}
+
+
+void
+journal_begin (journal_t * journal, const dcpu_t * cpu)
+{
+  journal_record_t * record = NULL;
+
+  if (NULL == journal)
+    {
+      return;
+    }
+
+  record = &journal->records[journal->head & journal->mask];
+
+  record->pc = cpu->pc;
+  record->sp = cpu->sp;
+  record->o = cpu->o;
+  record->type = UNKNOWN_VALUE;
+
+  ++journal->head;
+  if (journal->size <= journal->mask)
+    {
+      ++journal->size;
+    }
+}
+
+
+void
+journal_record_write (journal_t * journal
+		      , const dcpu_t * cpu
+		      , TaggedValue tvalue)
+{
+  journal_record_t * record = NULL;
+
+  if (0 == journal->size)
+    {
+      // written outside of an instruction
+      return;
+    }
+
+  record = &journal->records[(journal->head - 1) & journal->mask];
+
+  // an instruction writes a single word besides pc, sp and o
+  assert (UNKNOWN_VALUE == record->type);
+
+  record->type = tvalue.type;
+  record->location = tvalue.value;
+  record->value = MEMORY_REFERENCE == tvalue.type
+    ? cpu->ram[tvalue.value]
+    : *((const word *) ((const char *) cpu + tvalue.value));
+}
+
+
+bool
+journal_undo (journal_t * journal, dcpu_t * cpu)
+{
+  const journal_record_t * record = NULL;
+
+  if (NULL == journal || 0 == journal->size)
+    {
+      return false;
+    }
+
+  --journal->head;
+  --journal->size;
+  record = &journal->records[journal->head & journal->mask];
+
+  switch (record->type)
+    {
+    case MEMORY_REFERENCE:
+      cpu->ram[record->location] = record->value;
+      mark_dirty (cpu, record->location);
+      if (NULL != cpu->decode_cache)
+	{
+	  decode_cache_invalidate (cpu->decode_cache, record->location);
+	}
+      break;
+
+    case DCPU_REFERENCE:
+      *((word *) ((char *) cpu + record->location)) = record->value;
+      break;
+
+    default:
+      break;
+    }
+
+  cpu->pc = record->pc;
+  cpu->sp = record->sp;
+  cpu->o = record->o;
+
+  return true;
+}
+
+
+bool
+journal_last_write (const journal_t * journal
+		    , TaggedValueType * type
+		    , word * location)
+{
+  const journal_record_t * record = NULL;
+
+  if (0 == journal->size)
+    {
+      return false;
+    }
+
+  record = &journal->records[(journal->head - 1) & journal->mask];
+  if (UNKNOWN_VALUE == record->type)
+    {
+      return false;
+    }
+
+  *type = record->type;
+  *location = record->location;
+
+  return true;
+}
+
+
+unsigned int
+journal_size (const journal_t * journal)
+{
+  return journal->size;
+}
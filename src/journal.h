@@ -0,0 +1,57 @@
+#if ! defined (JOURNAL_H)
+#define JOURNAL_H
+
+#include "dcpu.h"
+
+// undo journal: a bounded ring of fixed size records, one per executed
+// instruction, holding what is needed to step it back
+typedef struct journal_t journal_t;
+
+/**
+ * @param capacity number of instructions that can be stepped back,
+ * rounded up to a power of two
+ * @return a new empty journal or NULL if it could not be allocated
+ */
+journal_t * journal_create (unsigned int capacity);
+
+void journal_destroy (journal_t * journal);
+
+/**
+ * Starts the record of the instruction at cpu->pc, to be called right
+ * before executing it (the oldest record is dropped if the journal is
+ * full). Does nothing if journal is NULL.
+ */
+void journal_begin (journal_t * journal, const dcpu_t * cpu);
+
+/**
+ * Records the value a register or ram word had before being written,
+ * called by assign_to_tagged_value for cpu->journal.
+ */
+void journal_record_write (journal_t * journal
+			   , const dcpu_t * cpu
+			   , TaggedValue tvalue);
+
+/**
+ * Steps the last recorded instruction back.
+ *
+ * @return false if the journal is empty (or NULL)
+ */
+bool journal_undo (journal_t * journal, dcpu_t * cpu);
+
+/**
+ * Tells what the last recorded instruction wrote besides pc, sp and o.
+ *
+ * @param type set to MEMORY_REFERENCE or DCPU_REFERENCE
+ * @param location set to the ram address or dcpu_t offset written
+ * @return false if it did not write anything (or the journal is empty)
+ */
+bool journal_last_write (const journal_t * journal
+			 , TaggedValueType * type
+			 , word * location);
+
+/**
+ * @return the number of instructions that can be stepped back
+ */
+unsigned int journal_size (const journal_t * journal);
+
+#endif
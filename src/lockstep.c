@@ -0,0 +1,649 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "threaded.h"
+
+// rounds over which the use of the lanes is measured
+#define LOCKSTEP_WINDOW 256
+
+// run_lockstep is flattened, every lane helper being inlined in each
+// of its clones, so that they all use the vector width of the clone
+#if defined (HAVE_TARGET_CLONES) && defined (__x86_64__)
+#define LOCKSTEP_KERNEL \
+  __attribute__ ((flatten, target_clones ("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define LOCKSTEP_KERNEL __attribute__ ((flatten))
+#endif
+
+
+typedef enum lane_operand_kind_t
+  {
+    // one word per lane, at the same place for every lane: register,
+    // SP, O or [next word]
+    LANE_SHARED,
+    // ram at a per lane address
+    LANE_MEMORY,
+    LANE_PC,
+    LANE_LITERAL
+
+  } lane_operand_kind_t;
+
+typedef struct lane_operand_t
+{
+  lane_operand_kind_t kind;
+  lane_word_t * shared;
+  lane_word_t address;
+  word literal;
+
+} lane_operand_t;
+
+
+// mask ? a : b, mask being 0xffff or 0 per lane (vectors are not
+// passed around by value: without AVX enabled, that changes the ABI)
+#define SELECT_LANES(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define BROADCAST(value) ((lane_word_t) { 0 } + (word) (value))
+
+// true if the lane vectors are equal, e.g. NO_LANE(mask) or if a mask
+// covers the same lanes as another one
+#define SAME_LANES(a, b)					\
+  ({								\
+    lane_word_t same_diff = (a) ^ (b);				\
+    uint64_t same_chunks [sizeof(lane_word_t) / sizeof(uint64_t)];	\
+    uint64_t same_any = 0;					\
+    unsigned int same_i = 0;					\
+    memcpy (same_chunks, &same_diff, sizeof(same_diff));	\
+    for (same_i = 0; same_i < sizeof(same_chunks) / sizeof(uint64_t); ++same_i) \
+      {								\
+	same_any |= same_chunks[same_i];			\
+      }								\
+    0 == same_any;						\
+  })
+
+static const lane_word_t no_lane = { 0 };
+
+
+// mirrors operand() of the threaded engine, side effects (SP) being
+// limited to the active lanes
+static lane_operand_t
+lane_operand (lockstep_t * lockstep
+	      , const lane_word_t * active
+	      , unsigned char value
+	      , word * pc
+	      , unsigned int leader)
+{
+  lane_operand_t operand = { .kind = LANE_MEMORY, .shared = NULL };
+
+  switch (value)
+    {
+    case 0x00 ... 0x07:
+      operand.kind = LANE_SHARED;
+      operand.shared = &lockstep->registers[value];
+      break;
+
+    case 0x08 ... 0x0f:
+      operand.address = lockstep->registers[value - 0x08];
+      break;
+
+    case 0x10 ... 0x17:
+      operand.address = lockstep->registers[value - 0x10]
+	+ lockstep->ram[(*pc)++][leader];
+      break;
+
+    case 0x18:
+      operand.address = lockstep->sp;
+      lockstep->sp = SELECT_LANES (*active, lockstep->sp + 1, lockstep->sp);
+      break;
+
+    case 0x19:
+      operand.address = lockstep->sp;
+      break;
+
+    case 0x1a:
+      lockstep->sp = SELECT_LANES (*active, lockstep->sp - 1, lockstep->sp);
+      operand.address = lockstep->sp;
+      break;
+
+    case 0x1b:
+      operand.kind = LANE_SHARED;
+      operand.shared = &lockstep->sp;
+      break;
+
+    case 0x1c:
+      operand.kind = LANE_PC;
+      break;
+
+    case 0x1d:
+      operand.kind = LANE_SHARED;
+      operand.shared = &lockstep->o;
+      break;
+
+    case 0x1e:
+      operand.kind = LANE_SHARED;
+      operand.shared = &lockstep->ram[lockstep->ram[(*pc)++][leader]];
+      break;
+
+    case 0x1f:
+      operand.kind = LANE_LITERAL;
+      operand.literal = lockstep->ram[(*pc)++][leader];
+      break;
+
+    default:
+      operand.kind = LANE_LITERAL;
+      operand.literal = value - 0x20;
+      break;
+    }
+
+  return operand;
+}
+
+
+// @param next the address of the next instruction, i.e. the value of PC
+static void
+read_operand (const lockstep_t * lockstep
+	      , const lane_operand_t * operand
+	      , word next
+	      , lane_word_t * value)
+{
+  unsigned int lane = 0;
+
+  switch (operand->kind)
+    {
+    case LANE_SHARED:
+      *value = *operand->shared;
+      break;
+
+    case LANE_MEMORY:
+      for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	{
+	  (*value)[lane] = lockstep->ram[operand->address[lane]][lane];
+	}
+      break;
+
+    case LANE_PC:
+      *value = BROADCAST (next);
+      break;
+
+    case LANE_LITERAL:
+      *value = BROADCAST (operand->literal);
+      break;
+    }
+}
+
+
+static void
+write_operand (lockstep_t * lockstep
+	       , const lane_operand_t * operand
+	       , const lane_word_t * active
+	       , const lane_word_t * value)
+{
+  unsigned int lane = 0;
+
+  switch (operand->kind)
+    {
+    case LANE_SHARED:
+      *operand->shared = SELECT_LANES (*active, *value, *operand->shared);
+      break;
+
+    case LANE_MEMORY:
+      for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	{
+	  if ((*active)[lane])
+	    {
+	      lockstep->ram[operand->address[lane]][lane] = (*value)[lane];
+	    }
+	}
+      break;
+
+    case LANE_PC:
+      lockstep->pc = SELECT_LANES (*active, *value, lockstep->pc);
+      break;
+
+    case LANE_LITERAL:
+      // silently ignored
+      break;
+    }
+}
+
+
+// executes the instruction at the pc of 'leader' on the active lanes,
+// which all share that pc and the words of the instruction
+static void
+step (lockstep_t * lockstep, const lane_word_t * active_lanes, unsigned int leader)
+{
+  lane_word_t active = *active_lanes;
+  word pc = lockstep->pc[leader];
+  word instruction = lockstep->ram[pc++][leader];
+  unsigned char opcode = instruction & DCPU_INST_OPCODE_MASK;
+  lane_operand_t a;
+  lane_operand_t b;
+  lane_word_t value_a;
+  lane_word_t value_b;
+  lane_word_t result;
+  lane_word_t overflow;
+  lane_dword_t wide_a;
+  lane_dword_t wide_b;
+  lane_dword_t wide;
+  lane_dword_t in_range;
+  lane_word_t skip = { 0 };
+  unsigned int lane = 0;
+  bool writes = true;
+  bool sets_o = false;
+
+  if (OPCODE_BASIC == opcode)
+    {
+      if (0x01 == ((instruction & DCPU_INST_A_MASK) >> 4))
+	{
+	  a = lane_operand (lockstep, active_lanes, (instruction & DCPU_INST_B_MASK) >> 10, &pc, leader);
+	  lockstep->sp = SELECT_LANES (active, lockstep->sp - 1, lockstep->sp);
+	  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	    {
+	      if (active[lane])
+		{
+		  lockstep->ram[lockstep->sp[lane]][lane] = pc;
+		}
+	    }
+	  read_operand (lockstep, &a, pc, &value_a);
+	  lockstep->pc = SELECT_LANES (active, value_a, lockstep->pc);
+	}
+      else
+	{
+	  lockstep->pc = SELECT_LANES (active, BROADCAST (pc), lockstep->pc);
+	}
+      return;
+    }
+
+  // we want to preserve the eval order, value 'a' then 'b'
+  a = lane_operand (lockstep, active_lanes, (instruction & DCPU_INST_A_MASK) >> 4, &pc, leader);
+  b = lane_operand (lockstep, active_lanes, (instruction & DCPU_INST_B_MASK) >> 10, &pc, leader);
+  lockstep->pc = SELECT_LANES (active, BROADCAST (pc), lockstep->pc);
+
+  read_operand (lockstep, &a, pc, &value_a);
+  read_operand (lockstep, &b, pc, &value_b);
+  wide_a = __builtin_convertvector (value_a, lane_dword_t);
+  wide_b = __builtin_convertvector (value_b, lane_dword_t);
+
+  switch (opcode)
+    {
+    case OPCODE_SET:
+      result = value_b;
+      break;
+
+    case OPCODE_ADD:
+      wide = wide_a + wide_b;
+      result = __builtin_convertvector (wide, lane_word_t);
+      overflow = __builtin_convertvector (wide >> 16, lane_word_t);
+      sets_o = true;
+      break;
+
+    case OPCODE_SUB:
+      result = value_a - value_b;
+      overflow = (lane_word_t) (value_a < value_b);
+      sets_o = true;
+      break;
+
+    case OPCODE_MUL:
+      wide = wide_a * wide_b;
+      result = __builtin_convertvector (wide, lane_word_t);
+      overflow = __builtin_convertvector (wide >> 16, lane_word_t);
+      sets_o = true;
+      break;
+
+    case OPCODE_DIV:
+      // no vector division
+      for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	{
+	  uint32_t divisor = wide_b[lane];
+	  result[lane] = 0 != divisor ? wide_a[lane] / divisor : 0;
+	  overflow[lane] = 0 != divisor ? (wide_a[lane] << 16) / divisor : 0;
+	}
+      sets_o = true;
+      break;
+
+    case OPCODE_MOD:
+      for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	{
+	  result[lane] = 0 != value_b[lane] ? value_a[lane] % value_b[lane] : 0;
+	}
+      break;
+
+    case OPCODE_SHL:
+      in_range = (lane_dword_t) (wide_b < 32);
+      wide = (wide_a << (wide_b & 31)) & in_range;
+      result = __builtin_convertvector (wide, lane_word_t);
+      overflow = __builtin_convertvector (wide >> 16, lane_word_t);
+      sets_o = true;
+      break;
+
+    case OPCODE_SHR:
+      in_range = (lane_dword_t) (wide_b < 32);
+      result = __builtin_convertvector ((wide_a >> (wide_b & 31)) & in_range, lane_word_t);
+      wide = ((wide_a << 16) >> (wide_b & 31)) & in_range;
+      overflow = __builtin_convertvector (wide, lane_word_t);
+      sets_o = true;
+      break;
+
+    case OPCODE_AND:
+      result = value_a & value_b;
+      break;
+
+    case OPCODE_BOR:
+      result = value_a | value_b;
+      break;
+
+    case OPCODE_XOR:
+      result = value_a ^ value_b;
+      break;
+
+    case OPCODE_IFE:
+      skip = (lane_word_t) (value_a != value_b);
+      writes = false;
+      break;
+
+    case OPCODE_IFN:
+      skip = (lane_word_t) (value_a == value_b);
+      writes = false;
+      break;
+
+    case OPCODE_IFG:
+      skip = (lane_word_t) (value_a <= value_b);
+      writes = false;
+      break;
+
+    case OPCODE_IFB:
+      skip = (lane_word_t) (0 == (value_a & value_b));
+      writes = false;
+      break;
+    }
+
+  if (writes)
+    {
+      write_operand (lockstep, &a, active_lanes, &result);
+      if (sets_o)
+	{
+	  lockstep->o = SELECT_LANES (active, overflow, lockstep->o);
+	}
+      return;
+    }
+
+  skip &= active;
+  if (SAME_LANES (skip, no_lane))
+    {
+      return;
+    }
+
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      if (skip[lane])
+	{
+	  // the skipped instruction may differ from one lane to the other
+	  word next = lockstep->pc[lane];
+	  lockstep->pc[lane] = next + instruction_length (lockstep->ram[next][lane]);
+	}
+    }
+}
+
+
+lockstep_t *
+lockstep_create (void)
+{
+  void * lockstep = NULL;
+
+  if (0 != posix_memalign (&lockstep, __alignof__ (lockstep_t), sizeof(lockstep_t)))
+    {
+      return NULL;
+    }
+
+  memset (lockstep, 0, sizeof(lockstep_t));
+  return lockstep;
+}
+
+
+void
+lockstep_destroy (lockstep_t * lockstep)
+{
+  free (lockstep);
+}
+
+
+void
+lockstep_reset (lockstep_t * lockstep, const word * image, size_t size)
+{
+  size_t address = 0;
+  unsigned char i = 0;
+
+  for (address = 0; address < size && address < RAM_SIZE; ++address)
+    {
+      lockstep->ram[address] = BROADCAST (image[address]);
+    }
+  memset (&lockstep->ram[address], 0, (RAM_SIZE - address) * sizeof(lane_word_t));
+
+  lockstep->pc = BROADCAST (0);
+  lockstep->sp = BROADCAST (RAM_SIZE - 1);
+  lockstep->o = BROADCAST (0);
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      lockstep->registers[i] = BROADCAST (0);
+    }
+}
+
+
+void
+lockstep_load (lockstep_t * lockstep, unsigned int lane, const dcpu_t * cpu)
+{
+  unsigned int address = 0;
+  unsigned char i = 0;
+
+  lockstep->pc[lane] = cpu->pc;
+  lockstep->sp[lane] = cpu->sp;
+  lockstep->o[lane] = cpu->o;
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      lockstep->registers[i][lane] = cpu->registers[i];
+    }
+
+  for (address = 0; address < RAM_SIZE; ++address)
+    {
+      lockstep->ram[address][lane] = cpu->ram[address];
+    }
+}
+
+
+void
+lockstep_store (const lockstep_t * lockstep, unsigned int lane, dcpu_t * cpu)
+{
+  unsigned int address = 0;
+  unsigned char i = 0;
+
+  cpu->pc = lockstep->pc[lane];
+  cpu->sp = lockstep->sp[lane];
+  cpu->o = lockstep->o[lane];
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      cpu->registers[i] = lockstep->registers[i][lane];
+    }
+
+  for (address = 0; address < RAM_SIZE; ++address)
+    {
+      cpu->ram[address] = lockstep->ram[address][lane];
+    }
+  mark_all_dirty (cpu);
+
+  cpu->decode_cache = NULL;
+}
+
+
+// the lowest number of instructions a live lane can still execute
+static unsigned long long
+horizon (const lane_word_t * live
+	 , unsigned long long budget
+	 , const unsigned long long executed [])
+{
+  unsigned long long lowest = budget;
+  unsigned int lane = 0;
+
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      if ((*live)[lane] && budget - executed[lane] < lowest)
+	{
+	  lowest = budget - executed[lane];
+	}
+    }
+
+  return lowest;
+}
+
+
+LOCKSTEP_KERNEL void
+run_lockstep (lockstep_t * lockstep
+	      , unsigned int lanes
+	      , unsigned long long budget
+	      , unsigned long long executed [])
+{
+  lane_word_t live = { 0 };
+  unsigned long long counts [LOCKSTEP_LANES] = { 0 };
+  unsigned int running = 0;
+  unsigned int lane = 0;
+  unsigned int leader = 0;
+  // every live lane is at the pc of the leader
+  bool converged = false;
+  // rounds run by every live lane, not added to the counts yet
+  unsigned long long together = 0;
+  unsigned long long until_finished = 0;
+  unsigned int rounds = 0;
+  // lanes executing together vs lanes that could have, over the window
+  unsigned long long used = 0;
+  unsigned long long available = 0;
+
+  for (lane = 0; lane < lanes && lane < LOCKSTEP_LANES; ++lane)
+    {
+      if (budget > 0)
+	{
+	  live[lane] = 0xffff;
+	  ++running;
+	}
+    }
+  until_finished = budget;
+
+  while (running > 0)
+    {
+      lane_word_t active;
+      word pc = 0;
+      word instruction = 0;
+      unsigned char length = 0;
+      unsigned char i = 0;
+
+      if ( ! converged)
+	{
+	  // the lowest pc goes first, which lets lanes that branched
+	  // apart join again after a forward jump
+	  leader = LOCKSTEP_LANES;
+	  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	    {
+	      if (live[lane]
+		  && (LOCKSTEP_LANES == leader
+		      || lockstep->pc[lane] < lockstep->pc[leader]))
+		{
+		  leader = lane;
+		}
+	    }
+	}
+
+      pc = lockstep->pc[leader];
+      instruction = lockstep->ram[pc][leader];
+
+      // as executed: an unknown instruction only reads its first word
+      length = 0 == (instruction & DCPU_INST_OPCODE_MASK)
+	&& 0x01 != ((instruction & DCPU_INST_A_MASK) >> 4)
+	? 1 : instruction_length (instruction);
+
+      active = converged ? live : live & (lane_word_t) (lockstep->pc == pc);
+      for (i = 0; i < length; ++i)
+	{
+	  word address = pc + i;
+	  active &= (lane_word_t) (lockstep->ram[address] == lockstep->ram[address][leader]);
+	}
+
+      step (lockstep, &active, leader);
+
+      available += running;
+      if (SAME_LANES (active, live))
+	{
+	  ++together;
+	  used += running;
+
+	  // lanes go on together unless the instruction sent them to
+	  // different places (IFx, writes to PC, JSR)
+	  converged = SAME_LANES (lockstep->pc & live
+				  , BROADCAST (lockstep->pc[leader]) & live);
+	}
+      else
+	{
+	  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	    {
+	      if (active[lane])
+		{
+		  ++counts[lane];
+		  ++used;
+		}
+	    }
+	  converged = false;
+	}
+
+      if (together == until_finished || ! SAME_LANES (active, live))
+	{
+	  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+	    {
+	      if (live[lane])
+		{
+		  counts[lane] += together;
+		  if (counts[lane] == budget)
+		    {
+		      live[lane] = 0;
+		      --running;
+		      converged = false;
+		    }
+		}
+	    }
+	  together = 0;
+	  until_finished = horizon (&live, budget, counts);
+	}
+
+      if (++rounds == LOCKSTEP_WINDOW)
+	{
+	  if (used * 4 < available)
+	    {
+	      // diverged too much
+	      break;
+	    }
+	  rounds = 0;
+	  used = 0;
+	  available = 0;
+	}
+    }
+
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      if (live[lane])
+	{
+	  counts[lane] += together;
+	}
+    }
+
+  // one lane at a time on the scalar engine
+  for (lane = 0; lane < LOCKSTEP_LANES; ++lane)
+    {
+      if (live[lane])
+	{
+	  lockstep_store (lockstep, lane, &lockstep->scalar);
+	  counts[lane] += run_threaded (&lockstep->scalar, budget - counts[lane]);
+	  lockstep_load (lockstep, lane, &lockstep->scalar);
+	}
+    }
+
+  for (lane = 0; lane < lanes && lane < LOCKSTEP_LANES; ++lane)
+    {
+      executed[lane] = counts[lane];
+    }
+}
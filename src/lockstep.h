@@ -0,0 +1,72 @@
+#if ! defined (LOCKSTEP_H)
+#define LOCKSTEP_H
+
+#include "dcpu.h"
+
+// vms per lockstep group, set by configure (--with-lanes)
+#if ! defined (LOCKSTEP_LANES)
+#define LOCKSTEP_LANES 16
+#endif
+
+// GCC vector extensions: one element per vm. run_lockstep is cloned
+// for AVX-512 and AVX2 when configure finds target_clones, the cpu
+// picking one at load time; otherwise the width is the one CFLAGS
+// allow (e.g. -march=native), SSE2 by default on x86-64
+typedef uint16_t lane_word_t
+__attribute__ ((vector_size (LOCKSTEP_LANES * sizeof(uint16_t))));
+
+typedef uint32_t lane_dword_t
+__attribute__ ((vector_size (LOCKSTEP_LANES * sizeof(uint32_t))));
+
+
+// LOCKSTEP_LANES vms as a structure of arrays
+typedef struct lockstep_t
+{
+  lane_word_t pc;
+  lane_word_t sp;
+  lane_word_t o;
+  lane_word_t registers [REGISTER_COUNT];
+
+  // ram[address][lane]
+  lane_word_t ram [RAM_SIZE];
+
+  // used to run lanes on the scalar engine when they diverge
+  dcpu_t scalar;
+
+} lockstep_t;
+
+
+/**
+ * @return a new group, every lane zeroed, or NULL if it could not be
+ * allocated
+ */
+lockstep_t * lockstep_create (void);
+
+void lockstep_destroy (lockstep_t * lockstep);
+
+/**
+ * Resets every lane to the image loaded at address 0, with zeroed
+ * registers and SP at the top of the ram.
+ */
+void lockstep_reset (lockstep_t * lockstep, const word * image, size_t size);
+
+/**
+ * Copies a vm state into a lane, or the other way around.
+ */
+void lockstep_load (lockstep_t * lockstep, unsigned int lane, const dcpu_t * cpu);
+void lockstep_store (const lockstep_t * lockstep, unsigned int lane, dcpu_t * cpu);
+
+/**
+ * Runs the first 'lanes' lanes for 'budget' instructions each. Lanes
+ * sharing a pc (and the code there) execute together, the lane with
+ * the lowest pc being scheduled first; the group is finished on the
+ * scalar engine when too few lanes are left running together.
+ *
+ * @param executed set to the number of instructions executed per lane
+ */
+void run_lockstep (lockstep_t * lockstep
+		   , unsigned int lanes
+		   , unsigned long long budget
+		   , unsigned long long executed []);
+
+#endif
@@ -0,0 +1,570 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "dcpu.h"
+#include "disassembler.h"
+#include "image.h"
+#include "batch.h"
+#include "predecode.h"
+#include "recorder.h"
+#include "profiler.h"
+#include "cfg.h"
+
+
+static void
+usage (const char * name)
+{
+  fprintf (stderr
+	   , "usage: %s [--batch IMAGE [--instances N] [--budget N]"
+	   " [--threads N] [--seed N] [--engine threaded|jit|lockstep]]\n"
+	   "       %s --disassemble DUMP [--output FILE] [--threads N]\n"
+	   "       %s --trace-out FILE [--image IMAGE] [--budget N]\n"
+	   "       %s --profile REPORT [--folded FILE] [--image IMAGE] [--budget N]\n"
+	   "       %s --cfg DOT [--image IMAGE]\n"
+	   "       %s --script FILE [--image IMAGE] [--budget N]\n"
+	   , name
+	   , name
+	   , name
+	   , name
+	   , name
+	   , name);
+}
+
+
+// runs N instances of an image, one result line per instance
+static int
+batch_main (const char * path, batch_t * batch)
+{
+  size_t size = 0;
+  unsigned int i = 0;
+  struct timespec start;
+  struct timespec end;
+  unsigned long long executed = 0;
+  double elapsed = 0;
+
+  word * image = load_image (path, &size);
+  if (NULL == image)
+    {
+      fprintf (stderr, "Could not load image %s\n", path);
+      return 1;
+    }
+
+  batch->image = image;
+  batch->image_size = size;
+  batch->results = calloc (batch->instances > 0 ? batch->instances : 1
+			   , sizeof(batch_result_t));
+  if (NULL == batch->results)
+    {
+      free (image);
+      return 1;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (0 != run_batch (batch))
+    {
+      fprintf (stderr, "Could not run every instance of the batch\n");
+      free (batch->results);
+      free (image);
+      return 1;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  // instance executed pc sp o A B C X Y Z I J ram_digest
+  for (i = 0; i < batch->instances; ++i)
+    {
+      const batch_result_t * result = &batch->results[i];
+      unsigned char r = 0;
+
+      printf ("%u %llu %04x %04x %04x"
+	      , i
+	      , result->executed
+	      , result->pc
+	      , result->sp
+	      , result->o);
+      for (r = 0; r < REGISTER_COUNT; ++r)
+	{
+	  printf (" %04x", result->registers[r]);
+	}
+      printf (" %016llx\n", (unsigned long long) result->ram_digest);
+
+      executed += result->executed;
+    }
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  fprintf (stderr
+	   , "%u instances, %llu instructions in %.3fs (%.1f MIPS)\n"
+	   , batch->instances
+	   , executed
+	   , elapsed
+	   , elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+
+  free (batch->results);
+  free (image);
+
+  return 0;
+}
+
+
+// runs a program for budget instructions, recording them to path
+static int
+record_main (const word program []
+	     , size_t size
+	     , const char * path
+	     , unsigned long long budget)
+{
+  struct timespec start;
+  struct timespec end;
+  unsigned long long executed = 0;
+  double elapsed = 0;
+  recorder_t * recorder = NULL;
+
+  dcpu_t * cpu = calloc (1, sizeof(dcpu_t));
+  if (NULL == cpu)
+    {
+      return 1;
+    }
+  memcpy (cpu->ram, program, size * sizeof(word));
+  mark_all_dirty (cpu);
+  cpu->sp = RAM_SIZE - 1;
+  cpu->decode_cache = decode_cache_create ();
+
+  recorder = recorder_open (path);
+  if (NULL == recorder)
+    {
+      fprintf (stderr, "Could not create %s\n", path);
+      decode_cache_destroy (cpu->decode_cache);
+      free (cpu);
+      return 1;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  executed = recorder_run (recorder, cpu, budget);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  decode_cache_destroy (cpu->decode_cache);
+  free (cpu);
+
+  if (0 != recorder_close (recorder))
+    {
+      fprintf (stderr, "Could not write the recording to %s\n", path);
+      return 1;
+    }
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  fprintf (stderr
+	   , "%llu instructions recorded in %.3fs (%.1f MIPS)\n"
+	   , executed
+	   , elapsed
+	   , elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+
+  return 0;
+}
+
+
+// writes a report to path ("-" for stdout), @return 0 on success
+static int
+write_report (const char * path
+	      , int (* write) (const profile_t *, const word [], FILE *)
+	      , const profile_t * profile
+	      , const word ram [])
+{
+  FILE * out = 0 == strcmp (path, "-") ? stdout : fopen (path, "w");
+  int result = 0;
+
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", path);
+      return 1;
+    }
+
+  result = write (profile, ram, out);
+  if ((stdout != out && 0 != fclose (out)) || (stdout == out && 0 != fflush (out)))
+    {
+      result = 1;
+    }
+  if (0 != result)
+    {
+      fprintf (stderr, "Could not write to %s\n", path);
+    }
+
+  return result;
+}
+
+// runs a program for budget instructions, then writes its profile to
+// path and, if folded_path is not NULL, its folded stacks
+static int
+profile_main (const word program []
+	      , size_t size
+	      , const char * path
+	      , const char * folded_path
+	      , unsigned long long budget)
+{
+  int result = 0;
+  profile_t * profile = calloc (1, sizeof(profile_t));
+  dcpu_t * cpu = calloc (1, sizeof(dcpu_t));
+
+  if (NULL == profile || NULL == cpu)
+    {
+      free (profile);
+      free (cpu);
+      return 1;
+    }
+  memcpy (cpu->ram, program, size * sizeof(word));
+  mark_all_dirty (cpu);
+  cpu->sp = RAM_SIZE - 1;
+  cpu->decode_cache = decode_cache_create ();
+
+  profile_run (profile, cpu, budget);
+
+  result = write_report (path, profile_report, profile, cpu->ram);
+  if (0 == result && NULL != folded_path)
+    {
+      result = write_report (folded_path, profile_write_folded, profile, cpu->ram);
+    }
+
+  decode_cache_destroy (cpu->decode_cache);
+  free (cpu);
+  free (profile);
+
+  return result;
+}
+
+
+// writes the control flow graph of a program to path, its loops
+// (innermost last) to stderr
+static int
+cfg_main (const word program []
+	  , size_t size
+	  , const char * path)
+{
+  int result = 0;
+  size_t l = 0;
+  FILE * out = NULL;
+  
+  cfg_t * cfg = cfg_build (program, size);
+  if (NULL == cfg)
+    {
+      return 1;
+    }
+  
+  out = 0 == strcmp (path, "-") ? stdout : fopen (path, "w");
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", path);
+      cfg_destroy (cfg);
+      return 1;
+    }
+  
+  result = cfg_write_dot (cfg, program, size, out);
+  if ((stdout != out && 0 != fclose (out)) || (stdout == out && 0 != fflush (out)))
+    {
+      result = 1;
+    }
+  if (0 != result)
+    {
+      fprintf (stderr, "Could not write to %s\n", path);
+    }
+  
+  fprintf (stderr, "%zu blocks, %zu loops\n", cfg->block_count, cfg->loop_count);
+  for (l = 0; l < cfg->loop_count; ++l)
+    {
+      const cfg_loop_t * loop = &cfg->loops[l];
+      
+      fprintf (stderr
+	       , "loop 0x%04X depth %u: %zu blocks, %zu instructions\n"
+	       , cfg->blocks[loop->header].start
+	       , loop->depth
+	       , loop->blocks
+	       , loop->instructions);
+    }
+  
+  cfg_destroy (cfg);
+  
+  return result;
+}
+
+
+// runs the debugger commands of path ("-" for stdin) on a program,
+// failing once they executed budget instructions
+static int
+script_main (word program []
+	     , size_t size
+	     , const char * path
+	     , unsigned long long budget)
+{
+  int result = 0;
+  FILE * script = 0 == strcmp (path, "-") ? stdin : fopen (path, "r");
+  
+  if (NULL == script)
+    {
+      fprintf (stderr, "Could not open %s\n", path);
+      return 1;
+    }
+  
+  dcpu_t * cpu = calloc (1, sizeof(dcpu_t));
+  if (NULL == cpu)
+    {
+      if (stdin != script)
+	{
+	  fclose (script);
+	}
+      return 1;
+    }
+  
+  result = run_with_debugger (program, size, cpu, script, budget);
+  
+  free (cpu);
+  if (stdin != script)
+    {
+      fclose (script);
+    }
+  
+  return 0 != result;
+}
+
+
+// writes the disassembly of a whole dump (any number of concatenated
+// images) to path ("-" for stdout), on threads threads
+static int
+disassemble_main (const char * image_path
+		  , const char * path
+		  , unsigned int threads)
+{
+  size_t size = 0;
+  int result = 0;
+  FILE * out = NULL;
+
+  word * image = load_dump (image_path, &size);
+  if (NULL == image)
+    {
+      fprintf (stderr, "Could not load dump %s\n", image_path);
+      return 1;
+    }
+
+  out = 0 == strcmp (path, "-") ? stdout : fopen (path, "w");
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", path);
+      free (image);
+      return 1;
+    }
+
+  result = disassemble_to_file_parallel (image, size, out, threads);
+  if (stdout != out && 0 != fclose (out))
+    {
+      result = 1;
+    }
+  if (0 != result)
+    {
+      fprintf (stderr, "Could not write the disassembly to %s\n", path);
+    }
+
+  free (image);
+
+  return result;
+}
+
+
+int main (int argc, char * argv [])
+{
+  static const struct option options [] = {
+    { "batch", required_argument, NULL, 'b' },
+    { "instances", required_argument, NULL, 'n' },
+    { "budget", required_argument, NULL, 'B' },
+    { "threads", required_argument, NULL, 't' },
+    { "seed", required_argument, NULL, 's' },
+    { "engine", required_argument, NULL, 'e' },
+    { "disassemble", required_argument, NULL, 'd' },
+    { "output", required_argument, NULL, 'o' },
+    { "trace-out", required_argument, NULL, 'T' },
+    { "image", required_argument, NULL, 'i' },
+    { "profile", required_argument, NULL, 'P' },
+    { "folded", required_argument, NULL, 'F' },
+    { "cfg", required_argument, NULL, 'G' },
+    { "script", required_argument, NULL, 'S' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  
+  const char * batch_image = NULL;
+  const char * disassemble_image = NULL;
+  const char * output = "-";
+  const char * trace_out = NULL;
+  const char * image_path = NULL;
+  const char * profile_out = NULL;
+  const char * folded_out = NULL;
+  const char * cfg_out = NULL;
+  const char * script_path = NULL;
+  batch_t batch = {
+    .instances = 1,
+    .budget = 1000000,
+    .threads = 0,
+    .engine = BATCH_ENGINE_JIT,
+    .seed = 0
+  };
+  int option = 0;
+  
+  while (-1 != (option = getopt_long (argc, argv, "", options, NULL)))
+    {
+      switch (option)
+	{
+	case 'b':
+	  batch_image = optarg;
+	  break;
+	  
+	case 'd':
+	  disassemble_image = optarg;
+	  break;
+	  
+	case 'o':
+	  output = optarg;
+	  break;
+	  
+	case 'T':
+	  trace_out = optarg;
+	  break;
+	  
+	case 'i':
+	  image_path = optarg;
+	  break;
+	  
+	case 'P':
+	  profile_out = optarg;
+	  break;
+	  
+	case 'F':
+	  folded_out = optarg;
+	  break;
+	  
+	case 'G':
+	  cfg_out = optarg;
+	  break;
+	  
+	case 'S':
+	  script_path = optarg;
+	  break;
+	  
+	case 'n':
+	  batch.instances = (unsigned int) strtoul (optarg, NULL, 0);
+	  break;
+	  
+	case 'B':
+	  batch.budget = strtoull (optarg, NULL, 0);
+	  break;
+	  
+	case 't':
+	  batch.threads = (unsigned int) strtoul (optarg, NULL, 0);
+	  break;
+	  
+	case 's':
+	  batch.seed = (uint32_t) strtoul (optarg, NULL, 0);
+	  break;
+	  
+	case 'e':
+	  if (0 == strcmp (optarg, "threaded"))
+	    {
+	      batch.engine = BATCH_ENGINE_THREADED;
+	    }
+	  else if (0 == strcmp (optarg, "jit"))
+	    {
+	      batch.engine = BATCH_ENGINE_JIT;
+	    }
+	  else if (0 == strcmp (optarg, "lockstep"))
+	    {
+	      batch.engine = BATCH_ENGINE_LOCKSTEP;
+	    }
+	  else
+	    {
+	      usage (argv[0]);
+	      return 1;
+	    }
+	  break;
+	  
+	default:
+	  usage (argv[0]);
+	  return 'h' == option ? 0 : 1;
+	}
+    }
+  
+  if (NULL != disassemble_image)
+    {
+      return disassemble_main (disassemble_image, output, batch.threads);
+    }
+  
+  if (NULL != batch_image)
+    {
+      return batch_main (batch_image, &batch);
+    }
+  
+  word program [] = {
+    0x7c01, 0x0030, 0x7de1, 0x1000, 0x0020, 0x7803, 0x1000, 0xc00d,
+    0x7dc1, 0x001a, 0xa861, 0x7c01, 0x2000, 0x2161, 0x2000, 0x8463,
+    0x806d, 0x7dc1, 0x000d, 0x9031, 0x7c10, 0x0018, 0x7dc1, 0x001a,
+    0x9037, 0x61c1, 0x7dc1, 0x001a, 0x0000, 0x0000, 0x0000, 0x0000
+  };
+  
+  if (NULL != trace_out
+      || NULL != profile_out
+      || NULL != cfg_out
+      || NULL != script_path)
+    {
+      size_t size = sizeof(program) / sizeof(program[0]);
+      int result = 0;
+      word * image = NULL;
+      
+      if (NULL != image_path)
+	{
+	  image = load_image (image_path, &size);
+	  if (NULL == image)
+	    {
+	      fprintf (stderr, "Could not load image %s\n", image_path);
+	      return 1;
+	    }
+	}
+      
+      if (NULL != trace_out)
+	{
+	  result = record_main (NULL != image ? image : program
+				, size
+				, trace_out
+				, batch.budget);
+	}
+      else if (NULL != profile_out)
+	{
+	  result = profile_main (NULL != image ? image : program
+				 , size
+				 , profile_out
+				 , folded_out
+				 , batch.budget);
+	}
+      else if (NULL != cfg_out)
+	{
+	  result = cfg_main (NULL != image ? image : program, size, cfg_out);
+	}
+      else
+	{
+	  result = script_main (NULL != image ? image : program
+				, size
+				, script_path
+				, batch.budget);
+	}
+      free (image);
+      
+      return result;
+    }
+  
+  disassemble (program, sizeof(program) / sizeof(program[0]));
+  
+  dcpu_t cpu = {0};
+  run_with_debugger (program
+		     , sizeof(program) / sizeof(program[0])
+		     , &cpu
+		     , NULL
+		     , 0);
+  
+  return 0;
+}
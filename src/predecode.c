@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "predecode.h"
+#include "trace.h"
+
+// code of the placeholder operands of the non basic instructions,
+// which execute_instruction does not decode
+#define OPERAND_NO_CODE 0xff
+
+
+decode_cache_t *
+decode_cache_create (void)
+{
+  // calloc'ed: every entry has a 0 length, i.e. is not decoded
+  return calloc (1, sizeof(decode_cache_t));
+}
+
+
+void
+decode_cache_destroy (decode_cache_t * cache)
+{
+  free (cache);
+}
+
+
+void
+decode_cache_flush (decode_cache_t * cache)
+{
+  assert (NULL != cache);
+  memset (cache, 0, sizeof(*cache));
+}
+
+
+// mirrors decode_value, but only keeps what depends on the cpu state
+// for execution time
+static predecoded_operand_t
+predecode_operand (const dcpu_t * cpu, word value, word * pc)
+{
+  predecoded_operand_t operand = {
+    .kind = OPERAND_STATIC,
+    .type = UNKNOWN_VALUE,
+    .reg = 0,
+    .code = value,
+    .value = 0
+  };
+
+  if (value <= 0x07)
+    {
+      operand.type = DCPU_REFERENCE;
+      operand.value = (word) (offsetof (dcpu_t, registers)
+			      + value * sizeof(cpu->registers[0]));
+    }
+  else if (value <= 0x0f)
+    {
+      operand.kind = OPERAND_REGISTER_REFERENCE;
+      operand.type = MEMORY_REFERENCE;
+      operand.reg = value - 0x08;
+    }
+  else if (value <= 0x17)
+    {
+      operand.kind = OPERAND_REGISTER_OFFSET_REFERENCE;
+      operand.type = MEMORY_REFERENCE;
+      operand.reg = value - 0x10;
+      operand.value = cpu->ram[(*pc)++];
+    }
+  else if (value == 0x18)
+    {
+      operand.kind = OPERAND_POP;
+      operand.type = MEMORY_REFERENCE;
+    }
+  else if (value == 0x19)
+    {
+      operand.kind = OPERAND_PEEK;
+      operand.type = MEMORY_REFERENCE;
+    }
+  else if (value == 0x1a)
+    {
+      operand.kind = OPERAND_PUSH;
+      operand.type = MEMORY_REFERENCE;
+    }
+  else if (value == 0x1b)
+    {
+      operand.type = DCPU_REFERENCE;
+      operand.value = (word) offsetof (dcpu_t, sp);
+    }
+  else if (value == 0x1c)
+    {
+      operand.type = DCPU_REFERENCE;
+      operand.value = (word) offsetof (dcpu_t, pc);
+    }
+  else if (value == 0x1d)
+    {
+      operand.type = DCPU_REFERENCE;
+      operand.value = (word) offsetof (dcpu_t, o);
+    }
+  else if (value == 0x1e)
+    {
+      operand.type = MEMORY_REFERENCE;
+      operand.value = cpu->ram[(*pc)++];
+    }
+  else if (value == 0x1f)
+    {
+      operand.type = PLAIN_VALUE;
+      operand.value = cpu->ram[(*pc)++];
+    }
+  else
+    {
+      operand.type = PLAIN_VALUE;
+      operand.value = value - 0x20;
+    }
+
+  return operand;
+}
+
+
+static void
+predecode (const dcpu_t * cpu, word address, predecoded_t * entry)
+{
+  word pc = address;
+  word value = cpu->ram[pc++];
+  unsigned char opcode = extract_opcode (value);
+
+  if (0 == opcode)
+    {
+      // handled as a special case
+      if (0x01 == extract_a (value))
+	{
+	  entry->apply = apply_jsr;
+	  entry->a = predecode_operand (cpu, extract_b (value), &pc);
+	}
+      else
+	{
+	  // unknown: as execute_instruction, only consumes the instruction word
+	  entry->apply = apply_nop;
+	  entry->a = predecode_operand (cpu, 0x20, &pc);
+	  entry->a.code = OPERAND_NO_CODE;
+	}
+      entry->b = predecode_operand (cpu, 0x20, &pc);
+      entry->b.code = OPERAND_NO_CODE;
+    }
+  else
+    {
+      entry->apply = opcodes[opcode].apply;
+      entry->a = predecode_operand (cpu, extract_a (value), &pc);
+      entry->b = predecode_operand (cpu, extract_b (value), &pc);
+    }
+
+  entry->length = (word) (pc - address);
+  assert (entry->length > 0 && entry->length <= DECODE_CACHE_MAX_SPAN);
+}
+
+
+// @return true if value is an instruction with a literal as operand b
+// (a for the non basic ones), which is then stored in target
+static bool
+literal_operand (const dcpu_t * cpu, word address, word * target)
+{
+  word value = cpu->ram[address];
+  unsigned char b = extract_b (value);
+
+  if (0x1f == b)
+    {
+      // the literal follows operand a, if any
+      *target = cpu->ram[(word) (address + 1 + (0 != extract_opcode (value)
+						 ? operand_length (extract_a (value))
+						 : 0))];
+      return true;
+    }
+  if (b >= 0x20)
+    {
+      *target = b - 0x20;
+      return true;
+    }
+
+  return false;
+}
+
+// recognises the sequences of fusion_t starting with the entry
+static void
+fuse (const dcpu_t * cpu, word address, predecoded_t * entry)
+{
+  word value = cpu->ram[address];
+  word next_address = address + entry->length;
+  word next = cpu->ram[next_address];
+  unsigned char opcode = extract_opcode (value);
+
+  entry->fusion = FUSION_NONE;
+  entry->next_length = 0;
+  entry->target = 0;
+  entry->span = entry->length;
+
+  if (DCPU_TRACE_LEVEL >= TRACE_LEVEL_DECODE)
+    {
+      // a superinstruction does not resolve the operands of its second
+      // instruction, they would be missing from the trace
+      return;
+    }
+
+  if (OPCODE_SET == opcode && 0x1c == extract_a (value) && 0x18 == extract_b (value))
+    {
+      entry->fusion = FUSION_RETURN;
+    }
+  else if (opcode >= OPCODE_IFE
+	   && OPCODE_SET == extract_opcode (next)
+	   && 0x1c == extract_a (next))
+    {
+      if (0x18 == extract_b (next))
+	{
+	  entry->fusion = FUSION_RETURN_IF;
+	}
+      else if (literal_operand (cpu, next_address, &entry->target))
+	{
+	  entry->fusion = FUSION_BRANCH;
+	}
+    }
+  else if (OPCODE_SET == opcode
+	   && 0x1a == extract_a (value)
+	   && 0 == extract_opcode (next)
+	   && 0x01 == extract_a (next)
+	   && literal_operand (cpu, next_address, &entry->target))
+    {
+      entry->fusion = FUSION_CALL;
+    }
+
+  if (FUSION_NONE != entry->fusion && FUSION_RETURN != entry->fusion)
+    {
+      entry->next_length = instruction_length (next);
+    }
+  entry->span = entry->length + entry->next_length;
+}
+
+
+const predecoded_t *
+decode_cache_lookup (dcpu_t * cpu, word address)
+{
+  predecoded_t * entry = &cpu->decode_cache->entries[address];
+
+  if (0 == entry->length)
+    {
+      predecode (cpu, address, entry);
+      fuse (cpu, address, entry);
+    }
+
+  return entry;
+}
+
+
+static inline TaggedValue
+resolve_operand (dcpu_t * cpu, const predecoded_operand_t * operand)
+{
+  TaggedValue tvalue = {.type = operand->type, .value = operand->value};
+
+  switch (operand->kind)
+    {
+    case OPERAND_STATIC:
+      break;
+
+    case OPERAND_REGISTER_REFERENCE:
+      tvalue.value = cpu->registers[operand->reg];
+      break;
+
+    case OPERAND_REGISTER_OFFSET_REFERENCE:
+      tvalue.value = cpu->registers[operand->reg] + operand->value;
+      break;
+
+    case OPERAND_POP:
+      tvalue.value = cpu->sp++;
+      break;
+
+    case OPERAND_PEEK:
+      tvalue.value = cpu->sp;
+      break;
+
+    case OPERAND_PUSH:
+      tvalue.value = --cpu->sp;
+      break;
+    }
+
+  if (OPERAND_NO_CODE != operand->code)
+    {
+      TRACE_DECODE (cpu, operand->code, tvalue);
+    }
+
+  return tvalue;
+}
+
+
+static inline void
+execute_entry (dcpu_t * cpu, const predecoded_t * entry)
+{
+  // as if every word of the instruction had been consumed
+  cpu->pc += entry->length;
+
+  // we want to preserve the eval order, value 'a' then 'b'
+  TaggedValue tvalue_a = resolve_operand (cpu, &entry->a);
+  TaggedValue tvalue_b = resolve_operand (cpu, &entry->b);
+
+  if (entry->apply (cpu, tvalue_a, tvalue_b))
+    {
+      // skip next instruction, without any operand side effect
+      cpu->pc += instruction_length (cpu->ram[cpu->pc]);
+    }
+}
+
+
+void
+execute_cached_instruction (dcpu_t * cpu)
+{
+  if (NULL == cpu->decode_cache)
+    {
+      word next_word (void)
+      {
+	return cpu->ram[cpu->pc++];
+      }
+
+      execute_instruction (cpu
+			   , next_word ()
+			   , next_word
+			   , next_instruction);
+      return;
+    }
+
+  execute_entry (cpu, decode_cache_lookup (cpu, cpu->pc));
+}
+
+
+// the word popped by a fused SET PC, POP, read through
+// value_from_tagged_value as the unfused one for the watchpoints
+static inline word
+pop (dcpu_t * cpu)
+{
+  TaggedValue top = { .type = MEMORY_REFERENCE, .value = cpu->sp++ };
+
+  return value_from_tagged_value (cpu, top);
+}
+
+
+// runs the superinstruction of entry, @return the number of
+// instructions it executed
+static inline unsigned int
+execute_fused (dcpu_t * cpu, const predecoded_t * entry)
+{
+  static const TaggedValue pc = {
+    .type = DCPU_REFERENCE,
+    .value = (word) offsetof (dcpu_t, pc)
+  };
+
+  switch (entry->fusion)
+    {
+    case FUSION_BRANCH:
+    case FUSION_RETURN_IF:
+      {
+	cpu->pc += entry->length;
+
+	TaggedValue tvalue_a = resolve_operand (cpu, &entry->a);
+	TaggedValue tvalue_b = resolve_operand (cpu, &entry->b);
+
+	if (entry->apply (cpu, tvalue_a, tvalue_b))
+	  {
+	    // the SET PC is skipped
+	    cpu->pc += entry->next_length;
+	    return 1;
+	  }
+
+	// through assign_to_tagged_value for the trace and the journal
+	assign_to_tagged_value (cpu
+				, pc
+				, FUSION_BRANCH == entry->fusion
+				? entry->target
+				: pop (cpu));
+	return 2;
+      }
+
+    case FUSION_RETURN:
+      assign_to_tagged_value (cpu, pc, pop (cpu));
+      return 1;
+
+    case FUSION_CALL:
+      execute_entry (cpu, entry);
+
+      // the push overwrote the JSR
+      if (0 == entry->length)
+	{
+	  return 1;
+	}
+
+      cpu->pc += entry->next_length;
+      assign_to_tagged_value (cpu
+			      , (TaggedValue) { .type = MEMORY_REFERENCE, .value = --cpu->sp }
+			      , cpu->pc);
+      cpu->pc = entry->target;
+      return 2;
+
+    default:
+      execute_entry (cpu, entry);
+      return 1;
+    }
+}
+
+
+unsigned long long
+run_cached (dcpu_t * cpu
+	    , unsigned long long budget
+	    , unsigned long long * dispatches)
+{
+  unsigned long long executed = 0;
+  unsigned long long handlers = 0;
+
+  while (executed < budget)
+    {
+      const predecoded_t * entry = decode_cache_lookup (cpu, cpu->pc);
+
+      // a pair would go over the budget
+      if (FUSION_NONE == entry->fusion
+	  || (executed + 1 == budget && 0 != entry->next_length))
+	{
+	  execute_entry (cpu, entry);
+	  ++executed;
+	}
+      else
+	{
+	  executed += execute_fused (cpu, entry);
+	}
+      ++handlers;
+    }
+
+  if (NULL != dispatches)
+    {
+      *dispatches = handlers;
+    }
+
+  return executed;
+}
@@ -0,0 +1,153 @@
+#if ! defined (PREDECODE_H)
+#define PREDECODE_H
+
+#include "dcpu.h"
+
+// an instruction spans at most 3 words (instruction + 2 next words)
+#define DECODE_CACHE_MAX_SPAN 3
+
+// a superinstruction covers two instructions
+#define DECODE_CACHE_FUSED_SPAN (2 * DECODE_CACHE_MAX_SPAN)
+
+typedef enum operand_kind_t
+  {
+    // the tagged value is fully known when the instruction is decoded
+    OPERAND_STATIC,
+    // [register]
+    OPERAND_REGISTER_REFERENCE,
+    // [next word + register]
+    OPERAND_REGISTER_OFFSET_REFERENCE,
+    OPERAND_POP,
+    OPERAND_PEEK,
+    OPERAND_PUSH
+
+  } operand_kind_t;
+
+// common sequences run by run_cached as a single handler
+typedef enum fusion_t
+  {
+    FUSION_NONE,
+    // IFx a, b then SET PC, literal
+    FUSION_BRANCH,
+    // IFx a, b then SET PC, POP
+    FUSION_RETURN_IF,
+    // SET PC, POP alone
+    FUSION_RETURN,
+    // SET PUSH, b then JSR literal
+    FUSION_CALL
+
+  } fusion_t;
+
+typedef struct predecoded_operand_t
+{
+  unsigned char kind;
+  unsigned char type;
+  // register index for register relative operands
+  unsigned char reg;
+  // operand code it was decoded from, for the trace
+  unsigned char code;
+  // static value, or next word for register relative operands
+  word value;
+
+} predecoded_operand_t;
+
+typedef struct predecoded_t
+{
+  OpcodeApply apply;
+
+  predecoded_operand_t a;
+  predecoded_operand_t b;
+
+  // in words, 0 if not decoded yet
+  unsigned char length;
+
+  // for a superinstruction, the length of the second instruction and
+  // its jump target
+  unsigned char fusion;
+  unsigned char next_length;
+  word target;
+
+  // words the entry depends on, length + next_length when fused
+  unsigned char span;
+
+} predecoded_t;
+
+typedef struct decode_cache_t
+{
+  predecoded_t entries [RAM_SIZE];
+
+} decode_cache_t;
+
+
+/**
+ * @return a new empty cache or NULL if it could not be allocated
+ */
+decode_cache_t * decode_cache_create (void);
+
+void decode_cache_destroy (decode_cache_t * cache);
+
+/**
+ * Drops every entry, to be called after the ram has been (re)loaded.
+ */
+void decode_cache_flush (decode_cache_t * cache);
+
+/**
+ * Drops the entries whose instruction spans the given address.
+ */
+static inline void
+decode_cache_invalidate (decode_cache_t * cache, word address)
+{
+  unsigned char i = 0;
+
+  for (i = 0; i < DECODE_CACHE_FUSED_SPAN; ++i)
+    {
+      predecoded_t * entry = &cache->entries[(word) (address - i)];
+      if (entry->span > i)
+	{
+	  entry->length = 0;
+	  entry->span = 0;
+	}
+    }
+}
+
+/**
+ * Drops the entries whose instruction may span [start, start + length).
+ */
+static inline void
+decode_cache_invalidate_range (decode_cache_t * cache, word start, unsigned int length)
+{
+  unsigned int i = 0;
+
+  for (i = 0; i < length + DECODE_CACHE_FUSED_SPAN - 1; ++i)
+    {
+      predecoded_t * entry = &cache->entries[(word) (start - (DECODE_CACHE_FUSED_SPAN - 1) + i)];
+      entry->length = 0;
+      entry->span = 0;
+    }
+}
+
+/**
+ * @return the predecoded instruction at address, decoding it from ram
+ * if needed
+ */
+const predecoded_t * decode_cache_lookup (dcpu_t * cpu, word address);
+
+/**
+ * Executes the instruction at cpu->pc using cpu->decode_cache
+ * (falls back to execute_instruction if there is no cache).
+ */
+void execute_cached_instruction (dcpu_t * cpu);
+
+/**
+ * Runs up to budget instructions with cpu->decode_cache, which must be
+ * set, the sequences of fusion_t being executed by a single handler.
+ *
+ * @param dispatches if not NULL, set to the number of handlers run
+ * @return the number of instructions executed, the instructions skipped
+ * by failed IF tests not counting
+ */
+unsigned long long run_cached (dcpu_t * cpu
+			       , unsigned long long budget
+			       , unsigned long long * dispatches);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "predecode.h"
+#include "disassembler.h"
+
+
+// rows of the per opcode table: opcodes[1..15], JSR and the unknown
+// non basic opcodes
+#define PROFILE_JSR 0
+#define PROFILE_UNKNOWN 16
+#define PROFILE_OPCODES 17
+
+
+unsigned long long
+profile_run (profile_t * profile
+	     , dcpu_t * cpu
+	     , unsigned long long budget)
+{
+  unsigned long long executed = 0;
+
+  for (executed = 0; executed < budget; ++executed)
+    {
+      ++profile->counts[cpu->pc];
+      execute_cached_instruction (cpu);
+    }
+
+  return executed;
+}
+
+
+// the instruction at pc, its words wrapping around the ram
+static void
+fetch (const word ram [], word pc, word words [DECODE_CACHE_MAX_SPAN])
+{
+  unsigned char i = 0;
+
+  for (i = 0; i < DECODE_CACHE_MAX_SPAN; ++i)
+    {
+      words[i] = ram[(word) (pc + i)];
+    }
+}
+
+// @return the row of the per opcode table of an instruction
+static unsigned char
+profile_row (word value)
+{
+  unsigned char opcode = extract_opcode (value);
+
+  if (0 != opcode)
+    {
+      return opcode;
+    }
+
+  return 0x01 == extract_a (value) ? PROFILE_JSR : PROFILE_UNKNOWN;
+}
+
+static unsigned int
+instruction_cycles (word value)
+{
+  unsigned char row = profile_row (value);
+
+  if (PROFILE_UNKNOWN == row)
+    {
+      // not executed, only fetched
+      return 1;
+    }
+
+  return opcodes[row].cycles + instruction_length (value) - 1;
+}
+
+
+typedef struct hot_spot_t
+{
+  unsigned long long count;
+  word pc;
+
+} hot_spot_t;
+
+static int
+compare_hot_spots (const void * a, const void * b)
+{
+  const hot_spot_t * x = a;
+  const hot_spot_t * y = b;
+
+  if (x->count != y->count)
+    {
+      return x->count < y->count ? 1 : -1;
+    }
+
+  return (int) x->pc - (int) y->pc;
+}
+
+
+int
+profile_report (const profile_t * profile
+		, const word ram []
+		, FILE * out)
+{
+  unsigned long long executed [PROFILE_OPCODES] = {0};
+  unsigned long long cycles [PROFILE_OPCODES] = {0};
+  unsigned long long total = 0;
+  unsigned long long total_cycles = 0;
+  hot_spot_t * spots = NULL;
+  size_t count = 0;
+  size_t i = 0;
+
+  spots = malloc (RAM_SIZE * sizeof(hot_spot_t));
+  if (NULL == spots)
+    {
+      return 1;
+    }
+
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      unsigned char row = 0;
+
+      if (0 == profile->counts[i])
+	{
+	  continue;
+	}
+
+      row = profile_row (ram[i]);
+      executed[row] += profile->counts[i];
+      cycles[row] += profile->counts[i] * instruction_cycles (ram[i]);
+
+      spots[count].count = profile->counts[i];
+      spots[count].pc = i;
+      ++count;
+    }
+
+  for (i = 0; i < PROFILE_OPCODES; ++i)
+    {
+      total += executed[i];
+      total_cycles += cycles[i];
+    }
+
+  fprintf (out, "# %llu instructions, %llu cycles\n", total, total_cycles);
+
+  fprintf (out, "# opcode\texecuted\tcycles\tshare\n");
+  for (i = 0; i < PROFILE_OPCODES; ++i)
+    {
+      if (0 == executed[i])
+	{
+	  continue;
+	}
+      fprintf (out
+	       , "%s\t%llu\t%llu\t%.2f%%\n"
+	       , PROFILE_JSR == i ? "JSR" : PROFILE_UNKNOWN == i ? "UNKNOWN" : opcodes[i].name
+	       , executed[i]
+	       , cycles[i]
+	       , 100.0 * cycles[i] / total_cycles);
+    }
+
+  qsort (spots, count, sizeof(hot_spot_t), compare_hot_spots);
+
+  fprintf (out, "# pc\texecuted\tshare\tcycles\tinstruction\n");
+  for (i = 0; i < count; ++i)
+    {
+      word words [DECODE_CACHE_MAX_SPAN];
+      char text [DISASSEMBLED_INSTRUCTION_SIZE];
+
+      fetch (ram, spots[i].pc, words);
+      format_instruction (text, sizeof(text), words, DECODE_CACHE_MAX_SPAN);
+
+      fprintf (out
+	       , "0x%04X\t%llu\t%.2f%%\t%llu\t%s\n"
+	       , spots[i].pc
+	       , spots[i].count
+	       , 100.0 * spots[i].count / total
+	       , spots[i].count * instruction_cycles (words[0])
+	       , text);
+    }
+
+  free (spots);
+
+  return ferror (out);
+}
+
+
+int
+profile_write_folded (const profile_t * profile
+		      , const word ram []
+		      , FILE * out)
+{
+  unsigned char * entries = calloc (RAM_SIZE, 1);
+  word routine = 0;
+  size_t i = 0;
+
+  if (NULL == entries)
+    {
+      return 1;
+    }
+
+  entries[0] = 1;
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      unsigned char b = extract_b (ram[i]);
+
+      if (0 == profile->counts[i]
+	  || 0 != extract_opcode (ram[i])
+	  || 0x01 != extract_a (ram[i]))
+	{
+	  continue;
+	}
+
+      // the targets known without running, JSR A and the like are not
+      if (0x1f == b)
+	{
+	  entries[ram[(word) (i + 1)]] = 1;
+	}
+      else if (b >= 0x20)
+	{
+	  entries[b - 0x20] = 1;
+	}
+    }
+
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      word words [DECODE_CACHE_MAX_SPAN];
+      char text [DISASSEMBLED_INSTRUCTION_SIZE];
+
+      if (entries[i])
+	{
+	  routine = i;
+	}
+      if (0 == profile->counts[i])
+	{
+	  continue;
+	}
+
+      fetch (ram, i, words);
+      format_instruction (text, sizeof(text), words, DECODE_CACHE_MAX_SPAN);
+
+      fprintf (out
+	       , "0x%04X;0x%04zX %s %llu\n"
+	       , routine
+	       , i
+	       , text
+	       , profile->counts[i]);
+    }
+
+  free (entries);
+
+  return ferror (out);
+}
@@ -0,0 +1,52 @@
+#if ! defined (PROFILER_H)
+#define PROFILER_H
+
+#include <stdio.h>
+
+#include "dcpu.h"
+
+// execution counts per ram address, everything else (cycles, opcodes,
+// routines) being derived from them and the ram when reporting
+typedef struct profile_t
+{
+  unsigned long long counts [RAM_SIZE];
+
+} profile_t;
+
+/**
+ * Runs the cpu (with its decode cache if it has one) for up to budget
+ * instructions, counting the executions of each pc.
+ *
+ * @return the number of instructions executed
+ */
+unsigned long long profile_run (profile_t * profile
+				, dcpu_t * cpu
+				, unsigned long long budget);
+
+/**
+ * Writes the executions and cycles per opcode, then the executed
+ * instructions from the hottest down, disassembled from ram.
+ *
+ * The cycles are those of opcodes[] plus the next words, failed IF
+ * tests are not counted. Code that modified itself is reported as it
+ * is in ram at the end of the run.
+ *
+ * @return 0, or non zero if writing failed
+ */
+int profile_report (const profile_t * profile
+		    , const word ram []
+		    , FILE * out);
+
+/**
+ * Writes the executions in the folded stacks format of flame graph
+ * tools: 'routine;instruction count' lines, the routines being the
+ * entry point and the targets of the executed JSR with a constant
+ * operand, each instruction belonging to the closest one before it.
+ *
+ * @return 0, or non zero if writing failed
+ */
+int profile_write_folded (const profile_t * profile
+			  , const word ram []
+			  , FILE * out);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "recorder.h"
+#include "journal.h"
+#include "predecode.h"
+
+
+// bytes, a power of two
+#define RECORDER_RING_SIZE (1 << 22)
+#define RECORDER_RING_MASK (RECORDER_RING_SIZE - 1)
+
+// header, pc delta (17 bits of zigzag), 3 words, address and value
+#define RECORDER_RECORD_MAX 16
+
+// writer thread pause when the ring is empty, in ns
+#define RECORDER_IDLE_SLEEP 200000
+
+struct recorder_t
+{
+  unsigned char * ring;
+  FILE * file;
+  pthread_t writer;
+
+  // total bytes ever put in the ring, published by the executing thread
+  size_t head __attribute__ ((aligned (64)));
+  // last tail it has seen, to only read the shared one when short of room
+  size_t tail_seen;
+  word next_pc;
+
+  // total bytes ever written out, published by the writer thread
+  size_t tail __attribute__ ((aligned (64)));
+  bool failed;
+
+  bool closing;
+};
+
+
+static void *
+write_ring (void * data)
+{
+  recorder_t * recorder = data;
+  size_t tail = 0;
+
+  for (;;)
+    {
+      // read before head, everything is in the ring once it is set
+      bool closing = __atomic_load_n (&recorder->closing, __ATOMIC_ACQUIRE);
+      size_t head = __atomic_load_n (&recorder->head, __ATOMIC_ACQUIRE);
+      size_t offset = tail & RECORDER_RING_MASK;
+      size_t count = head - tail;
+
+      if (0 == count)
+	{
+	  struct timespec pause = { .tv_sec = 0, .tv_nsec = RECORDER_IDLE_SLEEP };
+
+	  if (closing)
+	    {
+	      break;
+	    }
+	  nanosleep (&pause, NULL);
+	  continue;
+	}
+
+      // up to the end of the ring, the rest on the next round
+      if (count > RECORDER_RING_SIZE - offset)
+	{
+	  count = RECORDER_RING_SIZE - offset;
+	}
+
+      // keeps draining after a failure, the executing thread would
+      // wait for room forever otherwise
+      if (! recorder->failed
+	  && 1 != fwrite (recorder->ring + offset, count, 1, recorder->file))
+	{
+	  recorder->failed = true;
+	}
+
+      tail += count;
+      __atomic_store_n (&recorder->tail, tail, __ATOMIC_RELEASE);
+    }
+
+  return NULL;
+}
+
+
+recorder_t *
+recorder_open (const char * path)
+{
+  recorder_t * recorder = calloc (1, sizeof(recorder_t));
+
+  if (NULL == recorder)
+    {
+      return NULL;
+    }
+
+  recorder->ring = malloc (RECORDER_RING_SIZE);
+  recorder->file = fopen (path, "wb");
+  if (NULL == recorder->ring
+      || NULL == recorder->file
+      || 1 != fwrite (RECORDER_MAGIC, strlen (RECORDER_MAGIC), 1, recorder->file)
+      || 0 != pthread_create (&recorder->writer, NULL, write_ring, recorder))
+    {
+      if (NULL != recorder->file)
+	{
+	  fclose (recorder->file);
+	}
+      free (recorder->ring);
+      free (recorder);
+      return NULL;
+    }
+
+  return recorder;
+}
+
+
+static inline void
+put_record (recorder_t * recorder
+	    , word pc
+	    , const word words []
+	    , unsigned char length
+	    , TaggedValueType type
+	    , word location
+	    , word value)
+{
+  unsigned char record [RECORDER_RECORD_MAX];
+  unsigned char * p = record + 1;
+  unsigned char header = length;
+  size_t head = recorder->head;
+  size_t count = 0;
+  size_t i = 0;
+
+  if (__builtin_expect (pc != recorder->next_pc, 0))
+    {
+      // jumps and skips, the difference wraps around the ram
+      int32_t delta = (int16_t) (word) (pc - recorder->next_pc);
+      uint32_t zigzag = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+
+      header |= 1 << 2;
+      while (zigzag >= 0x80)
+	{
+	  *p++ = (zigzag & 0x7f) | 0x80;
+	  zigzag >>= 7;
+	}
+      *p++ = zigzag;
+    }
+
+  for (i = 0; i < length; ++i)
+    {
+      *p++ = words[i] & 0xff;
+      *p++ = words[i] >> 8;
+    }
+
+  if (MEMORY_REFERENCE == type)
+    {
+      header |= RECORDED_WRITE_RAM << 3;
+      *p++ = location & 0xff;
+      *p++ = location >> 8;
+    }
+  else if (DCPU_REFERENCE == type)
+    {
+      header |= RECORDED_WRITE_DCPU << 3;
+      *p++ = (unsigned char) location;
+    }
+  if (UNKNOWN_VALUE != type)
+    {
+      *p++ = value & 0xff;
+      *p++ = value >> 8;
+    }
+
+  record[0] = header;
+  count = p - record;
+  recorder->next_pc = pc + length;
+
+  while (head + count - recorder->tail_seen > RECORDER_RING_SIZE)
+    {
+      recorder->tail_seen = __atomic_load_n (&recorder->tail, __ATOMIC_ACQUIRE);
+      if (head + count - recorder->tail_seen > RECORDER_RING_SIZE)
+	{
+	  sched_yield ();
+	}
+    }
+
+  for (i = 0; i < count; ++i)
+    {
+      recorder->ring[(head + i) & RECORDER_RING_MASK] = record[i];
+    }
+
+  __atomic_store_n (&recorder->head, head + count, __ATOMIC_RELEASE);
+}
+
+
+unsigned long long
+recorder_run (recorder_t * recorder
+	      , dcpu_t * cpu
+	      , unsigned long long budget)
+{
+  // only the write of the last instruction is needed
+  journal_t * journal = journal_create (1);
+  unsigned long long executed = 0;
+
+  if (NULL == journal)
+    {
+      return 0;
+    }
+  cpu->journal = journal;
+
+  for (executed = 0; executed < budget; ++executed)
+    {
+      word pc = cpu->pc;
+      unsigned char length = instruction_length (cpu->ram[pc]);
+      word words [DECODE_CACHE_MAX_SPAN];
+      TaggedValueType type = UNKNOWN_VALUE;
+      word location = 0;
+      word value = 0;
+      unsigned char i = 0;
+
+      // before it runs, it may overwrite itself
+      for (i = 0; i < length; ++i)
+	{
+	  words[i] = cpu->ram[(word) (pc + i)];
+	}
+
+      journal_begin (journal, cpu);
+      execute_cached_instruction (cpu);
+
+      if (journal_last_write (journal, &type, &location))
+	{
+	  value = MEMORY_REFERENCE == type
+	    ? cpu->ram[location]
+	    : *((const word *) ((const char *) cpu + location));
+	}
+
+      put_record (recorder, pc, words, length, type, location, value);
+    }
+
+  cpu->journal = NULL;
+  journal_destroy (journal);
+
+  return executed;
+}
+
+
+int
+recorder_close (recorder_t * recorder)
+{
+  int result = 0;
+
+  __atomic_store_n (&recorder->closing, true, __ATOMIC_RELEASE);
+  pthread_join (recorder->writer, NULL);
+
+  result = recorder->failed;
+  if (0 != fclose (recorder->file))
+    {
+      result = 1;
+    }
+
+  free (recorder->ring);
+  free (recorder);
+
+  return result;
+}
+
+
+// @return the next byte, setting truncated at the end of the file
+static inline unsigned char
+read_byte (FILE * file, bool * truncated)
+{
+  int c = getc_unlocked (file);
+
+  if (EOF == c)
+    {
+      *truncated = true;
+      return 0;
+    }
+
+  return (unsigned char) c;
+}
+
+static inline word
+read_word (FILE * file, bool * truncated)
+{
+  word low = read_byte (file, truncated);
+
+  return low | (read_byte (file, truncated) << 8);
+}
+
+
+int
+recorder_replay (const char * path
+		 , RecordedInstructionFunc func
+		 , void * data)
+{
+  FILE * file = fopen (path, "rb");
+  char magic [sizeof(RECORDER_MAGIC) - 1];
+  word next_pc = 0;
+  bool truncated = false;
+  int c = 0;
+
+  if (NULL == file)
+    {
+      return 1;
+    }
+
+  if (1 != fread (magic, sizeof(magic), 1, file)
+      || 0 != memcmp (magic, RECORDER_MAGIC, sizeof(magic)))
+    {
+      fclose (file);
+      return 1;
+    }
+
+  while (! truncated && EOF != (c = getc_unlocked (file)))
+    {
+      recorded_instruction_t instruction;
+      unsigned char header = (unsigned char) c;
+      unsigned char write = (header >> 3) & 0x3;
+      unsigned char i = 0;
+
+      instruction.length = header & 0x3;
+      if (0 == instruction.length || RECORDED_WRITE_DCPU < write)
+	{
+	  // not written by put_record
+	  truncated = true;
+	  break;
+	}
+
+      instruction.pc = next_pc;
+      if (0 != (header & (1 << 2)))
+	{
+	  uint32_t zigzag = 0;
+	  unsigned int shift = 0;
+	  unsigned char byte = 0;
+
+	  do
+	    {
+	      byte = read_byte (file, &truncated);
+	      zigzag |= (uint32_t) (byte & 0x7f) << shift;
+	      shift += 7;
+	    }
+	  while (0 != (byte & 0x80) && shift < 32);
+
+	  instruction.pc += (word) ((zigzag >> 1) ^ -(zigzag & 1));
+	}
+
+      for (i = 0; i < instruction.length; ++i)
+	{
+	  instruction.words[i] = read_word (file, &truncated);
+	}
+
+      instruction.type = UNKNOWN_VALUE;
+      instruction.location = 0;
+      instruction.value = 0;
+      if (RECORDED_WRITE_RAM == write)
+	{
+	  instruction.type = MEMORY_REFERENCE;
+	  instruction.location = read_word (file, &truncated);
+	}
+      else if (RECORDED_WRITE_DCPU == write)
+	{
+	  instruction.type = DCPU_REFERENCE;
+	  instruction.location = read_byte (file, &truncated);
+	}
+      if (RECORDED_WRITE_NONE != write)
+	{
+	  instruction.value = read_word (file, &truncated);
+	}
+
+      next_pc = instruction.pc + instruction.length;
+
+      if (! truncated)
+	{
+	  func (&instruction, data);
+	}
+    }
+
+  fclose (file);
+
+  return truncated;
+}
@@ -0,0 +1,86 @@
+#if ! defined (RECORDER_H)
+#define RECORDER_H
+
+#include "dcpu.h"
+
+// execution recordings: every executed instruction with its words and
+// what it wrote, in a compact binary file. The records are encoded by
+// the executing thread into a lock free ring, a background thread
+// writing the ring to the file.
+//
+// File format: the RECORDER_MAGIC bytes, then per instruction a header
+// byte, an optional pc delta, the words of the instruction and the
+// optional write:
+//   header bits 0-1  number of words (1 to 3)
+//          bit 2     the pc is not the one following the previous
+//                    instruction: a zigzag LEB128 varint follows, the
+//                    difference to that pc
+//          bits 3-4  RECORDED_WRITE_*
+//   words            little endian
+//   write            RECORDED_WRITE_RAM: the address (little endian
+//                    word), RECORDED_WRITE_DCPU: the dcpu_t offset
+//                    (a byte), then the new value (little endian word)
+#define RECORDER_MAGIC "DCPUREC1"
+
+#define RECORDED_WRITE_NONE 0
+#define RECORDED_WRITE_RAM 1
+#define RECORDED_WRITE_DCPU 2
+
+typedef struct recorder_t recorder_t;
+
+typedef struct recorded_instruction_t
+{
+  word pc;
+
+  unsigned char length;
+  word words [3];
+
+  // UNKNOWN_VALUE if it wrote nothing but pc, sp or o, otherwise
+  // MEMORY_REFERENCE (location is a ram address) or DCPU_REFERENCE
+  // (location is a dcpu_t offset)
+  TaggedValueType type;
+  word location;
+  word value;
+
+} recorded_instruction_t;
+
+typedef void (* RecordedInstructionFunc) (const recorded_instruction_t * instruction
+					  , void * data);
+
+/**
+ * Creates the recording file and starts its writer thread.
+ *
+ * @return the recorder, NULL if the file could not be created
+ */
+recorder_t * recorder_open (const char * path);
+
+/**
+ * Runs the cpu (with its decode cache if it has one) for up to budget
+ * instructions, recording each of them. The cpu must not have a
+ * journal, one is attached for the run.
+ *
+ * @return the number of instructions executed
+ */
+unsigned long long recorder_run (recorder_t * recorder
+				 , dcpu_t * cpu
+				 , unsigned long long budget);
+
+/**
+ * Writes the remaining records, stops the writer thread and releases
+ * the recorder.
+ *
+ * @return 0, or non zero if writing failed
+ */
+int recorder_close (recorder_t * recorder);
+
+/**
+ * Reads a recording back, calling func for each instruction in order.
+ *
+ * @return 0, or non zero if the file could not be read, is not a
+ * recording or is truncated
+ */
+int recorder_replay (const char * path
+		     , RecordedInstructionFunc func
+		     , void * data);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <getopt.h>
+
+#include "dcpu.h"
+#include "disassembler.h"
+#include "recorder.h"
+
+
+static void
+usage (const char * name)
+{
+  fprintf (stderr, "usage: %s RECORDING [--output FILE]\n", name);
+}
+
+
+// name of the dcpu_t word at offset
+static const char *
+location_name (word offset)
+{
+  static const char * const register_names [REGISTER_COUNT] = {
+    "A", "B", "C", "X", "Y", "Z", "I", "J"
+  };
+
+  if (offsetof (dcpu_t, pc) == offset)
+    {
+      return "PC";
+    }
+  if (offsetof (dcpu_t, sp) == offset)
+    {
+      return "SP";
+    }
+  if (offsetof (dcpu_t, o) == offset)
+    {
+      return "O";
+    }
+  if (offset >= offsetof (dcpu_t, registers)
+      && offset < offsetof (dcpu_t, registers) + sizeof(((dcpu_t *) NULL)->registers))
+    {
+      return register_names[(offset - offsetof (dcpu_t, registers)) / sizeof(word)];
+    }
+
+  return "?";
+}
+
+// one line per instruction, the text of the disassembler followed by
+// what it wrote
+static void
+print_instruction (const recorded_instruction_t * instruction, void * data)
+{
+  FILE * out = data;
+  char text [DISASSEMBLED_INSTRUCTION_SIZE];
+
+  format_instruction (text, sizeof(text), instruction->words, instruction->length);
+
+  switch (instruction->type)
+    {
+    case MEMORY_REFERENCE:
+      fprintf (out
+	       , "0x%04X: %s ; [0x%04X] = 0x%04X\n"
+	       , instruction->pc
+	       , text
+	       , instruction->location
+	       , instruction->value);
+      break;
+
+    case DCPU_REFERENCE:
+      fprintf (out
+	       , "0x%04X: %s ; %s = 0x%04X\n"
+	       , instruction->pc
+	       , text
+	       , location_name (instruction->location)
+	       , instruction->value);
+      break;
+
+    default:
+      fprintf (out, "0x%04X: %s\n", instruction->pc, text);
+      break;
+    }
+}
+
+
+int main (int argc, char * argv [])
+{
+  static const struct option options [] = {
+    { "output", required_argument, NULL, 'o' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  const char * output = "-";
+  FILE * out = NULL;
+  int result = 0;
+  int option = 0;
+
+  while (-1 != (option = getopt_long (argc, argv, "o:", options, NULL)))
+    {
+      switch (option)
+	{
+	case 'o':
+	  output = optarg;
+	  break;
+
+	default:
+	  usage (argv[0]);
+	  return 'h' == option ? 0 : 1;
+	}
+    }
+
+  if (optind + 1 != argc)
+    {
+      usage (argv[0]);
+      return 1;
+    }
+
+  out = 0 == strcmp (output, "-") ? stdout : fopen (output, "w");
+  if (NULL == out)
+    {
+      fprintf (stderr, "Could not open %s\n", output);
+      return 1;
+    }
+
+  if (0 != recorder_replay (argv[optind], print_instruction, out))
+    {
+      fprintf (stderr, "Could not read the recording %s\n", argv[optind]);
+      result = 1;
+    }
+
+  if ((stdout != out && 0 != fclose (out)) || (stdout == out && 0 != fflush (out)))
+    {
+      fprintf (stderr, "Could not write to %s\n", output);
+      result = 1;
+    }
+
+  return result;
+}
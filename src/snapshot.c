@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "predecode.h"
+
+
+typedef struct page_t
+{
+  unsigned int references;
+  word words [DCPU_PAGE_SIZE];
+
+} page_t;
+
+struct dcpu_snapshot_t
+{
+  // one for the caller of dcpu_snapshot, one per cpu tracked against it
+  unsigned int references;
+
+  word pc;
+  word sp;
+  word o;
+  word registers [REGISTER_COUNT];
+
+  page_t * pages [DCPU_PAGE_COUNT];
+};
+
+
+// plain counters, a whole snapshot costs one per page
+#define ACQUIRE(object) (++(object)->references)
+#define RELEASE(object) (0 == --(object)->references)
+
+#define IS_DIRTY(cpu, page) (0 != (cpu)->dirty[(page)])
+
+
+static void
+release_snapshot (dcpu_snapshot_t * snapshot)
+{
+  unsigned int page = 0;
+
+  if (NULL == snapshot || ! RELEASE (snapshot))
+    {
+      return;
+    }
+
+  for (page = 0; page < DCPU_PAGE_COUNT; ++page)
+    {
+      if (NULL != snapshot->pages[page] && RELEASE (snapshot->pages[page]))
+	{
+	  free (snapshot->pages[page]);
+	}
+    }
+
+  free (snapshot);
+}
+
+
+dcpu_snapshot_t *
+dcpu_snapshot (dcpu_t * cpu)
+{
+  dcpu_snapshot_t * parent = cpu->snapshot;
+  unsigned int page = 0;
+
+  dcpu_snapshot_t * snapshot = calloc (1, sizeof(dcpu_snapshot_t));
+  if (NULL == snapshot)
+    {
+      return NULL;
+    }
+
+  snapshot->references = 1;
+
+  for (page = 0; page < DCPU_PAGE_COUNT; ++page)
+    {
+      if (NULL != parent && ! IS_DIRTY (cpu, page))
+	{
+	  snapshot->pages[page] = parent->pages[page];
+	  ACQUIRE (snapshot->pages[page]);
+	  continue;
+	}
+
+      snapshot->pages[page] = malloc (sizeof(page_t));
+      if (NULL == snapshot->pages[page])
+	{
+	  release_snapshot (snapshot);
+	  return NULL;
+	}
+
+      snapshot->pages[page]->references = 1;
+      memcpy (snapshot->pages[page]->words
+	      , &cpu->ram[page * DCPU_PAGE_SIZE]
+	      , sizeof(snapshot->pages[page]->words));
+    }
+
+  snapshot->pc = cpu->pc;
+  snapshot->sp = cpu->sp;
+  snapshot->o = cpu->o;
+  memcpy (snapshot->registers, cpu->registers, sizeof(snapshot->registers));
+
+  // the cpu is now tracked against the new snapshot
+  ACQUIRE (snapshot);
+  cpu->snapshot = snapshot;
+  release_snapshot (parent);
+  memset (cpu->dirty, 0, sizeof(cpu->dirty));
+
+  return snapshot;
+}
+
+
+void
+dcpu_restore (dcpu_t * cpu, dcpu_snapshot_t * snapshot)
+{
+  dcpu_snapshot_t * current = cpu->snapshot;
+  unsigned int page = 0;
+
+  for (page = 0; page < DCPU_PAGE_COUNT; ++page)
+    {
+      // a page shared by both snapshots and not written since is
+      // already there
+      if (NULL != current
+	  && ! IS_DIRTY (cpu, page)
+	  && current->pages[page] == snapshot->pages[page])
+	{
+	  continue;
+	}
+
+      memcpy (&cpu->ram[page * DCPU_PAGE_SIZE]
+	      , snapshot->pages[page]->words
+	      , sizeof(snapshot->pages[page]->words));
+
+      if (NULL != cpu->decode_cache)
+	{
+	  decode_cache_invalidate_range (cpu->decode_cache
+					 , page * DCPU_PAGE_SIZE
+					 , DCPU_PAGE_SIZE);
+	}
+    }
+
+  cpu->pc = snapshot->pc;
+  cpu->sp = snapshot->sp;
+  cpu->o = snapshot->o;
+  memcpy (cpu->registers, snapshot->registers, sizeof(cpu->registers));
+
+  if (current != snapshot)
+    {
+      ACQUIRE (snapshot);
+      cpu->snapshot = snapshot;
+      release_snapshot (current);
+    }
+  memset (cpu->dirty, 0, sizeof(cpu->dirty));
+}
+
+
+void
+dcpu_snapshot_free (dcpu_snapshot_t * snapshot)
+{
+  release_snapshot (snapshot);
+}
+
+
+void
+dcpu_snapshot_detach (dcpu_t * cpu)
+{
+  release_snapshot (cpu->snapshot);
+  cpu->snapshot = NULL;
+}
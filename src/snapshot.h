@@ -0,0 +1,38 @@
+#if ! defined (SNAPSHOT_H)
+#define SNAPSHOT_H
+
+#include "dcpu.h"
+
+// copy on write snapshots of a cpu: the ram is kept in reference
+// counted pages, a snapshot sharing the pages that have not been
+// written with the snapshot the cpu was last taken from or restored to.
+// Snapshots sharing pages must not be used from several threads at once.
+typedef struct dcpu_snapshot_t dcpu_snapshot_t;
+
+/**
+ * Captures the state of the cpu, only copying the pages written since
+ * the last snapshot taken or restored on this cpu.
+ *
+ * @return the snapshot, to be released with dcpu_snapshot_free, or
+ * NULL if it could not be allocated
+ */
+dcpu_snapshot_t * dcpu_snapshot (dcpu_t * cpu);
+
+/**
+ * Brings the cpu back to the state of a snapshot, only copying the
+ * pages that differ from the current ram.
+ */
+void dcpu_restore (dcpu_t * cpu, dcpu_snapshot_t * snapshot);
+
+/**
+ * Releases a snapshot returned by dcpu_snapshot.
+ */
+void dcpu_snapshot_free (dcpu_snapshot_t * snapshot);
+
+/**
+ * Releases the snapshot the cpu is tracked against, to be called
+ * before a cpu that has been snapshotted is discarded.
+ */
+void dcpu_snapshot_detach (dcpu_t * cpu);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "predecode.h"
+#include "snapshot.h"
+#include "threaded.h"
+#include "jit/jit.h"
+
+// checks that restoring a snapshot gives back the ram and registers
+// it was taken from, whatever engine wrote to the ram in between
+
+#define CHECK_SEEDS 64
+#define CHECK_BUDGET 20000
+
+typedef enum engine_t
+  {
+    ENGINE_REFERENCE,
+    ENGINE_CACHED,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    ENGINE_COUNT
+
+  } engine_t;
+
+static const char * const engine_names [ENGINE_COUNT] = {
+  "reference", "cached", "threaded", "jit"
+};
+
+
+static uint32_t
+next_random (uint32_t * state)
+{
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+// random code, biased towards instructions writing to ram through
+// registers and the stack
+static void
+load_random (dcpu_t * cpu, uint32_t seed)
+{
+  uint32_t state = seed * 2654435761u + 1;
+  unsigned int i = 0;
+
+  memset (cpu, 0, sizeof(*cpu));
+  for (i = 0; i < RAM_SIZE; ++i)
+    {
+      word value = (word) next_random (&state);
+
+      if (0 == (next_random (&state) & 1))
+	{
+	  // a: [register], [next word + register] or PUSH
+	  static const unsigned char targets [] = { 0x08, 0x0b, 0x10, 0x16, 0x1a };
+	  unsigned char a = targets[next_random (&state) % sizeof(targets)];
+
+	  value = (value & DCPU_INST_B_MASK) | (a << 4) | OPCODE_SET;
+	}
+      cpu->ram[i] = value;
+    }
+  for (i = 0; i < REGISTER_COUNT; ++i)
+    {
+      cpu->registers[i] = (word) next_random (&state);
+    }
+  cpu->sp = RAM_SIZE - 1;
+  mark_all_dirty (cpu);
+}
+
+
+static void
+run (engine_t engine, dcpu_t * cpu, jit_t * jit, unsigned long long budget)
+{
+  unsigned long long i = 0;
+
+  switch (engine)
+    {
+    case ENGINE_REFERENCE:
+    case ENGINE_CACHED:
+      for (i = 0; i < budget; ++i)
+	{
+	  execute_cached_instruction (cpu);
+	}
+      break;
+
+    case ENGINE_THREADED:
+      run_threaded (cpu, budget);
+      break;
+
+    default:
+      run_jit (jit, cpu, budget);
+      break;
+    }
+}
+
+
+static bool
+same_state (const dcpu_t * cpu, const dcpu_t * expected)
+{
+  return cpu->pc == expected->pc
+    && cpu->sp == expected->sp
+    && cpu->o == expected->o
+    && 0 == memcmp (cpu->registers, expected->registers, sizeof(cpu->registers))
+    && 0 == memcmp (cpu->ram, expected->ram, sizeof(cpu->ram));
+}
+
+
+// takes two snapshots while running, then restores them in turn,
+// running between the restores: @return the number of mismatches
+static unsigned int
+check (engine_t engine, uint32_t seed, jit_t * jit, dcpu_t * cpu, dcpu_t expected [2])
+{
+  dcpu_snapshot_t * snapshots [2] = { NULL, NULL };
+  unsigned int mismatches = 0;
+  unsigned int i = 0;
+
+  load_random (cpu, seed);
+  if (ENGINE_CACHED == engine)
+    {
+      cpu->decode_cache = decode_cache_create ();
+    }
+
+  for (i = 0; i < 2; ++i)
+    {
+      memcpy (&expected[i], cpu, sizeof(*cpu));
+      snapshots[i] = dcpu_snapshot (cpu);
+      if (NULL == snapshots[i])
+	{
+	  fprintf (stderr, "Could not allocate a snapshot\n");
+	  exit (EXIT_FAILURE);
+	}
+      run (engine, cpu, jit, CHECK_BUDGET);
+    }
+
+  // the last one, back to the first one, then forward again
+  for (i = 0; i < 3; ++i)
+    {
+      unsigned int s = 1 == i ? 0 : 1;
+
+      dcpu_restore (cpu, snapshots[s]);
+      if ( ! same_state (cpu, &expected[s]))
+	{
+	  fprintf (stderr
+		   , "%s, seed %u: restoring snapshot %u gave another state\n"
+		   , engine_names[engine]
+		   , seed
+		   , s);
+	  ++mismatches;
+	}
+
+      // its own writes are undone by the next restore
+      run (engine, cpu, jit, CHECK_BUDGET);
+    }
+
+  dcpu_snapshot_free (snapshots[0]);
+  dcpu_snapshot_free (snapshots[1]);
+  dcpu_snapshot_detach (cpu);
+  decode_cache_destroy (cpu->decode_cache);
+  cpu->decode_cache = NULL;
+
+  return mismatches;
+}
+
+
+int
+main (void)
+{
+  unsigned int mismatches = 0;
+  uint32_t seed = 0;
+  engine_t engine = ENGINE_REFERENCE;
+
+  dcpu_t * cpu = calloc (1, sizeof(dcpu_t));
+  dcpu_t * expected = calloc (2, sizeof(dcpu_t));
+  // NULL if the host has no jit, run_jit is then the threaded engine
+  jit_t * jit = jit_create ();
+
+  if (NULL == cpu || NULL == expected)
+    {
+      return EXIT_FAILURE;
+    }
+
+  for (engine = ENGINE_REFERENCE; engine < ENGINE_COUNT; ++engine)
+    {
+      for (seed = 1; seed <= CHECK_SEEDS; ++seed)
+	{
+	  if (ENGINE_JIT == engine)
+	    {
+	      jit_flush (jit);
+	    }
+	  mismatches += check (engine, seed, jit, cpu, expected);
+	}
+    }
+
+  jit_destroy (jit);
+  free (expected);
+  free (cpu);
+
+  printf ("%u mismatches over %u runs\n", mismatches, ENGINE_COUNT * CHECK_SEEDS);
+
+  return 0 == mismatches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "threaded.h"
+#include "predecode.h"
+
+
+// resolves an encoded operand to the word it designates,
+// literals being copied to a scratch word (so that writes are ignored)
+static inline word *
+operand (dcpu_t * cpu, unsigned char value, word * literal)
+{
+  switch (value)
+    {
+    case 0x00 ... 0x07:
+      return &cpu->registers[value];
+
+    case 0x08 ... 0x0f:
+      return &cpu->ram[cpu->registers[value - 0x08]];
+
+    case 0x10 ... 0x17:
+      {
+	word next = cpu->ram[cpu->pc++];
+	return &cpu->ram[(word) (cpu->registers[value - 0x10] + next)];
+      }
+
+    case 0x18:
+      return &cpu->ram[cpu->sp++];
+
+    case 0x19:
+      return &cpu->ram[cpu->sp];
+
+    case 0x1a:
+      return &cpu->ram[--cpu->sp];
+
+    case 0x1b:
+      return &cpu->sp;
+
+    case 0x1c:
+      return &cpu->pc;
+
+    case 0x1d:
+      return &cpu->o;
+
+    case 0x1e:
+      return &cpu->ram[cpu->ram[cpu->pc++]];
+
+    case 0x1f:
+      *literal = cpu->ram[cpu->pc++];
+      return literal;
+
+    default:
+      *literal = value - 0x20;
+      return literal;
+    }
+}
+
+
+unsigned long long
+run_threaded (dcpu_t * cpu, unsigned long long budget)
+{
+  static void * const dispatch [] = {
+    &&op_basic, &&op_set, &&op_add, &&op_sub
+    , &&op_mul, &&op_div, &&op_mod, &&op_shl
+    , &&op_shr, &&op_and, &&op_bor, &&op_xor
+    , &&op_ife, &&op_ifn, &&op_ifg, &&op_ifb
+  };
+
+  unsigned long long executed = 0;
+
+  word instruction = 0;
+  word literal_a = 0;
+  word literal_b = 0;
+  word * a = NULL;
+  word * b = NULL;
+  uint32_t value_a = 0;
+  uint32_t value_b = 0;
+
+  // every handler ends with its own copy of the dispatch,
+  // which gives the branch predictor one indirect jump per handler
+#define DISPATCH()						\
+  do								\
+    {								\
+      if (executed == budget)					\
+	{							\
+	  goto done;						\
+	}							\
+      ++executed;						\
+      instruction = cpu->ram[cpu->pc++];			\
+      goto *dispatch[instruction & DCPU_INST_OPCODE_MASK];	\
+    }								\
+  while (0)
+
+  // we want to preserve the eval order, value 'a' then 'b'
+#define OPERANDS()							\
+  do									\
+    {									\
+      a = operand (cpu, (instruction & DCPU_INST_A_MASK) >> 4, &literal_a); \
+      b = operand (cpu, (instruction & DCPU_INST_B_MASK) >> 10, &literal_b); \
+      value_a = *a;							\
+      value_b = *b;							\
+    }									\
+  while (0)
+
+  // ram writes are tracked for the snapshots
+#define STORE(value)							\
+  do									\
+    {									\
+      *a = (value);							\
+      if ((uintptr_t) a - (uintptr_t) cpu->ram < sizeof(cpu->ram))	\
+	{								\
+	  mark_dirty (cpu, a - cpu->ram);				\
+	}								\
+    }									\
+  while (0)
+
+#define SKIP_IF(condition)						\
+  do									\
+    {									\
+      if (condition)							\
+	{								\
+	  cpu->pc += instruction_length (cpu->ram[cpu->pc]);		\
+	}								\
+    }									\
+  while (0)
+
+  DISPATCH ();
+
+ op_basic:
+  if (0x01 == ((instruction & DCPU_INST_A_MASK) >> 4))
+    {
+      a = operand (cpu, (instruction & DCPU_INST_B_MASK) >> 10, &literal_a);
+      cpu->ram[--cpu->sp] = cpu->pc;
+      mark_dirty (cpu, cpu->sp);
+      cpu->pc = *a;
+    }
+  DISPATCH ();
+
+ op_set:
+  a = operand (cpu, (instruction & DCPU_INST_A_MASK) >> 4, &literal_a);
+  b = operand (cpu, (instruction & DCPU_INST_B_MASK) >> 10, &literal_b);
+  STORE (*b);
+  DISPATCH ();
+
+ op_add:
+  OPERANDS ();
+  STORE (value_a + value_b);
+  cpu->o = (value_a + value_b) >> 16;
+  DISPATCH ();
+
+ op_sub:
+  OPERANDS ();
+  STORE (value_a - value_b);
+  cpu->o = value_a < value_b ? 0xFFFF : 0x0000;
+  DISPATCH ();
+
+ op_mul:
+  OPERANDS ();
+  STORE (value_a * value_b);
+  cpu->o = (value_a * value_b) >> 16;
+  DISPATCH ();
+
+ op_div:
+  OPERANDS ();
+  if (0 != value_b)
+    {
+      STORE (value_a / value_b);
+      cpu->o = ((value_a << 16) / value_b) & 0xffff;
+    }
+  else
+    {
+      STORE (0);
+      cpu->o = 0;
+    }
+  DISPATCH ();
+
+ op_mod:
+  OPERANDS ();
+  STORE (0 != value_b ? value_a % value_b : 0);
+  DISPATCH ();
+
+ op_shl:
+  OPERANDS ();
+  value_a = value_b < 32 ? value_a << value_b : 0;
+  STORE (value_a);
+  cpu->o = (value_a >> 16) & 0xffff;
+  DISPATCH ();
+
+ op_shr:
+  OPERANDS ();
+  if (value_b < 32)
+    {
+      STORE (value_a >> value_b);
+      cpu->o = ((value_a << 16) >> value_b) & 0xffff;
+    }
+  else
+    {
+      STORE (0);
+      cpu->o = 0;
+    }
+  DISPATCH ();
+
+ op_and:
+  OPERANDS ();
+  STORE (value_a & value_b);
+  DISPATCH ();
+
+ op_bor:
+  OPERANDS ();
+  STORE (value_a | value_b);
+  DISPATCH ();
+
+ op_xor:
+  OPERANDS ();
+  STORE (value_a ^ value_b);
+  DISPATCH ();
+
+ op_ife:
+  OPERANDS ();
+  SKIP_IF (value_a != value_b);
+  DISPATCH ();
+
+ op_ifn:
+  OPERANDS ();
+  SKIP_IF (value_a == value_b);
+  DISPATCH ();
+
+ op_ifg:
+  OPERANDS ();
+  SKIP_IF (value_a <= value_b);
+  DISPATCH ();
+
+ op_ifb:
+  OPERANDS ();
+  SKIP_IF (0 == (value_a & value_b));
+  DISPATCH ();
+
+#undef SKIP_IF
+#undef STORE
+#undef OPERANDS
+#undef DISPATCH
+
+ done:
+  // ram has been written behind the back of the cache
+  if (NULL != cpu->decode_cache)
+    {
+      decode_cache_flush (cpu->decode_cache);
+    }
+
+  return executed;
+}
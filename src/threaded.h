@@ -0,0 +1,15 @@
+#if ! defined (THREADED_H)
+#define THREADED_H
+
+#include "dcpu.h"
+
+/**
+ * Executes the program in ram from cpu->pc with a computed goto
+ * dispatch, operands being read straight from the cpu state.
+ *
+ * @param budget maximum number of instructions to execute
+ * @return the number of executed instructions
+ */
+unsigned long long run_threaded (dcpu_t * cpu, unsigned long long budget);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+
+// records per thread buffer
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct trace_buffer_t
+{
+  unsigned int count;
+  trace_record_t records [TRACE_BUFFER_RECORDS];
+
+} trace_buffer_t;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static FILE * sink = NULL;
+
+static __thread trace_buffer_t * buffer = NULL;
+
+
+static void
+write_buffer (trace_buffer_t * b)
+{
+  if (NULL != sink && 0 != b->count)
+    {
+      // a single call, the buffers of several threads do not interleave
+      fwrite (b->records, sizeof(trace_record_t), b->count, sink);
+    }
+  b->count = 0;
+}
+
+// at thread exit
+static void
+release_buffer (void * data)
+{
+  write_buffer (data);
+  free (data);
+}
+
+static void
+flush_at_exit (void)
+{
+  trace_flush ();
+  if (NULL != sink)
+    {
+      fflush (sink);
+    }
+}
+
+static void
+open_sink (void)
+{
+  const char * path = getenv ("DCPU_TRACE_FILE");
+
+  sink = fopen (NULL == path ? "dcpu.trace" : path, "wb");
+  if (NULL == sink)
+    {
+      fprintf (stderr, "Could not open the trace file, tracing is disabled\n");
+    }
+
+  pthread_key_create (&key, release_buffer);
+  atexit (flush_at_exit);
+}
+
+
+void
+trace_record (trace_event_t event
+	      , const dcpu_t * cpu
+	      , TaggedValueType type
+	      , word location
+	      , word value)
+{
+  trace_record_t * record = NULL;
+
+  if (__builtin_expect (NULL == buffer, 0))
+    {
+      pthread_once (&once, open_sink);
+
+      buffer = malloc (sizeof(trace_buffer_t));
+      if (NULL == buffer)
+	{
+	  return;
+	}
+      buffer->count = 0;
+      pthread_setspecific (key, buffer);
+    }
+
+  record = &buffer->records[buffer->count];
+  record->event = event;
+  record->type = type;
+  record->pc = cpu->pc;
+  record->location = location;
+  record->value = value;
+
+  if (++buffer->count == TRACE_BUFFER_RECORDS)
+    {
+      write_buffer (buffer);
+    }
+}
+
+
+void
+trace_flush (void)
+{
+  if (NULL != buffer)
+    {
+      write_buffer (buffer);
+    }
+}
@@ -0,0 +1,75 @@
+#if ! defined (TRACE_H)
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "dcpu.h"
+
+// interpreter tracing, its level being chosen at configure time with
+// --enable-trace=LEVEL: the trace points of the levels above it compile
+// to nothing
+
+#define TRACE_LEVEL_NONE 0
+// register and ram writes (assign_to_tagged_value)
+#define TRACE_LEVEL_WRITE 1
+// decoded operands (decode_value, and resolve_operand for the
+// predecode cache, whose superinstructions are then disabled), on top
+// of the writes
+#define TRACE_LEVEL_DECODE 2
+
+#if ! defined (DCPU_TRACE_LEVEL)
+#define DCPU_TRACE_LEVEL TRACE_LEVEL_NONE
+#endif
+
+typedef enum trace_event_t
+  {
+    TRACE_EVENT_WRITE = 1,
+    TRACE_EVENT_DECODE = 2
+
+  } trace_event_t;
+
+// what is written to the sink, in host byte order
+typedef struct trace_record_t
+{
+  uint8_t event;
+  // TaggedValueType of the operand
+  uint8_t type;
+  word pc;
+  // written: ram address or dcpu_t offset, decoded: operand code
+  word location;
+  // written: new value, decoded: ram address or dcpu_t offset
+  word value;
+
+} trace_record_t;
+
+/**
+ * Appends a record to the buffer of the calling thread, written to the
+ * file named by $DCPU_TRACE_FILE (dcpu.trace by default) when full, at
+ * thread exit or at exit.
+ */
+void trace_record (trace_event_t event
+		   , const dcpu_t * cpu
+		   , TaggedValueType type
+		   , word location
+		   , word value);
+
+/**
+ * Writes the records buffered by the calling thread.
+ */
+void trace_flush (void);
+
+#if DCPU_TRACE_LEVEL >= TRACE_LEVEL_WRITE
+#define TRACE_WRITE(cpu, tvalue, new_value)				\
+  trace_record (TRACE_EVENT_WRITE, cpu, (tvalue).type, (tvalue).value, new_value)
+#else
+#define TRACE_WRITE(cpu, tvalue, new_value) ((void) 0)
+#endif
+
+#if DCPU_TRACE_LEVEL >= TRACE_LEVEL_DECODE
+#define TRACE_DECODE(cpu, code, tvalue)					\
+  trace_record (TRACE_EVENT_DECODE, cpu, (tvalue).type, code, (tvalue).value)
+#else
+#define TRACE_DECODE(cpu, code, tvalue) ((void) 0)
+#endif
+
+#endif
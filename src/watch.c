@@ -0,0 +1,48 @@
+#include <stdlib.h>
+
+#include "watch.h"
+
+
+watch_t *
+watch_create (void)
+{
+  return calloc (1, sizeof(watch_t));
+}
+
+
+void
+watch_destroy (watch_t * watch)
+{
+  free (watch);
+}
+
+
+void
+watch_set (watch_t * watch
+	   , word address
+	   , unsigned int length
+	   , bool reads
+	   , bool set)
+{
+  uint64_t * bits = reads ? watch->reads : watch->writes;
+  size_t end = (size_t) address + length;
+  size_t i = 0;
+
+  if (end > RAM_SIZE)
+    {
+      end = RAM_SIZE;
+    }
+
+  for (i = address; i < end; ++i)
+    {
+      uint64_t mask = (uint64_t) 1 << (i & 63);
+
+      if (set == (0 != (bits[i >> 6] & mask)))
+	{
+	  continue;
+	}
+
+      bits[i >> 6] ^= mask;
+      watch->count += set ? 1 : -1;
+    }
+}
@@ -0,0 +1,70 @@
+#if ! defined (WATCH_H)
+#define WATCH_H
+
+#include "dcpu.h"
+
+// watchpoints: a bit per ram address for the writes and another for
+// the reads, tested on the data accesses of assign_to_tagged_value and
+// value_from_tagged_value when cpu->watch is set
+typedef struct watch_t
+{
+  uint64_t writes [RAM_SIZE / 64];
+  uint64_t reads [RAM_SIZE / 64];
+
+  // bits set in both
+  unsigned int count;
+
+  // the first watched access since the last watch_clear_hit
+  bool hit;
+  bool hit_read;
+  word hit_address;
+  // the value read or written
+  word hit_value;
+
+} watch_t;
+
+/**
+ * @return a watch with no watchpoint or NULL if it could not be
+ * allocated
+ */
+watch_t * watch_create (void);
+
+void watch_destroy (watch_t * watch);
+
+/**
+ * Sets or clears the watchpoints of address to address + length - 1,
+ * the range stopping at the end of the ram.
+ *
+ * @param reads the read watchpoints rather than the write ones
+ */
+void watch_set (watch_t * watch
+		, word address
+		, unsigned int length
+		, bool reads
+		, bool set);
+
+static inline void
+watch_clear_hit (watch_t * watch)
+{
+  watch->hit = false;
+}
+
+/**
+ * Records a hit if address is watched for this kind of access.
+ */
+static inline void
+watch_access (watch_t * watch, word address, word value, bool read)
+{
+  const uint64_t * bits = read ? watch->reads : watch->writes;
+
+  if (__builtin_expect ((bits[address >> 6] >> (address & 63)) & 1, 0)
+      && ! watch->hit)
+    {
+      watch->hit = true;
+      watch->hit_read = read;
+      watch->hit_address = address;
+      watch->hit_value = value;
+    }
+}
+
+#endif